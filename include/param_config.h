@@ -22,6 +22,49 @@
 #define PARAMID_COLLECTOR_RUN               201
 #define PARAMID_COLLECTOR_VERBOSE           202
 
+#define PARAMID_SNIFFER_RX                  210
+#define PARAMID_SNIFFER_ACCEPTED            211
+#define PARAMID_SNIFFER_DROPPED             212
+#define PARAMID_SNIFFER_CRC_ERR             213
+#define PARAMID_SNIFFER_UNKNOWN             214
+#define PARAMID_SNIFFER_MPACK_ERR           215
+#define PARAMID_SNIFFER_SAMPLES             216
+#define PARAMID_SNIFFER_SAMPLE_FULL         217
+#define PARAMID_SNIFFER_HK_PACKETS          218
+#define PARAMID_SNIFFER_HK_NO_EPOCH         219
+#define PARAMID_SNIFFER_PROM_SCRAPES        220
+#define PARAMID_SNIFFER_PROM_SERIES         221
+#define PARAMID_SNIFFER_PROM_FULL           222
+#define PARAMID_SNIFFER_VM_PUSHES           223
+#define PARAMID_SNIFFER_VM_PUSH_ERR         224
+#define PARAMID_SNIFFER_VM_FULL             225
+#define PARAMID_SNIFFER_FILTERED            226
+#define PARAMID_SNIFFER_RW_PUSHES           227
+#define PARAMID_SNIFFER_RW_PUSH_ERR         228
+#define PARAMID_SNIFFER_RW_FULL             229
+
+#define PARAMID_SNIFFER_LAT_DECODE          230
+#define PARAMID_SNIFFER_LAT_HK              231
+#define PARAMID_SNIFFER_LAT_ARCHIVE         232
+#define PARAMID_SNIFFER_LAT_VM              233
+#define PARAMID_SNIFFER_LAT_PROMETHEUS      234
+#define PARAMID_SNIFFER_LAT_LOGFILE         235
+#define PARAMID_SNIFFER_LAT_VTS             236
+#define PARAMID_SNIFFER_LAT_SCRAPE          237
+#define PARAMID_SNIFFER_LAT_VM_PUSH         238
+#define PARAMID_SNIFFER_LAT_SUM             239
+#define PARAMID_SNIFFER_VM_LINES            240
+#define PARAMID_SNIFFER_VM_INFLIGHT         241
+#define PARAMID_SNIFFER_VM_BATCH_KB         242
+#define PARAMID_SNIFFER_LAT_VM_COMPRESS     243
+#define PARAMID_SNIFFER_VM_RAW_KB           244
+#define PARAMID_SNIFFER_VM_SENT_KB          245
+#define PARAMID_SNIFFER_LAT_RW_PUSH         246
+#define PARAMID_SNIFFER_VM_SPOOLED          247
+#define PARAMID_SNIFFER_VM_REPLAYED         248
+#define PARAMID_SNIFFER_VM_SPOOL_DROP       249
+#define PARAMID_SNIFFER_VM_SPOOL_KB         250
+
 
 #define PARAMID_CRYPTO_KEY_PUBLIC           150
 #define PARAMID_CRYPTO_KEY_SECRET           151
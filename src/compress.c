@@ -0,0 +1,265 @@
+/*
+ * compress.c
+ *
+ * Input is fed to the compressor in chunks and output is grown as it is
+ * produced, so a large body is not held twice at full size while being
+ * compressed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef CSH_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CSH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+#define COMPRESS_CHUNK  (64 * 1024)
+
+struct compress {
+    compress_type_e type;
+#ifdef CSH_HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef CSH_HAVE_ZSTD
+    ZSTD_CCtx * zstd;
+#endif
+};
+
+int compress_available(compress_type_e type) {
+    switch (type) {
+        case COMPRESS_NONE:
+            return 1;
+#ifdef CSH_HAVE_ZLIB
+        case COMPRESS_GZIP:
+            return 1;
+#endif
+#ifdef CSH_HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char * compress_name(compress_type_e type) {
+    switch (type) {
+        case COMPRESS_GZIP:
+            return "gzip";
+        case COMPRESS_ZSTD:
+            return "zstd";
+        default:
+            return "identity";
+    }
+}
+
+compress_t * compress_create(compress_type_e type, int level) {
+
+    if (type == COMPRESS_NONE || !compress_available(type)) {
+        return NULL;
+    }
+
+    compress_t * compress = calloc(1, sizeof(compress_t));
+    if (compress == NULL) {
+        return NULL;
+    }
+    compress->type = type;
+
+#ifdef CSH_HAVE_ZLIB
+    if (type == COMPRESS_GZIP) {
+        /* 16 + MAX_WBITS selects the gzip wrapper */
+        if (deflateInit2(&compress->zs, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(compress);
+            return NULL;
+        }
+    }
+#endif
+#ifdef CSH_HAVE_ZSTD
+    if (type == COMPRESS_ZSTD) {
+        compress->zstd = ZSTD_createCCtx();
+        if (compress->zstd == NULL) {
+            free(compress);
+            return NULL;
+        }
+        ZSTD_CCtx_setParameter(compress->zstd, ZSTD_c_compressionLevel, level ? level : ZSTD_CLEVEL_DEFAULT);
+    }
+#endif
+
+    return compress;
+
+}
+
+void compress_destroy(compress_t * compress) {
+
+    if (compress == NULL) {
+        return;
+    }
+#ifdef CSH_HAVE_ZLIB
+    if (compress->type == COMPRESS_GZIP) {
+        deflateEnd(&compress->zs);
+    }
+#endif
+#ifdef CSH_HAVE_ZSTD
+    if (compress->type == COMPRESS_ZSTD) {
+        ZSTD_freeCCtx(compress->zstd);
+    }
+#endif
+    free(compress);
+
+}
+
+/* Makes room for at least one more chunk of output */
+static int compress_grow(char ** out, size_t * size, size_t used) {
+
+    if (*size - used >= COMPRESS_CHUNK) {
+        return 0;
+    }
+    size_t grown_size = *size ? *size * 2 : 4 * COMPRESS_CHUNK;
+    while (grown_size - used < COMPRESS_CHUNK) {
+        grown_size *= 2;
+    }
+    char * grown = realloc(*out, grown_size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *out = grown;
+    *size = grown_size;
+    return 0;
+
+}
+
+#ifdef CSH_HAVE_ZLIB
+static long compress_gzip(compress_t * compress, const void * in, size_t len, char ** out, size_t * size) {
+
+    z_stream * zs = &compress->zs;
+    deflateReset(zs);
+
+    const unsigned char * next = in;
+    size_t left = len;
+    size_t used = 0;
+    int res;
+
+    do {
+        if (zs->avail_in == 0) {
+            size_t chunk = left < COMPRESS_CHUNK ? left : COMPRESS_CHUNK;
+            zs->next_in = (unsigned char *) next;
+            zs->avail_in = chunk;
+            next += chunk;
+            left -= chunk;
+        }
+        if (compress_grow(out, size, used) < 0) {
+            return -1;
+        }
+        zs->next_out = (unsigned char *) *out + used;
+        zs->avail_out = *size - used;
+        res = deflate(zs, left == 0 ? Z_FINISH : Z_NO_FLUSH);
+        used = *size - zs->avail_out;
+        if (res == Z_STREAM_ERROR) {
+            return -1;
+        }
+    } while (res != Z_STREAM_END);
+
+    return used;
+
+}
+#endif
+
+#ifdef CSH_HAVE_ZSTD
+static long compress_zstd(compress_t * compress, const void * in, size_t len, char ** out, size_t * size) {
+
+    ZSTD_CCtx_reset(compress->zstd, ZSTD_reset_session_only);
+    ZSTD_CCtx_setPledgedSrcSize(compress->zstd, len);
+
+    ZSTD_inBuffer input = {in, 0, 0};
+    ZSTD_outBuffer output = {NULL, 0, 0};
+    size_t remaining;
+
+    do {
+        if (input.pos == input.size && input.size < len) {
+            input.size = len - input.size < COMPRESS_CHUNK ? len : input.size + COMPRESS_CHUNK;
+        }
+        if (compress_grow(out, size, output.pos) < 0) {
+            return -1;
+        }
+        output.dst = *out;
+        output.size = *size;
+        remaining = ZSTD_compressStream2(compress->zstd, &output, &input, input.size == len ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining)) {
+            return -1;
+        }
+    } while (input.size < len || remaining != 0);
+
+    return output.pos;
+
+}
+#endif
+
+long compress_run(compress_t * compress, const void * in, size_t len, char ** out, size_t * size) {
+
+    switch (compress->type) {
+#ifdef CSH_HAVE_ZLIB
+        case COMPRESS_GZIP:
+            return compress_gzip(compress, in, len, out, size);
+#endif
+#ifdef CSH_HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            return compress_zstd(compress, in, len, out, size);
+#endif
+        default:
+            return -1;
+    }
+
+}
+
+/* Returns 1 if coding is listed and not refused with q=0 */
+static int compress_offered(const char * accept, const char * coding) {
+
+    size_t coding_len = strlen(coding);
+    const char * token = accept;
+
+    while (*token) {
+        while (*token == ' ' || *token == ',') {
+            token++;
+        }
+        const char * end = token + strcspn(token, ",");
+        const char * params = memchr(token, ';', end - token);
+        const char * name_end = params ? params : end;
+        while (name_end > token && name_end[-1] == ' ') {
+            name_end--;
+        }
+
+        if ((size_t) (name_end - token) == coding_len && strncasecmp(token, coding, coding_len) == 0) {
+            const char * q = params ? strstr(params, "q=") : NULL;
+            if (q && q < end && atof(q + 2) <= 0) {
+                return 0;
+            }
+            return 1;
+        }
+        token = end;
+    }
+
+    return 0;
+
+}
+
+compress_type_e compress_negotiate(const char * accept_encoding) {
+
+    if (accept_encoding == NULL) {
+        return COMPRESS_NONE;
+    }
+    if (compress_available(COMPRESS_ZSTD) && compress_offered(accept_encoding, "zstd")) {
+        return COMPRESS_ZSTD;
+    }
+    if (compress_available(COMPRESS_GZIP) && compress_offered(accept_encoding, "gzip")) {
+        return COMPRESS_GZIP;
+    }
+    return COMPRESS_NONE;
+
+}
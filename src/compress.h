@@ -0,0 +1,37 @@
+/*
+ * compress.h
+ *
+ * gzip and zstd compression of HTTP bodies. Both are optional at build
+ * time (CSH_HAVE_ZLIB, CSH_HAVE_ZSTD); compress_available() tells which
+ * ones this build supports.
+ */
+
+#ifndef SRC_COMPRESS_H_
+#define SRC_COMPRESS_H_
+
+#include <stddef.h>
+
+typedef enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+} compress_type_e;
+
+typedef struct compress compress_t;
+
+int compress_available(compress_type_e type);
+
+/* Content-Encoding name, "identity" for COMPRESS_NONE */
+const char * compress_name(compress_type_e type);
+
+/* level 0 = the library default. The context is reused between calls */
+compress_t * compress_create(compress_type_e type, int level);
+void compress_destroy(compress_t * compress);
+
+/* Compresses in into *out (grown with realloc as needed). Returns the compressed length, or -1 */
+long compress_run(compress_t * compress, const void * in, size_t len, char ** out, size_t * size);
+
+/* Picks the best encoding offered in an Accept-Encoding header, zstd before gzip */
+compress_type_e compress_negotiate(const char * accept_encoding);
+
+#endif /* SRC_COMPRESS_H_ */
@@ -0,0 +1,157 @@
+/*
+ * csp_capture.c
+ *
+ * Writer and sequential reader for CSP captures.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "csp_capture.h"
+
+static int csp_capture_check(FILE * file, const char * path, unsigned int * csp_version) {
+
+    csp_capture_file_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CSP_CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+        printf("%s is not a CSP capture\n", path);
+        return -1;
+    }
+    if (header.version != CSP_CAPTURE_VERSION) {
+        printf("%s has unsupported capture version %u\n", path, header.version);
+        return -1;
+    }
+
+    if (csp_version) {
+        *csp_version = header.csp_version;
+    }
+    return 0;
+
+}
+
+log_writer_t * csp_capture_create(const char * path, unsigned int csp_version) {
+
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size > 0) {
+        /* Appending to an existing capture, frames must use the same header layout */
+        FILE * file = fopen(path, "rb");
+        unsigned int existing;
+        if (file == NULL || csp_capture_check(file, path, &existing) < 0) {
+            if (file)
+                fclose(file);
+            return NULL;
+        }
+        fclose(file);
+        if (existing != csp_version) {
+            printf("%s holds CSP version %u frames, not %u\n", path, existing, csp_version);
+            return NULL;
+        }
+    } else {
+        csp_capture_file_t header = {
+            .magic = CSP_CAPTURE_MAGIC,
+            .version = CSP_CAPTURE_VERSION,
+            .csp_version = csp_version,
+        };
+        FILE * file = fopen(path, "wb");
+        if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1) {
+            printf("Cannot create capture %s\n", path);
+            if (file)
+                fclose(file);
+            return NULL;
+        }
+        fclose(file);
+    }
+
+    log_writer_conf_t conf = {
+        .path = path,
+    };
+    return log_writer_open(&conf);
+
+}
+
+int csp_capture_add(log_writer_t * capture, uint64_t time_ns, const void * frame, size_t len) {
+
+    if (len > CSP_CAPTURE_FRAME_MAX) {
+        return -1;
+    }
+
+    /* One call, so a record is never split between writer buffers */
+    csp_capture_record_t header = {
+        .length = len,
+        .time_ns = time_ns,
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = (void *) frame, .iov_len = len},
+    };
+
+    return log_writer_writev(capture, iov, 2);
+
+}
+
+FILE * csp_capture_open(const char * path, unsigned int * csp_version) {
+
+    FILE * file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open %s\n", path);
+        return NULL;
+    }
+
+    if (csp_capture_check(file, path, csp_version) < 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+
+}
+
+int csp_capture_next(FILE * file, csp_capture_record_t * record, void * frame, size_t size) {
+
+    if (fread(record, sizeof(*record), 1, file) != 1) {
+        return 0;
+    }
+
+    if (record->length > CSP_CAPTURE_FRAME_MAX || record->length > size) {
+        return -1;
+    }
+
+    if (fread(frame, 1, record->length, file) != record->length) {
+        /* Truncated by a crash or a capture still being written */
+        return 0;
+    }
+
+    return 1;
+
+}
+
+size_t csp_capture_header(unsigned int csp_version, const uint8_t * frame, size_t len, csp_capture_header_t * header) {
+
+    if (csp_version == 2) {
+        if (len < 6)
+            return 0;
+        uint64_t id = 0;
+        for (int i = 0; i < 6; i++)
+            id = (id << 8) | frame[i];
+        header->pri = (id >> 46) & 0x3;
+        header->dst = (id >> 32) & 0x3FFF;
+        header->src = (id >> 18) & 0x3FFF;
+        header->dport = (id >> 12) & 0x3F;
+        header->sport = (id >> 6) & 0x3F;
+        header->flags = id & 0x3F;
+        return 6;
+    }
+
+    if (len < 4)
+        return 0;
+    uint32_t id = (uint32_t) frame[0] << 24 | frame[1] << 16 | frame[2] << 8 | frame[3];
+    header->pri = (id >> 30) & 0x3;
+    header->src = (id >> 25) & 0x1F;
+    header->dst = (id >> 20) & 0x1F;
+    header->dport = (id >> 14) & 0x3F;
+    header->sport = (id >> 8) & 0x3F;
+    header->flags = id & 0xFF;
+    return 4;
+
+}
@@ -0,0 +1,42 @@
+/*
+ * csp_capture.h
+ *
+ * Writer and sequential reader for CSP captures (csp_capture_format.h).
+ * The writer appends through log_writer.c, so recording costs one memcpy
+ * per packet on the calling thread.
+ */
+
+#ifndef SRC_CSP_CAPTURE_H_
+#define SRC_CSP_CAPTURE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "csp_capture_format.h"
+#include "log_writer.h"
+
+/* Opens path for appending, writes the file header if the file is new */
+log_writer_t * csp_capture_create(const char * path, unsigned int csp_version);
+int csp_capture_add(log_writer_t * capture, uint64_t time_ns, const void * frame, size_t len);
+
+/* Opens path for reading, returns the stream positioned at the first record */
+FILE * csp_capture_open(const char * path, unsigned int * csp_version);
+
+/* Reads the next record and its frame, returns 1 on success, 0 at end of file, -1 on a corrupt record */
+int csp_capture_next(FILE * file, csp_capture_record_t * record, void * frame, size_t size);
+
+/* CSP header fields of a frame, without depending on libcsp */
+typedef struct {
+    unsigned int pri;
+    unsigned int src;
+    unsigned int dst;
+    unsigned int dport;
+    unsigned int sport;
+    unsigned int flags;
+} csp_capture_header_t;
+
+/* Decodes the wire header of a version 1 or 2 frame. Returns its size, or 0 if the frame is too short */
+size_t csp_capture_header(unsigned int csp_version, const uint8_t * frame, size_t len, csp_capture_header_t * header);
+
+#endif /* SRC_CSP_CAPTURE_H_ */
@@ -0,0 +1,203 @@
+/*
+ * csp_capture_dump.c
+ *
+ * Standalone reader for CSP captures written by zmqproxy -f or "sniffer
+ * record start". Prints one line per packet with its decoded CSP header, or
+ * converts the capture to pcapng for Wireshark.
+ *
+ * CSP has no registered pcap link type, so frames are exported with
+ * LINKTYPE_USER0 by default and the interface description names the CSP
+ * header version. Map the link type to a dissector in Wireshark under
+ * Preferences > Protocols > DLT_USER.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "csp_capture.h"
+
+#define LINKTYPE_USER0          147
+
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BYTE_ORDER       0x1A2B3C4D
+#define PCAPNG_OPT_END          0
+#define PCAPNG_OPT_IF_NAME      2
+#define PCAPNG_OPT_IF_DESC      3
+#define PCAPNG_OPT_IF_TSRESOL   9
+
+static int opt_linktype = LINKTYPE_USER0;
+
+void usage(void) {
+    printf("usage: csp_capture_dump [options] CAPTURE\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" -w FILE\tWrite the packets to FILE as pcapng instead of printing them\n");
+    printf(" -l TYPE\tpcapng link type (default = %d, LINKTYPE_USER0)\n", LINKTYPE_USER0);
+}
+
+static void print_record(unsigned int csp_version, const csp_capture_record_t * record, const uint8_t * frame) {
+
+    time_t sec = record->time_ns / 1000000000;
+    struct tm tm;
+    char when[32];
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+    csp_capture_header_t id;
+    size_t header = csp_capture_header(csp_version, frame, record->length, &id);
+    if (header == 0) {
+        printf("%s.%09"PRIu64" short frame of %"PRIu32" bytes\n", when, record->time_ns % 1000000000, record->length);
+        return;
+    }
+    printf("%s.%09"PRIu64" Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %zu\n",
+           when, record->time_ns % 1000000000, id.src, id.dst, id.dport, id.sport, id.pri, id.flags, record->length - header);
+
+}
+
+/* Appends an option, padded to 32 bits, to buf at *len */
+static void pcapng_option(uint8_t * buf, size_t * len, uint16_t code, const void * value, uint16_t size) {
+    memcpy(buf + *len, &code, 2);
+    memcpy(buf + *len + 2, &size, 2);
+    memcpy(buf + *len + 4, value, size);
+    memset(buf + *len + 4 + size, 0, (4 - size % 4) % 4);
+    *len += 4 + size + (4 - size % 4) % 4;
+}
+
+/* Writes a block of type with body, adding the type and both length fields */
+static int pcapng_block(FILE * out, uint32_t type, const uint8_t * body, size_t len) {
+    uint32_t total = 12 + len;
+    return fwrite(&type, 4, 1, out) == 1 && fwrite(&total, 4, 1, out) == 1 &&
+           fwrite(body, 1, len, out) == len && fwrite(&total, 4, 1, out) == 1 ? 0 : -1;
+}
+
+static int pcapng_header(FILE * out, unsigned int csp_version) {
+
+    uint8_t shb[16];
+    uint32_t magic = PCAPNG_BYTE_ORDER;
+    uint16_t major = 1, minor = 0;
+    int64_t section_length = -1;
+    memcpy(shb, &magic, 4);
+    memcpy(shb + 4, &major, 2);
+    memcpy(shb + 6, &minor, 2);
+    memcpy(shb + 8, &section_length, 8);
+    if (pcapng_block(out, PCAPNG_SHB, shb, sizeof(shb)) < 0) {
+        return -1;
+    }
+
+    uint8_t idb[128];
+    size_t len = 0;
+    uint16_t linktype = opt_linktype, reserved = 0;
+    uint32_t snaplen = CSP_CAPTURE_FRAME_MAX;
+    memcpy(idb, &linktype, 2);
+    memcpy(idb + 2, &reserved, 2);
+    memcpy(idb + 4, &snaplen, 4);
+    len = 8;
+
+    char desc[32];
+    snprintf(desc, sizeof(desc), "CSP v%u", csp_version);
+    uint8_t tsresol = 9;    // Nanoseconds
+    uint32_t end = 0;
+    pcapng_option(idb, &len, PCAPNG_OPT_IF_NAME, "csp", 3);
+    pcapng_option(idb, &len, PCAPNG_OPT_IF_DESC, desc, strlen(desc));
+    pcapng_option(idb, &len, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+    pcapng_option(idb, &len, PCAPNG_OPT_END, &end, 0);
+    return pcapng_block(out, PCAPNG_IDB, idb, len);
+
+}
+
+static int pcapng_packet(FILE * out, const csp_capture_record_t * record, const uint8_t * frame) {
+
+    uint8_t epb[20 + CSP_CAPTURE_FRAME_MAX + 3];
+    uint32_t fields[5] = {
+        0,                                  // Interface
+        record->time_ns >> 32,
+        record->time_ns & 0xFFFFFFFF,
+        record->length,                     // Captured
+        record->length,                     // On the wire
+    };
+    memcpy(epb, fields, sizeof(fields));
+    memcpy(epb + 20, frame, record->length);
+    size_t pad = (4 - record->length % 4) % 4;
+    memset(epb + 20 + record->length, 0, pad);
+    return pcapng_block(out, PCAPNG_EPB, epb, 20 + record->length + pad);
+
+}
+
+int main(int argc, char ** argv) {
+
+    const char * pcapng_path = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "hw:l:")) != -1) {
+        switch (c) {
+            case 'w':
+                pcapng_path = optarg;
+                break;
+            case 'l':
+                opt_linktype = atoi(optarg);
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int csp_version;
+    FILE * fp = csp_capture_open(argv[optind], &csp_version);
+    if (fp == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    FILE * out = NULL;
+    if (pcapng_path) {
+        out = fopen(pcapng_path, "wb");
+        if (out == NULL || pcapng_header(out, csp_version) < 0) {
+            printf("Cannot write %s\n", pcapng_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    csp_capture_record_t record;
+    uint8_t frame[CSP_CAPTURE_FRAME_MAX];
+    uint64_t packets = 0;
+    int res;
+    while ((res = csp_capture_next(fp, &record, frame, sizeof(frame))) > 0) {
+        packets++;
+        if (out) {
+            if (pcapng_packet(out, &record, frame) < 0) {
+                printf("Cannot write %s\n", pcapng_path);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            print_record(csp_version, &record, frame);
+        }
+    }
+    if (res < 0) {
+        printf("Corrupt record after %"PRIu64" packets\n", packets);
+    }
+
+    if (out) {
+        if (fclose(out) != 0) {
+            printf("Cannot write %s\n", pcapng_path);
+            exit(EXIT_FAILURE);
+        }
+        printf("Wrote %"PRIu64" packets to %s\n", packets, pcapng_path);
+    }
+    fclose(fp);
+
+    return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,43 @@
+/*
+ * csp_capture_format.h
+ *
+ * On-disk layout of CSP packet captures. Written by "sniffer record" in
+ * csh and zmqproxy -f, read by "sniffer replay" and csp_capture_dump. Like
+ * param_archive_format.h this header must not depend on libcsp.
+ *
+ * Capture file:
+ *   csp_capture_file_t
+ *   csp_capture_record_t, frame, csp_capture_record_t, frame, ...
+ *
+ * A frame is the packet as it appears on the wire: the CSP header of the
+ * version given in the file header, followed by the data. Records are
+ * only ever appended, so a capture is read sequentially from the start and
+ * a truncated last record is simply ignored.
+ *
+ * All fields are stored in host byte order (little endian on every
+ * ground station we run).
+ */
+
+#ifndef SRC_CSP_CAPTURE_FORMAT_H_
+#define SRC_CSP_CAPTURE_FORMAT_H_
+
+#include <stdint.h>
+
+#define CSP_CAPTURE_MAGIC           "CSPCAP01"
+#define CSP_CAPTURE_VERSION         1
+#define CSP_CAPTURE_FRAME_MAX       4096
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint16_t version;
+    uint8_t csp_version;    /* Header layout of the frames, 1 or 2 */
+    uint8_t reserved[5];
+} csp_capture_file_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t length;        /* Frame bytes following this record header */
+    uint32_t reserved;
+    uint64_t time_ns;       /* Capture time, ns since the UNIX epoch */
+} csp_capture_record_t;
+
+#endif /* SRC_CSP_CAPTURE_FORMAT_H_ */
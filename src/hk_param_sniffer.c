@@ -19,7 +19,11 @@
 #include <slash/optparse.h>
 
 #include "prometheus.h"
+#include "hk_param_sniffer.h"
 #include "param_sniffer.h"
+#include "param_index.h"
+#include "sniffer_stats.h"
+#include "sniffer_filter.h"
 
 pthread_t hk_param_sniffer_thread;
 
@@ -62,13 +66,14 @@ slash_command_sub(hk, timeoffset, hk_timeoffset, NULL, NULL);
 
 void hk_param_sniffer(csp_packet_t * packet) {
 
-	if (packet->id.sport != 13) {
+	if (packet->id.sport != HK_PARAM_PORT) {
 		return;
 	}
 
 	if (param_sniffer_crc(packet) < 0) {
 		return;
 	}
+	sniffer_stat_inc(SNIFFER_STAT_HK_PACKETS);
 
 	/* Protocol has a header size of 5, and RDP adds 5 bytes to the end of the packet if activated */
 	size_t header_size = 5;
@@ -77,6 +82,9 @@ void hk_param_sniffer(csp_packet_t * packet) {
 	param_queue_init(&queue, &packet->data[header_size], data_len, data_len, PARAM_QUEUE_TYPE_SET, 2);
 	queue.last_node = packet->id.src;
 
+	/* Ids are only tested against the rules this packet matched */
+	uint64_t rules = sniffer_filter_packet(packet->id.src, packet->id.sport);
+
 	mpack_reader_t reader;
 	mpack_reader_init_data(&reader, queue.buffer, queue.used);
 	while(reader.data < reader.end) {
@@ -86,17 +94,25 @@ void hk_param_sniffer(csp_packet_t * packet) {
 		if (node == 0) {
 			node = packet->id.src;
 		}
-		param_t * param = param_list_find_id(node, id);
-		if (param) {
-			*param->timestamp = timestamp;
-			if (*param->timestamp == 0 || local_epoch == 0) {
-				printf("EPOCH or param timestamp is missing for %u:%s, logging is aborted %u %lu\n", param->node, param->name, *param->timestamp, local_epoch);
+		if (!sniffer_filter_param(rules, id)) {
+			mpack_discard(&reader);
+			if (mpack_reader_error(&reader) != mpack_ok) {
+				sniffer_stat_inc(SNIFFER_STAT_MPACK_ERR);
 				break;
 			}
-			if (*param->timestamp != 0) {
-				*param->timestamp += local_epoch;
+			continue;
+		}
+		param_t * param = param_index_find(node, id);
+		if (param) {
+			if (timestamp == 0 || local_epoch == 0) {
+				printf("EPOCH or param timestamp is missing for %u:%s, logging is aborted %lu %lu\n", param->node, param->name, timestamp, local_epoch);
+				sniffer_stat_inc(SNIFFER_STAT_HK_NO_EPOCH);
+				break;
 			}
-			param_sniffer_log(NULL, &queue, param, offset, &reader, *param->timestamp);
+			timestamp += local_epoch;
+			param_sniffer_log(NULL, &queue, param, offset, &reader, timestamp);
+		} else {
+			sniffer_stat_inc(SNIFFER_STAT_UNKNOWN);
 		}
 	}
 }
@@ -11,6 +11,8 @@
 #include <time.h>
 #include <csp/csp.h>
 
+#define HK_PARAM_PORT 13
+
 void hk_epoch(time_t epoch);
 void hk_param_sniffer(csp_packet_t * packet);
 
@@ -0,0 +1,621 @@
+/*
+ * http_server.c
+ *
+ * Epoll loop over non-blocking sockets, level triggered. Every connection
+ * has a fixed request buffer and a growing response buffer. Responses are
+ * queued in full and written out as the socket accepts them, so a client
+ * that reads slowly only delays itself.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "http_server.h"
+
+/* Response buffers above this size are released once sent */
+#define HTTP_OUT_KEEP       (64 * 1024)
+/* Pipelined requests wait while more than this is queued for sending */
+#define HTTP_OUT_PENDING    (1024 * 1024)
+
+typedef struct {
+    int fd;
+    unsigned int slot;
+    time_t last;
+    int close_after;        // Close once the queued response is sent
+    char * in;
+    size_t in_len;
+    size_t in_size;         // Grows past HTTP_REQUEST_MAX for request bodies
+    char * out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_size;
+} http_conn_t;
+
+struct http_server {
+    char name[32];
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t port;
+    http_handler_t handler;
+    void * ctx;
+    size_t body_max;
+
+    int listen_fd;
+    int epoll_fd;
+    volatile int running;
+    pthread_t thread;
+
+    http_conn_t * conns[HTTP_CONN_MAX];
+    unsigned int conn_count;
+};
+
+static time_t http_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static const char * http_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+/* Header lookup within [headers, end), which need not be NUL terminated */
+static int http_header_find(const char * headers, const char * end, const char * name, char * out, size_t size) {
+
+    size_t name_len = strlen(name);
+    const char * line = headers;
+
+    while (line < end) {
+        const char * eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        if ((size_t) (eol - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+            const char * value = line + name_len + 1;
+            const char * value_end = eol;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            size_t len = value_end - value;
+            if (len >= size) {
+                len = size - 1;
+            }
+            memcpy(out, value, len);
+            out[len] = '\0';
+            return 0;
+        }
+
+        line = eol + 1;
+    }
+
+    return -1;
+
+}
+
+int http_request_header(const http_request_t * request, const char * name, char * out, size_t size) {
+    return http_header_find(request->headers, request->headers + strlen(request->headers), name, out, size);
+}
+
+static int http_conn_reserve(http_conn_t * conn, size_t len) {
+
+    if (conn->out_len + len <= conn->out_size) {
+        return 0;
+    }
+
+    size_t size = conn->out_size ? conn->out_size : 4096;
+    while (size < conn->out_len + len) {
+        size *= 2;
+    }
+    char * grown = realloc(conn->out, size);
+    if (grown == NULL) {
+        return -1;
+    }
+    conn->out = grown;
+    conn->out_size = size;
+    return 0;
+
+}
+
+static int http_conn_respond(http_conn_t * conn, const http_response_t * response, int head) {
+
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n"
+        "%s\r\n",
+        response->status, http_reason(response->status),
+        response->content_type ? response->content_type : "text/plain",
+        response->len,
+        conn->close_after ? "close" : "keep-alive",
+        response->headers ? response->headers : "");
+    if (header_len < 0 || (size_t) header_len >= sizeof(header)) {
+        return -1;
+    }
+
+    size_t body_len = head ? 0 : response->len;
+    if (http_conn_reserve(conn, header_len + body_len) < 0) {
+        return -1;
+    }
+
+    memcpy(conn->out + conn->out_len, header, header_len);
+    conn->out_len += header_len;
+    if (body_len) {
+        memcpy(conn->out + conn->out_len, response->body, body_len);
+        conn->out_len += body_len;
+    }
+    return 0;
+
+}
+
+static void http_conn_error(http_conn_t * conn, int status) {
+
+    http_response_t response = {
+        .status = status,
+        .body = http_reason(status),
+        .len = strlen(http_reason(status)),
+    };
+    conn->close_after = 1;
+    http_conn_respond(conn, &response, 0);
+
+}
+
+static int http_conn_backlogged(http_conn_t * conn) {
+    return conn->out_len - conn->out_sent > HTTP_OUT_PENDING;
+}
+
+/* Answers every complete request in the input buffer. Returns 1 if it
+ * stopped for the output to drain first, 0 otherwise */
+static int http_conn_process(http_server_t * server, http_conn_t * conn) {
+
+    while (!conn->close_after) {
+
+        if (http_conn_backlogged(conn)) {
+            return 1;
+        }
+
+        char * end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+        if (end == NULL) {
+            if (conn->in_len >= HTTP_REQUEST_MAX) {
+                http_conn_error(conn, 431);
+            }
+            return 0;
+        }
+        size_t header_len = end + 4 - conn->in;
+
+        char * line_end = memmem(conn->in, header_len, "\r\n", 2);
+        char * headers = line_end + 2;
+
+        /* A body past a large pipelined one can leave headers beyond the limit */
+        if (header_len > HTTP_REQUEST_MAX) {
+            http_conn_error(conn, 431);
+            return 0;
+        }
+
+        char value[32];
+        size_t body_len = 0;
+        if (http_header_find(headers, end + 2, "Content-Length", value, sizeof(value)) == 0) {
+            char * value_end;
+            errno = 0;
+            unsigned long long parsed = strtoull(value, &value_end, 10);
+            if (!isdigit((unsigned char) value[0]) || *value_end != '\0' || errno == ERANGE || parsed > SIZE_MAX) {
+                http_conn_error(conn, 400);
+                return 0;
+            }
+            body_len = parsed;
+        }
+        if (body_len > server->body_max && body_len > HTTP_REQUEST_MAX - header_len) {
+            http_conn_error(conn, 413);
+            return 0;
+        }
+        if (header_len + body_len + 1 > conn->in_size) {
+            char * grown = realloc(conn->in, header_len + body_len + 1);
+            if (grown == NULL) {
+                http_conn_error(conn, 413);
+                return 0;
+            }
+            conn->in = grown;
+            conn->in_size = header_len + body_len + 1;
+            end = conn->in + header_len - 4;
+            line_end = memmem(conn->in, header_len, "\r\n", 2);
+            headers = line_end + 2;
+        }
+        if (header_len + body_len > conn->in_len) {
+            return 0;
+        }
+
+        /* Split request line and headers in place */
+        *line_end = '\0';
+        end[2] = '\0';
+
+        char * method = conn->in;
+        char * path = strchr(method, ' ');
+        char * version = path ? strchr(path + 1, ' ') : NULL;
+        if (version == NULL) {
+            http_conn_error(conn, 400);
+            return 0;
+        }
+        *path++ = '\0';
+        *version++ = '\0';
+
+        char * query = strchr(path, '?');
+        if (query) {
+            *query++ = '\0';
+        } else {
+            query = "";
+        }
+
+        http_request_t request = {
+            .method = method,
+            .path = path,
+            .query = query,
+            .headers = headers,
+            .body = conn->in + header_len,
+            .body_len = body_len,
+            .head = strcmp(method, "HEAD") == 0,
+        };
+
+        /* HTTP/1.1 keeps the connection by default, HTTP/1.0 only on request */
+        int keep_alive = strcmp(version, "HTTP/1.1") == 0;
+        if (http_request_header(&request, "Connection", value, sizeof(value)) == 0) {
+            if (strcasecmp(value, "close") == 0) {
+                keep_alive = 0;
+            } else if (strcasecmp(value, "keep-alive") == 0) {
+                keep_alive = 1;
+            }
+        }
+        conn->close_after = !keep_alive;
+
+        http_response_t response = {
+            .status = 200,
+        };
+        server->handler(&request, &response, server->ctx);
+
+        if (http_conn_respond(conn, &response, request.head) < 0) {
+            conn->close_after = 1;
+        }
+
+        size_t used = header_len + body_len;
+        memmove(conn->in, conn->in + used, conn->in_len - used);
+        conn->in_len -= used;
+
+        /* Give back the room taken by a large body */
+        if (conn->in_size > HTTP_REQUEST_MAX + 1 && conn->in_len <= HTTP_REQUEST_MAX) {
+            char * shrunk = realloc(conn->in, HTTP_REQUEST_MAX + 1);
+            if (shrunk) {
+                conn->in = shrunk;
+                conn->in_size = HTTP_REQUEST_MAX + 1;
+            }
+        }
+
+    }
+
+    return 0;
+
+}
+
+static void http_conn_close(http_server_t * server, http_conn_t * conn) {
+
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+
+    /* Move the last connection into the freed slot */
+    server->conn_count--;
+    server->conns[conn->slot] = server->conns[server->conn_count];
+    server->conns[conn->slot]->slot = conn->slot;
+
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+
+}
+
+/* Returns -1 if the connection was closed */
+static int http_conn_flush(http_server_t * server, http_conn_t * conn) {
+
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            http_conn_close(server, conn);
+            return -1;
+        }
+        conn->out_sent += sent;
+        /* A slow reader is not idle while its response is moving */
+        conn->last = http_now();
+    }
+
+    struct epoll_event event = {
+        .events = http_conn_backlogged(conn) ? 0 : EPOLLIN,
+        .data.ptr = conn,
+    };
+
+    if (conn->out_sent < conn->out_len) {
+        event.events |= EPOLLOUT;
+    } else {
+        if (conn->close_after) {
+            http_conn_close(server, conn);
+            return -1;
+        }
+        conn->out_len = 0;
+        conn->out_sent = 0;
+        if (conn->out_size > HTTP_OUT_KEEP) {
+            free(conn->out);
+            conn->out = NULL;
+            conn->out_size = 0;
+        }
+    }
+
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    return 0;
+
+}
+
+static void http_conn_read(http_server_t * server, http_conn_t * conn) {
+
+    int held;
+    do {
+        /* Requests held back while the output was backed up come first */
+        held = http_conn_process(server, conn);
+
+        while (!held && conn->in_len < conn->in_size - 1 && !conn->close_after) {
+            ssize_t got = recv(conn->fd, conn->in + conn->in_len, conn->in_size - 1 - conn->in_len, 0);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                http_conn_close(server, conn);
+                return;
+            }
+            if (got == 0) {
+                http_conn_close(server, conn);
+                return;
+            }
+            conn->in_len += got;
+            conn->last = http_now();
+            held = http_conn_process(server, conn);
+        }
+
+        if (http_conn_flush(server, conn) < 0) {
+            return;
+        }
+    } while (held && !http_conn_backlogged(conn));
+
+}
+
+static void http_server_accept(http_server_t * server) {
+
+    while (1) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        if (server->conn_count >= HTTP_CONN_MAX) {
+            close(fd);
+            continue;
+        }
+
+        http_conn_t * conn = calloc(1, sizeof(http_conn_t));
+        if (conn) {
+            conn->in_size = HTTP_REQUEST_MAX + 1;
+            conn->in = malloc(conn->in_size);
+        }
+        if (conn == NULL || conn->in == NULL) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->last = http_now();
+
+        /* Responses are written in one go, do not hold back the tail */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(conn->in);
+            free(conn);
+            continue;
+        }
+
+        conn->slot = server->conn_count;
+        server->conns[server->conn_count++] = conn;
+    }
+
+}
+
+static int http_server_bind(http_server_t * server) {
+
+    struct sockaddr_storage addr = {0};
+    socklen_t addr_len;
+
+    struct sockaddr_in * in4 = (struct sockaddr_in *) &addr;
+    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *) &addr;
+    if (inet_pton(AF_INET, server->addr, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(server->port);
+        addr_len = sizeof(*in4);
+    } else if (inet_pton(AF_INET6, server->addr, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(server->port);
+        addr_len = sizeof(*in6);
+    } else {
+        printf("%s: invalid address %s\n", server->name, server->addr);
+        return -1;
+    }
+
+    server->listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0) {
+        return -1;
+    }
+
+    if (setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
+        printf("setsockopt(SO_REUSEADDR) failed\n");
+
+    if (addr.ss_family == AF_INET6) {
+        /* Let :: accept IPv4 as well */
+        setsockopt(server->listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &(int){0}, sizeof(int));
+    }
+
+    while (bind(server->listen_fd, (struct sockaddr *) &addr, addr_len) < 0) {
+        printf("Cannot bind %s to %s port %u\n", server->name, server->addr, server->port);
+        sleep(1);
+        if (!server->running) {
+            return -1;
+        }
+    }
+
+    if (listen(server->listen_fd, SOMAXCONN) < 0) {
+        return -1;
+    }
+
+    printf("%s listening on %s port %u\n", server->name, server->addr, server->port);
+    return 0;
+
+}
+
+static void * http_server_thread(void * arg) {
+
+    http_server_t * server = arg;
+
+    if (http_server_bind(server) < 0) {
+        return NULL;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+
+    time_t swept = http_now();
+    struct epoll_event events[64];
+
+    while (server->running) {
+
+        int count = epoll_wait(server->epoll_fd, events, 64, 1000);
+
+        for (int i = 0; i < count; i++) {
+            http_conn_t * conn = events[i].data.ptr;
+            if (conn == NULL) {
+                http_server_accept(server);
+            } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                /* Also finds errors and hangups through recv() */
+                http_conn_read(server, conn);
+            } else if (events[i].events & EPOLLOUT) {
+                /* Sending may have made room for held back requests */
+                if (http_conn_flush(server, conn) == 0 && conn->in_len > 0 && !http_conn_backlogged(conn)) {
+                    http_conn_read(server, conn);
+                }
+            }
+        }
+
+        /* Close idle keep-alive connections */
+        time_t now = http_now();
+        if (now != swept) {
+            swept = now;
+            for (unsigned int i = server->conn_count; i-- > 0;) {
+                if (now - server->conns[i]->last > HTTP_IDLE_S) {
+                    http_conn_close(server, server->conns[i]);
+                }
+            }
+        }
+
+    }
+
+    while (server->conn_count) {
+        http_conn_close(server, server->conns[0]);
+    }
+
+    return NULL;
+
+}
+
+http_server_t * http_server_start(const http_server_conf_t * conf) {
+
+    http_server_t * server = calloc(1, sizeof(http_server_t));
+    if (server == NULL) {
+        return NULL;
+    }
+
+    strncpy(server->name, conf->name ? conf->name : "HTTP server", sizeof(server->name) - 1);
+    strncpy(server->addr, conf->addr ? conf->addr : "0.0.0.0", sizeof(server->addr) - 1);
+    server->port = conf->port;
+    server->handler = conf->handler;
+    server->ctx = conf->ctx;
+    server->body_max = conf->body_max;
+    server->listen_fd = -1;
+    server->running = 1;
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epoll_fd < 0) {
+        free(server);
+        return NULL;
+    }
+
+    if (pthread_create(&server->thread, NULL, http_server_thread, server) != 0) {
+        close(server->epoll_fd);
+        free(server);
+        return NULL;
+    }
+
+    return server;
+
+}
+
+void http_server_stop(http_server_t * server) {
+
+    if (server == NULL) {
+        return;
+    }
+
+    server->running = 0;
+    pthread_join(server->thread, NULL);
+
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+    }
+    close(server->epoll_fd);
+    free(server);
+
+}
@@ -0,0 +1,60 @@
+/*
+ * http_server.h
+ *
+ * Minimal HTTP/1.1 server for metrics endpoints. One thread runs an epoll
+ * loop over non-blocking sockets, so a slow or idle client never holds up
+ * the others. Connections are kept alive between requests, and pipelined
+ * requests are answered in order.
+ *
+ * The handler is called on the server thread, one request at a time.
+ */
+
+#ifndef SRC_HTTP_SERVER_H_
+#define SRC_HTTP_SERVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HTTP_REQUEST_MAX    8192    // Request line and headers
+#define HTTP_CONN_MAX       1024
+#define HTTP_IDLE_S         60
+
+typedef struct {
+    const char * method;
+    const char * path;              // Without the query string
+    const char * query;             // Empty if none
+    const char * headers;           // Raw header lines, see http_request_header()
+    const char * body;
+    size_t body_len;
+    int head;                       // HEAD request, the body is not sent
+} http_request_t;
+
+typedef struct {
+    int status;                     // Defaults to 200
+    const char * content_type;      // Defaults to text/plain
+    const char * headers;           // Extra header lines, each ending in \r\n
+    const char * body;
+    size_t len;
+} http_response_t;
+
+typedef void (*http_handler_t)(const http_request_t * request, http_response_t * response, void * ctx);
+
+typedef struct {
+    const char * name;              // Used in messages
+    const char * addr;              // IPv4 or IPv6 address, NULL = any
+    uint16_t port;
+    http_handler_t handler;
+    void * ctx;
+    size_t body_max;                // Largest request body accepted, 0 = what fits in HTTP_REQUEST_MAX
+} http_server_conf_t;
+
+typedef struct http_server http_server_t;
+
+/* Starts the server thread. Binding is retried every second until it succeeds */
+http_server_t * http_server_start(const http_server_conf_t * conf);
+void http_server_stop(http_server_t * server);
+
+/* Copies the value of header name (case insensitive) to out. Returns 0, or -1 if not present */
+int http_request_header(const http_request_t * request, const char * name, char * out, size_t size);
+
+#endif /* SRC_HTTP_SERVER_H_ */
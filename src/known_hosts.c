@@ -18,6 +18,13 @@ struct host_s {
     char name[MAX_NAMELEN];
 } known_hosts[100];
 
+/* Bumped on every change, so cached names can be refreshed */
+static unsigned int known_hosts_changes;
+
+unsigned int known_hosts_version(void) {
+    return __atomic_load_n(&known_hosts_changes, __ATOMIC_RELAXED);
+}
+
 void known_hosts_del(int host) {
 
     for (int i = 0; i < MAX_HOSTS; i++) {
@@ -28,6 +35,8 @@ void known_hosts_del(int host) {
 
     }
 
+    __atomic_fetch_add(&known_hosts_changes, 1, __ATOMIC_RELAXED);
+
 }
 
 void known_hosts_add(int addr, char * new_name) {
@@ -39,6 +48,7 @@ void known_hosts_add(int addr, char * new_name) {
         if (known_hosts[i].node == 0) {
             known_hosts[i].node = addr;
             strncpy(known_hosts[i].name, new_name, MAX_NAMELEN);
+            __atomic_fetch_add(&known_hosts_changes, 1, __ATOMIC_RELAXED);
             break;
         }
     }
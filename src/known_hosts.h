@@ -2,4 +2,5 @@
 
 void known_hosts_add(int host, char * name);
 int known_hosts_get_name(int find_host, char * name, int buflen);
-int known_hosts_get_node(char * find_name);
\ No newline at end of file
+int known_hosts_get_node(char * find_name);
+unsigned int known_hosts_version(void);
\ No newline at end of file
@@ -0,0 +1,330 @@
+/*
+ * log_writer.c
+ *
+ * Double buffered log writer, see log_writer.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef CSH_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "log_writer.h"
+
+#define LOG_WRITER_ALIGN        4096
+#define LOG_WRITER_BUFFER       (1024 * 1024)
+#define LOG_WRITER_FLUSH_MS     1000
+
+struct log_writer_s {
+    log_writer_conf_t conf;
+    char * path;
+
+    int fd;
+    size_t file_size;
+    time_t file_opened;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signals the writer thread
+    pthread_cond_t done;        // Signals callers waiting for a free buffer
+    char * buf[2];
+    size_t len[2];
+    int active;                 // Buffer being filled by callers
+    int stop;
+
+    pthread_t thread;
+};
+
+static int log_writer_reopen(log_writer_t * writer) {
+
+    writer->fd = open(writer->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        printf("Cannot open log %s: %s\n", writer->path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    writer->file_size = (fstat(writer->fd, &st) == 0) ? st.st_size : 0;
+    writer->file_opened = time(NULL);
+    return 0;
+
+}
+
+#ifdef CSH_HAVE_ZLIB
+static void * log_writer_compress(void * arg) {
+
+    char * name = arg;
+    char gzname[strlen(name) + 4];
+    snprintf(gzname, sizeof(gzname), "%s.gz", name);
+
+    FILE * in = fopen(name, "rb");
+    gzFile out = gzopen(gzname, "wb6");
+    if (in == NULL || out == NULL) {
+        printf("Cannot compress %s\n", name);
+        if (in)
+            fclose(in);
+        if (out)
+            gzclose(out);
+        free(name);
+        return NULL;
+    }
+
+    char chunk[64 * 1024];
+    size_t n;
+    int ok = 1;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        if (gzwrite(out, chunk, n) != (int) n) {
+            ok = 0;
+            break;
+        }
+    }
+
+    fclose(in);
+    if (gzclose(out) != Z_OK || !ok) {
+        printf("Failed to compress %s\n", name);
+        unlink(gzname);
+    } else {
+        unlink(name);
+    }
+
+    free(name);
+    return NULL;
+
+}
+#endif
+
+static void log_writer_rotate(log_writer_t * writer) {
+
+    close(writer->fd);
+    writer->fd = -1;
+
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+    size_t size = strlen(writer->path) + sizeof(stamp) + 16;
+    char * name = malloc(size);
+    if (name == NULL) {
+        log_writer_reopen(writer);
+        return;
+    }
+
+    /* Avoid overwriting a segment rotated within the same second, compressed or not */
+    char gzname[size + 3];
+    snprintf(name, size, "%s.%s", writer->path, stamp);
+    snprintf(gzname, sizeof(gzname), "%s.gz", name);
+    for (unsigned int i = 1; access(name, F_OK) == 0 || access(gzname, F_OK) == 0; i++) {
+        snprintf(name, size, "%s.%s.%u", writer->path, stamp, i);
+        snprintf(gzname, sizeof(gzname), "%s.gz", name);
+    }
+
+    if (rename(writer->path, name) < 0) {
+        printf("Cannot rotate %s: %s\n", writer->path, strerror(errno));
+        free(name);
+        log_writer_reopen(writer);
+        return;
+    }
+
+    log_writer_reopen(writer);
+
+#ifdef CSH_HAVE_ZLIB
+    if (writer->conf.compress) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, log_writer_compress, name) == 0) {
+            pthread_detach(thread);
+            return;
+        }
+    }
+#endif
+    free(name);
+
+}
+
+static void log_writer_flush(log_writer_t * writer, int out) {
+
+    const char * data = writer->buf[out];
+    size_t left = writer->len[out];
+
+    while (left > 0 && writer->fd >= 0) {
+        ssize_t n = write(writer->fd, data, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Log write to %s failed: %s\n", writer->path, strerror(errno));
+            break;
+        }
+        data += n;
+        left -= n;
+        writer->file_size += n;
+    }
+
+    if (writer->conf.sync && writer->fd >= 0) {
+        fdatasync(writer->fd);
+    }
+
+}
+
+static void * log_writer_thread(void * arg) {
+
+    log_writer_t * writer = arg;
+
+    pthread_mutex_lock(&writer->lock);
+
+    while (1) {
+
+        /* Group commit: wait for a half full buffer or the flush interval */
+        if (!writer->stop && writer->len[writer->active] < writer->conf.buffer_size / 2) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += writer->conf.flush_ms / 1000;
+            deadline.tv_nsec += (writer->conf.flush_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&writer->wake, &writer->lock, &deadline);
+        }
+
+        int out = writer->active;
+        if (writer->len[out] == 0 && writer->stop) {
+            break;
+        }
+
+        /* Callers continue in the other buffer while this one is written */
+        writer->active = !out;
+        pthread_cond_broadcast(&writer->done);
+        pthread_mutex_unlock(&writer->lock);
+
+        if (writer->len[out] > 0) {
+            log_writer_flush(writer, out);
+        }
+
+        if (writer->file_size > 0 &&
+            ((writer->conf.rotate_size && writer->file_size >= writer->conf.rotate_size) ||
+             (writer->conf.rotate_s && time(NULL) - writer->file_opened >= writer->conf.rotate_s))) {
+            log_writer_rotate(writer);
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->len[out] = 0;
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+
+}
+
+log_writer_t * log_writer_open(const log_writer_conf_t * conf) {
+
+    log_writer_t * writer = calloc(1, sizeof(log_writer_t));
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    writer->conf = *conf;
+    if (writer->conf.buffer_size == 0)
+        writer->conf.buffer_size = LOG_WRITER_BUFFER;
+    if (writer->conf.flush_ms == 0)
+        writer->conf.flush_ms = LOG_WRITER_FLUSH_MS;
+
+#ifndef CSH_HAVE_ZLIB
+    if (writer->conf.compress) {
+        printf("Built without zlib, rotated logs are not compressed\n");
+        writer->conf.compress = 0;
+    }
+#endif
+
+    writer->path = strdup(conf->path);
+    if (writer->path == NULL ||
+        posix_memalign((void **) &writer->buf[0], LOG_WRITER_ALIGN, writer->conf.buffer_size) != 0 ||
+        posix_memalign((void **) &writer->buf[1], LOG_WRITER_ALIGN, writer->conf.buffer_size) != 0 ||
+        log_writer_reopen(writer) < 0) {
+        free(writer->buf[0]);
+        free(writer->buf[1]);
+        free(writer->path);
+        free(writer);
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&writer->done, NULL);
+    pthread_mutex_init(&writer->lock, NULL);
+
+    pthread_create(&writer->thread, NULL, log_writer_thread, writer);
+    return writer;
+
+}
+
+void log_writer_close(log_writer_t * writer) {
+
+    if (writer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    if (writer->fd >= 0) {
+        close(writer->fd);
+    }
+    pthread_cond_destroy(&writer->wake);
+    pthread_cond_destroy(&writer->done);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->buf[0]);
+    free(writer->buf[1]);
+    free(writer->path);
+    free(writer);
+
+}
+
+int log_writer_writev(log_writer_t * writer, const struct iovec * iov, int count) {
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len > writer->conf.buffer_size) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+
+    while (writer->len[writer->active] + len > writer->conf.buffer_size) {
+        pthread_cond_signal(&writer->wake);
+        pthread_cond_wait(&writer->done, &writer->lock);
+    }
+
+    int b = writer->active;
+    for (int i = 0; i < count; i++) {
+        memcpy(writer->buf[b] + writer->len[b], iov[i].iov_base, iov[i].iov_len);
+        writer->len[b] += iov[i].iov_len;
+    }
+
+    if (writer->len[b] >= writer->conf.buffer_size / 2) {
+        pthread_cond_signal(&writer->wake);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    return 0;
+
+}
+
+int log_writer_write(log_writer_t * writer, const char * data, size_t len) {
+    struct iovec iov = {.iov_base = (void *) data, .iov_len = len};
+    return log_writer_writev(writer, &iov, 1);
+}
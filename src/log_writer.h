@@ -0,0 +1,42 @@
+/*
+ * log_writer.h
+ *
+ * Buffered append-only log file with a dedicated writer thread.
+ *
+ * Callers copy lines into one of two page aligned buffers. The writer
+ * thread swaps buffers and writes the full one with a single write() when
+ * it is half full or flush_ms after the last flush (group commit), and
+ * optionally calls fdatasync(). The file can be rotated by size and/or age,
+ * and rotated segments can be gzip compressed in the background.
+ */
+
+#ifndef SRC_LOG_WRITER_H_
+#define SRC_LOG_WRITER_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+typedef struct {
+    const char * path;
+    size_t buffer_size;         // Per buffer, 0 = 1 MB
+    unsigned int flush_ms;      // Max time data stays buffered, 0 = 1000
+    int sync;                   // fdatasync() after each write
+    size_t rotate_size;         // Rotate when file reaches this size, 0 = never
+    unsigned int rotate_s;      // Rotate when file reaches this age, 0 = never
+    int compress;               // gzip rotated segments
+} log_writer_conf_t;
+
+typedef struct log_writer_s log_writer_t;
+
+log_writer_t * log_writer_open(const log_writer_conf_t * conf);
+
+/* Flushes remaining data and stops the writer thread */
+void log_writer_close(log_writer_t * writer);
+
+/* Copies len bytes into the buffer, waits for the writer if both buffers are full */
+int log_writer_write(log_writer_t * writer, const char * data, size_t len);
+
+/* Same for several pieces, which always land together in one buffer */
+int log_writer_writev(log_writer_t * writer, const struct iovec * iov, int count);
+
+#endif /* SRC_LOG_WRITER_H_ */
@@ -0,0 +1,553 @@
+/*
+ * metric_format.c
+ *
+ * Allocation and printf free rendering of sniffer samples. The label set
+ * of each series is rendered once and interned, a line is then a copy of
+ * it followed by the value and timestamp.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <param/param.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include "metric_format.h"
+#include "known_hosts.h"
+
+#define METRIC_SERIES_MIN_BITS  10
+#define METRIC_POW10_MAX        308
+
+typedef struct {
+    param_t * param;
+    const char * name;      /* Detects a param freed and reallocated at the same address */
+    uint16_t node;
+    uint16_t idx;
+    uint16_t len;
+    uint64_t version;       /* metric_labels_version() the prefix was rendered for */
+    char * prefix;
+} metric_series_t;
+
+/* Interned label sets, one per series (param, idx) */
+static pthread_rwlock_t series_lock = PTHREAD_RWLOCK_INITIALIZER;
+static metric_series_t * series_slots;
+static unsigned int series_bits;
+static unsigned int series_used;
+
+static unsigned int metric_labels;
+static unsigned int metric_labels_gen;
+
+static pthread_once_t pow10_once = PTHREAD_ONCE_INIT;
+static double pow10_tab[2 * METRIC_POW10_MAX + 1];
+
+static const char digits2[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+char * metric_fmt_u64(char * out, uint64_t value) {
+
+    char buf[20];
+    char * p = buf + sizeof(buf);
+
+    while (value >= 100) {
+        unsigned int r = value % 100;
+        value /= 100;
+        p -= 2;
+        memcpy(p, &digits2[r * 2], 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, &digits2[value * 2], 2);
+    } else {
+        *--p = '0' + value;
+    }
+
+    size_t n = buf + sizeof(buf) - p;
+    memcpy(out, p, n);
+    return out + n;
+
+}
+
+char * metric_fmt_i64(char * out, int64_t value) {
+    if (value < 0) {
+        *out++ = '-';
+        return metric_fmt_u64(out, (uint64_t) 0 - (uint64_t) value);
+    }
+    return metric_fmt_u64(out, value);
+}
+
+static void pow10_init(void) {
+    /* strtod gives correctly rounded powers, repeated multiplication would not */
+    for (int k = -METRIC_POW10_MAX; k <= METRIC_POW10_MAX; k++) {
+        char tmp[8];
+        snprintf(tmp, sizeof(tmp), "1e%d", k);
+        pow10_tab[k + METRIC_POW10_MAX] = strtod(tmp, NULL);
+    }
+}
+
+/**
+ * round(value * 10^k). While 10^|k| is exact (|k| <= 22) the rounding
+ * error of the multiply/divide is recovered with fma, so halfway cases
+ * round like printf. Outside that range the result may be off by one
+ * in the last digit.
+ */
+static uint64_t metric_scale(double value, int k) {
+
+    double scaled, err = 0;
+
+    if (k >= 0 && k <= 22) {
+        double p = pow10_tab[k + METRIC_POW10_MAX];
+        scaled = value * p;
+        err = fma(value, p, -scaled);
+    } else if (k < 0 && k >= -22) {
+        double p = pow10_tab[-k + METRIC_POW10_MAX];
+        scaled = value / p;
+        err = fma(-scaled, p, value) / p;
+    } else if (k > 300) {
+        scaled = value * 1e300 * pow10_tab[k - 300 + METRIC_POW10_MAX];
+    } else if (k < -300) {
+        scaled = value * 1e-300 * pow10_tab[k + 300 + METRIC_POW10_MAX];
+    } else {
+        scaled = value * pow10_tab[k + METRIC_POW10_MAX];
+    }
+
+    double whole = floor(scaled);
+    double frac = (scaled - whole) + err;
+    uint64_t m = whole;
+    if (frac > 0.5 || (frac == 0.5 && (m & 1))) {
+        m++;
+    }
+    return m;
+
+}
+
+char * metric_fmt_double(char * out, double value) {
+
+    if (isnan(value)) {
+        memcpy(out, "nan", 3);
+        return out + 3;
+    }
+
+    if (signbit(value)) {
+        *out++ = '-';
+        value = -value;
+    }
+
+    if (isinf(value)) {
+        memcpy(out, "inf", 3);
+        return out + 3;
+    }
+
+    if (value == 0) {
+        memcpy(out, "0.000000e+00", 12);
+        return out + 12;
+    }
+
+    pthread_once(&pow10_once, pow10_init);
+
+    /* Seven significant digits, like %e */
+    int exp = (int) floor(log10(value));
+    uint64_t m = metric_scale(value, 6 - exp);
+    if (m >= 10000000) {
+        exp++;
+        m = metric_scale(value, 6 - exp);
+    } else if (m < 1000000) {
+        exp--;
+        m = metric_scale(value, 6 - exp);
+    }
+    if (m >= 10000000) {
+        /* Rounded up to the next decade, e.g. 9.9999999 */
+        m /= 10;
+        exp++;
+    }
+
+    unsigned int lead = m / 1000000;
+    unsigned int frac = m % 1000000;
+    out[0] = '0' + lead;
+    out[1] = '.';
+    memcpy(&out[2], &digits2[(frac / 10000) * 2], 2);
+    memcpy(&out[4], &digits2[((frac / 100) % 100) * 2], 2);
+    memcpy(&out[6], &digits2[(frac % 100) * 2], 2);
+    out[8] = 'e';
+    if (exp < 0) {
+        out[9] = '-';
+        exp = -exp;
+    } else {
+        out[9] = '+';
+    }
+    out += 10;
+    if (exp >= 100) {
+        *out++ = '0' + exp / 100;
+        exp %= 100;
+    }
+    memcpy(out, &digits2[exp * 2], 2);
+    return out + 2;
+
+}
+
+static char * metric_put(char * out, char * end, const char * str, size_t len) {
+    if (out == NULL || (size_t) (end - out) < len) {
+        return NULL;
+    }
+    memcpy(out, str, len);
+    return out + len;
+}
+
+/* Label value with backslash, quote and newline escaped */
+static char * metric_put_escaped(char * out, char * end, const char * str) {
+    for (; out && *str; str++) {
+        if (*str == '\\' || *str == '"' || *str == '\n') {
+            out = metric_put(out, end, "\\", 1);
+            out = metric_put(out, end, *str == '\n' ? "n" : str, 1);
+        } else {
+            out = metric_put(out, end, str, 1);
+        }
+    }
+    return out;
+}
+
+static const struct {
+    uint32_t flag;
+    const char * name;
+} metric_mask_names[] = {
+    {PM_READONLY, "readonly"},
+    {PM_REMOTE, "remote"},
+    {PM_CONF, "conf"},
+    {PM_TELEM, "telem"},
+    {PM_HWREG, "hwreg"},
+    {PM_ERRCNT, "errcnt"},
+    {PM_SYSINFO, "sysinfo"},
+    {PM_SYSCONF, "sysconf"},
+    {PM_WDT, "wdt"},
+    {PM_DEBUG, "debug"},
+    {PM_CALIB, "calib"},
+};
+
+const char * metric_label(param_t * param, unsigned int label, char * buf, size_t size) {
+
+    if (!(metric_labels & label)) {
+        return NULL;
+    }
+
+    switch (label) {
+        case METRIC_LABEL_UNIT:
+            return param->unit && param->unit[0] ? param->unit : NULL;
+        case METRIC_LABEL_MASK: {
+            if (size == 0) {
+                return NULL;
+            }
+            char * p = buf;
+            char * end = buf + size - 1;
+            for (unsigned int i = 0; p && i < sizeof(metric_mask_names) / sizeof(metric_mask_names[0]); i++) {
+                if (param->mask & metric_mask_names[i].flag) {
+                    if (p != buf) {
+                        p = metric_put(p, end, ",", 1);
+                    }
+                    p = metric_put(p, end, metric_mask_names[i].name, strlen(metric_mask_names[i].name));
+                }
+            }
+            if (p == NULL || p == buf) {
+                return NULL;
+            }
+            *p = '\0';
+            return buf;
+        }
+        case METRIC_LABEL_HOST:
+            if (size == 0 || known_hosts_get_name(param->node, buf, size - 1) == 0 || buf[0] == '\0') {
+                return NULL;
+            }
+            buf[size - 1] = '\0';
+            return buf;
+        default:
+            return NULL;
+    }
+
+}
+
+uint64_t metric_labels_version(void) {
+    /* Host names are looked up when the label set is rendered, so follow known_hosts.
+     * Each counter has its own half, so no two states map to the same version */
+    uint64_t version = (uint64_t) __atomic_load_n(&metric_labels_gen, __ATOMIC_RELAXED) << 32;
+    if (metric_labels & METRIC_LABEL_HOST) {
+        version |= known_hosts_version();
+    }
+    return version;
+}
+
+void metric_format_set_labels(unsigned int labels) {
+    metric_labels = labels;
+    __atomic_fetch_add(&metric_labels_gen, 1, __ATOMIC_RELAXED);
+}
+
+unsigned int metric_format_get_labels(void) {
+    return metric_labels;
+}
+
+/* Renders the label set of a series up to and including '} ', returns NULL if it does not fit */
+static char * metric_render_prefix(char * out, char * end, param_t * param, unsigned int idx) {
+
+    static const struct {
+        unsigned int label;
+        const char * name;
+    } optional[] = {
+        {METRIC_LABEL_HOST, ", host=\""},
+        {METRIC_LABEL_UNIT, ", unit=\""},
+        {METRIC_LABEL_MASK, ", mask=\""},
+    };
+
+    char num[20];
+
+    out = metric_put(out, end, param->name, strlen(param->name));
+    out = metric_put(out, end, "{node=\"", 7);
+    out = metric_put(out, end, num, metric_fmt_u64(num, param->node) - num);
+    out = metric_put(out, end, "\", idx=\"", 8);
+    out = metric_put(out, end, num, metric_fmt_u64(num, idx) - num);
+    out = metric_put(out, end, "\"", 1);
+
+    for (unsigned int i = 0; i < sizeof(optional) / sizeof(optional[0]); i++) {
+        char buf[METRIC_LABEL_VALUE_MAX];
+        const char * value = metric_label(param, optional[i].label, buf, sizeof(buf));
+        if (value) {
+            out = metric_put(out, end, optional[i].name, strlen(optional[i].name));
+            out = metric_put_escaped(out, end, value);
+            out = metric_put(out, end, "\"", 1);
+        }
+    }
+
+    return metric_put(out, end, "} ", 2);
+
+}
+
+static inline uint32_t series_home(param_t * param, unsigned int idx, unsigned int bits) {
+    return ((uint32_t) ((uintptr_t) param >> 4) * 2654435761u + idx * 40503u) * 2654435761u >> (32 - bits);
+}
+
+static metric_series_t * series_lookup(param_t * param, unsigned int idx) {
+
+    if (series_slots == NULL) {
+        return NULL;
+    }
+
+    uint32_t mask = (1u << series_bits) - 1;
+    for (uint32_t i = series_home(param, idx, series_bits);; i = (i + 1) & mask) {
+        metric_series_t * entry = &series_slots[i];
+        if (entry->param == NULL)
+            return NULL;
+        if (entry->param == param && entry->idx == idx)
+            return entry;
+    }
+
+}
+
+static metric_series_t * series_slot(metric_series_t * slots, unsigned int bits, param_t * param, unsigned int idx) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t i = series_home(param, idx, bits);
+    while (slots[i].param != NULL && (slots[i].param != param || slots[i].idx != idx)) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static int series_grow(void) {
+
+    if (series_slots != NULL && (series_used + 1) * 2 <= (1u << series_bits)) {
+        return 0;
+    }
+
+    unsigned int bits = series_slots ? series_bits + 1 : METRIC_SERIES_MIN_BITS;
+    metric_series_t * slots = calloc(1u << bits, sizeof(metric_series_t));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    unsigned int old_size = series_slots ? 1u << series_bits : 0;
+    for (unsigned int i = 0; i < old_size; i++) {
+        if (series_slots[i].param) {
+            *series_slot(slots, bits, series_slots[i].param, series_slots[i].idx) = series_slots[i];
+        }
+    }
+
+    free(series_slots);
+    series_slots = slots;
+    series_bits = bits;
+    return 0;
+
+}
+
+/* Copy the interned label set of the series to out, rendering it on first use. Returns NULL if it does not fit */
+static char * metric_prefix(char * out, char * end, param_t * param, unsigned int idx) {
+
+    uint64_t version = metric_labels_version();
+
+    pthread_rwlock_rdlock(&series_lock);
+    metric_series_t * entry = series_lookup(param, idx);
+    if (entry && entry->name == param->name && entry->node == param->node && entry->version == version) {
+        out = metric_put(out, end, entry->prefix, entry->len);
+        pthread_rwlock_unlock(&series_lock);
+        return out;
+    }
+    pthread_rwlock_unlock(&series_lock);
+
+    char prefix[METRIC_PREFIX_MAX];
+    char * prefix_end = metric_render_prefix(prefix, prefix + sizeof(prefix), param, idx);
+    if (prefix_end == NULL) {
+        return NULL;
+    }
+    size_t len = prefix_end - prefix;
+
+    pthread_rwlock_wrlock(&series_lock);
+    if (series_grow() == 0) {
+        entry = series_slot(series_slots, series_bits, param, idx);
+        char * copy = realloc(entry->prefix, len);
+        if (copy) {
+            if (entry->param == NULL) {
+                series_used++;
+            }
+            memcpy(copy, prefix, len);
+            entry->param = param;
+            entry->name = param->name;
+            entry->node = param->node;
+            entry->idx = idx;
+            entry->len = len;
+            entry->version = version;
+            entry->prefix = copy;
+        }
+    }
+    pthread_rwlock_unlock(&series_lock);
+
+    return metric_put(out, end, prefix, len);
+
+}
+
+static char * metric_put_value(char * p, param_type_e type, param_sniffer_value_t value) {
+    switch (type) {
+        case PARAM_TYPE_UINT8:
+        case PARAM_TYPE_XINT8:
+        case PARAM_TYPE_UINT16:
+        case PARAM_TYPE_XINT16:
+        case PARAM_TYPE_UINT32:
+        case PARAM_TYPE_XINT32:
+        case PARAM_TYPE_UINT64:
+        case PARAM_TYPE_XINT64:
+            return metric_fmt_u64(p, value.u);
+        case PARAM_TYPE_INT8:
+        case PARAM_TYPE_INT16:
+        case PARAM_TYPE_INT32:
+        case PARAM_TYPE_INT64:
+            return metric_fmt_i64(p, value.i);
+        case PARAM_TYPE_FLOAT:
+        case PARAM_TYPE_DOUBLE:
+            return metric_fmt_double(p, value.d);
+        default:
+            return NULL;
+    }
+}
+
+size_t metric_format_value(char * out, size_t len, param_t * param, unsigned int idx, param_sniffer_value_t value, uint64_t time_ms) {
+
+    char * end = out + len;
+    char * p = metric_prefix(out, end, param, idx);
+
+    /* Value + ' ' + timestamp + '\n' */
+    if (p == NULL || (size_t) (end - p) < 24 + 1 + 20 + 1) {
+        return 0;
+    }
+
+    p = metric_put_value(p, param->type, value);
+    if (p == NULL) {
+        return 0;
+    }
+
+    *p++ = ' ';
+    p = metric_fmt_u64(p, time_ms);
+    *p++ = '\n';
+
+    return p - out;
+
+}
+
+size_t metric_format_derived(char * out, size_t len, param_t * param, unsigned int idx, const char * suffix, const char * label,
+                             param_type_e type, param_sniffer_value_t value, uint64_t time_ms) {
+
+    char prefix[METRIC_PREFIX_MAX];
+    char * prefix_end = metric_prefix(prefix, prefix + sizeof(prefix), param, idx);
+    if (prefix_end == NULL) {
+        return 0;
+    }
+
+    /* name + suffix, the interned labels without "} ", then the extra label */
+    size_t name_len = strlen(param->name);
+    char * end = out + len;
+    char * p = metric_put(out, end, param->name, name_len);
+    p = metric_put(p, end, suffix, strlen(suffix));
+    p = metric_put(p, end, prefix + name_len, prefix_end - prefix - name_len - 2);
+    if (label) {
+        p = metric_put(p, end, ", ", 2);
+        p = metric_put(p, end, label, strlen(label));
+    }
+    p = metric_put(p, end, "} ", 2);
+
+    if (p == NULL || (size_t) (end - p) < 24 + 1 + 20 + 1) {
+        return 0;
+    }
+
+    p = metric_put_value(p, type, value);
+    if (p == NULL) {
+        return 0;
+    }
+
+    *p++ = ' ';
+    p = metric_fmt_u64(p, time_ms);
+    *p++ = '\n';
+
+    return p - out;
+
+}
+
+size_t metric_format_sample(char * out, size_t len, const param_sniffer_sample_t * sample) {
+    return metric_format_value(out, len, sample->param, sample->idx, sample->value, sample->time_ms);
+}
+
+static int sniffer_labels_cmd(struct slash * slash) {
+
+    int unit = 0, mask = 0, host = 0, none = 0;
+
+    optparse_t * parser = optparse_new("sniffer labels", "");
+    optparse_add_help(parser);
+    optparse_add_set(parser, 'u', "unit", 1, &unit, "Add unit label");
+    optparse_add_set(parser, 'm', "mask", 1, &mask, "Add mask label with the param flags");
+    optparse_add_set(parser, 'H', "host", 1, &host, "Add host label with the node name from known hosts");
+    optparse_add_set(parser, 'c', "clear", 1, &none, "Only node and idx labels");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    optparse_del(parser);
+    if (argi < 0) {
+        return SLASH_EINVAL;
+    }
+
+    if (unit || mask || host || none) {
+        metric_format_set_labels((unit ? METRIC_LABEL_UNIT : 0) | (mask ? METRIC_LABEL_MASK : 0) | (host ? METRIC_LABEL_HOST : 0));
+    }
+
+    unsigned int labels = metric_format_get_labels();
+    printf("Labels: node, idx%s%s%s\n",
+           labels & METRIC_LABEL_HOST ? ", host" : "",
+           labels & METRIC_LABEL_UNIT ? ", unit" : "",
+           labels & METRIC_LABEL_MASK ? ", mask" : "");
+    return SLASH_SUCCESS;
+
+}
+slash_command_sub(sniffer, labels, sniffer_labels_cmd, "", "Select the optional labels of exported series");
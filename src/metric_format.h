@@ -0,0 +1,61 @@
+/*
+ * metric_format.h
+ *
+ * Prometheus text exposition lines for sniffed samples, without printf:
+ *
+ *   name{node="N", idx="I"[, host="H"][, unit="U"][, mask="M"]} VALUE TIMESTAMP_MS\n
+ *
+ * The label set is rendered once per series and interned until the
+ * selected labels or the known hosts change. Integers and floats are
+ * converted with table driven routines. Floats use the %e layout and
+ * round like printf for magnitudes between 1e-16 and 1e28; outside that
+ * range the last digit may differ.
+ */
+
+#ifndef SRC_METRIC_FORMAT_H_
+#define SRC_METRIC_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <param/param.h>
+
+#include "param_sniffer.h"
+
+/* Longest label set, and the longest line metric_format_sample() produces */
+#define METRIC_PREFIX_MAX   256
+#define METRIC_LINE_MAX     (METRIC_PREFIX_MAX + 24 + 1 + 20 + 1)
+
+/* Optional labels, see metric_format_set_labels() */
+#define METRIC_LABEL_UNIT   (1 << 0)
+#define METRIC_LABEL_MASK   (1 << 1)     /* Param flags, e.g. "conf,telem" */
+#define METRIC_LABEL_HOST   (1 << 2)     /* Node name from known hosts */
+
+/* Buffer size for metric_label(), fits the mask label with every flag set */
+#define METRIC_LABEL_VALUE_MAX  sizeof("readonly,remote,conf,telem,hwreg,errcnt,sysinfo,sysconf,wdt,debug,calib")
+
+char * metric_fmt_u64(char * out, uint64_t value);
+char * metric_fmt_i64(char * out, int64_t value);
+char * metric_fmt_double(char * out, double value);
+
+/* Writes one line to out, returns its length or 0 if it does not fit in len */
+size_t metric_format_sample(char * out, size_t len, const param_sniffer_sample_t * sample);
+
+/* Same, for a value read from local param storage */
+size_t metric_format_value(char * out, size_t len, param_t * param, unsigned int idx, param_sniffer_value_t value, uint64_t time_ms);
+
+/* A series derived from param, e.g. name_max{...} or name_bucket{..., le="10"}.
+ * label is an extra label or NULL, value is formatted as type */
+size_t metric_format_derived(char * out, size_t len, param_t * param, unsigned int idx, const char * suffix, const char * label,
+                             param_type_e type, param_sniffer_value_t value, uint64_t time_ms);
+
+/* Select the optional labels of every series, a mask of METRIC_LABEL_* */
+void metric_format_set_labels(unsigned int labels);
+unsigned int metric_format_get_labels(void);
+
+/* Changes whenever interned label sets must be rendered again */
+uint64_t metric_labels_version(void);
+
+/* Value of one optional label of param, or NULL if not selected or empty. buf may be used for the result */
+const char * metric_label(param_t * param, unsigned int label, char * buf, size_t size);
+
+#endif /* SRC_METRIC_FORMAT_H_ */
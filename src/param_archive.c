@@ -0,0 +1,411 @@
+/*
+ * param_archive.c
+ *
+ * Binary archive sink for the parameter sniffer.
+ *
+ * Samples are buffered per node:id in memory columns and written out as
+ * self-describing blocks once a column is full or older than the flush
+ * interval. For every block a fixed size record is appended to a
+ * sidecar index file, so a reader can locate all blocks of a single
+ * parameter within a time range without touching the rest of the archive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+#include <slash/dflopt.h>
+
+#include <param/param.h>
+
+#include "param_archive.h"
+#include "param_archive_format.h"
+#include "param_sniffer.h"
+
+#define PARAM_ARCHIVE_BLOCK_SAMPLES 256
+#define PARAM_ARCHIVE_BUCKETS       1024
+
+typedef struct param_archive_col_s param_archive_col_t;
+struct param_archive_col_s {
+    uint16_t node;
+    uint16_t id;
+    uint8_t kind;
+    uint8_t value_size;
+    uint16_t count;
+    uint64_t t_first;
+    uint64_t t_last;
+    time_t opened;
+    uint64_t time[PARAM_ARCHIVE_BLOCK_SAMPLES];
+    uint16_t idx[PARAM_ARCHIVE_BLOCK_SAMPLES];
+    uint8_t values[PARAM_ARCHIVE_BLOCK_SAMPLES * sizeof(uint64_t)];
+    param_archive_col_t * next;     /* Hash bucket chain */
+    param_archive_col_t * all_next; /* List of all columns, for sweeping */
+};
+
+int param_archive_running = 0;
+
+static pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE * archive_file;
+static FILE * index_file;
+static uint64_t archive_offset;
+static unsigned int archive_flush_interval = 10;
+static time_t archive_last_sweep;
+
+static param_archive_col_t * archive_buckets[PARAM_ARCHIVE_BUCKETS];
+static param_archive_col_t * archive_columns;
+
+static time_t archive_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static int archive_kind(int type, uint8_t * kind, uint8_t * value_size) {
+    switch (type) {
+        case PARAM_TYPE_UINT8:
+        case PARAM_TYPE_XINT8:
+            *kind = PARAM_ARCHIVE_KIND_UINT; *value_size = 1; return 0;
+        case PARAM_TYPE_UINT16:
+        case PARAM_TYPE_XINT16:
+            *kind = PARAM_ARCHIVE_KIND_UINT; *value_size = 2; return 0;
+        case PARAM_TYPE_UINT32:
+        case PARAM_TYPE_XINT32:
+            *kind = PARAM_ARCHIVE_KIND_UINT; *value_size = 4; return 0;
+        case PARAM_TYPE_UINT64:
+        case PARAM_TYPE_XINT64:
+            *kind = PARAM_ARCHIVE_KIND_UINT; *value_size = 8; return 0;
+        case PARAM_TYPE_INT8:
+            *kind = PARAM_ARCHIVE_KIND_INT; *value_size = 1; return 0;
+        case PARAM_TYPE_INT16:
+            *kind = PARAM_ARCHIVE_KIND_INT; *value_size = 2; return 0;
+        case PARAM_TYPE_INT32:
+            *kind = PARAM_ARCHIVE_KIND_INT; *value_size = 4; return 0;
+        case PARAM_TYPE_INT64:
+            *kind = PARAM_ARCHIVE_KIND_INT; *value_size = 8; return 0;
+        case PARAM_TYPE_FLOAT:
+            *kind = PARAM_ARCHIVE_KIND_FLOAT; *value_size = 4; return 0;
+        case PARAM_TYPE_DOUBLE:
+            *kind = PARAM_ARCHIVE_KIND_FLOAT; *value_size = 8; return 0;
+        default:
+            return -1;
+    }
+}
+
+/* Store value narrowed to the column width */
+static void archive_store(param_archive_col_t * col, param_sniffer_value_t value) {
+
+    uint8_t * out = &col->values[col->count * col->value_size];
+
+    if (col->kind == PARAM_ARCHIVE_KIND_FLOAT) {
+        if (col->value_size == 4) {
+            float f = value.d;
+            memcpy(out, &f, sizeof(f));
+        } else {
+            memcpy(out, &value.d, sizeof(value.d));
+        }
+        return;
+    }
+
+    switch (col->value_size) {
+        case 1: { uint8_t v = value.u; memcpy(out, &v, 1); break; }
+        case 2: { uint16_t v = value.u; memcpy(out, &v, 2); break; }
+        case 4: { uint32_t v = value.u; memcpy(out, &v, 4); break; }
+        default: memcpy(out, &value.u, 8); break;
+    }
+
+}
+
+static int archive_write_header(FILE * fp, const char * magic) {
+
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) > 0) {
+        return 0;
+    }
+
+    param_archive_file_t hdr = {
+        .version = PARAM_ARCHIVE_VERSION,
+    };
+    memcpy(hdr.magic, magic, sizeof(hdr.magic));
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        return -1;
+    }
+    fflush(fp);
+    return 0;
+}
+
+static void archive_flush_col(param_archive_col_t * col) {
+
+    if (col->count == 0 || archive_file == NULL) {
+        return;
+    }
+
+    param_archive_block_t block = {
+        .magic = PARAM_ARCHIVE_BLOCK_MAGIC,
+        .node = col->node,
+        .id = col->id,
+        .kind = col->kind,
+        .value_size = col->value_size,
+        .count = col->count,
+        .t_first = col->t_first,
+        .t_last = col->t_last,
+        .payload_len = param_archive_payload_len(col->count, col->value_size),
+    };
+
+    param_archive_index_t index = {
+        .node = col->node,
+        .id = col->id,
+        .kind = col->kind,
+        .value_size = col->value_size,
+        .count = col->count,
+        .t_first = col->t_first,
+        .t_last = col->t_last,
+        .offset = archive_offset,
+    };
+
+    int ok = 1;
+    ok &= fwrite(&block, sizeof(block), 1, archive_file) == 1;
+    ok &= fwrite(col->time, sizeof(uint64_t), col->count, archive_file) == col->count;
+    ok &= fwrite(col->idx, sizeof(uint16_t), col->count, archive_file) == col->count;
+    ok &= fwrite(col->values, col->value_size, col->count, archive_file) == col->count;
+    fflush(archive_file);
+
+    if (!ok) {
+        printf("Archive write failed, block for %u:%u lost\n", col->node, col->id);
+        /* Cut off the partial block, or at least index later blocks where they really are */
+        clearerr(archive_file);
+        if (ftruncate(fileno(archive_file), archive_offset) < 0) {
+            off_t end = ftello(archive_file);
+            if (end >= 0)
+                archive_offset = end;
+        }
+    } else {
+        archive_offset += sizeof(block) + block.payload_len;
+        if (index_file) {
+            fwrite(&index, sizeof(index), 1, index_file);
+            fflush(index_file);
+        }
+    }
+
+    col->count = 0;
+
+}
+
+static param_archive_col_t * archive_col_get(uint16_t node, uint16_t id) {
+
+    unsigned int bucket = (node * 2654435761u ^ id) % PARAM_ARCHIVE_BUCKETS;
+
+    for (param_archive_col_t * col = archive_buckets[bucket]; col != NULL; col = col->next) {
+        if (col->node == node && col->id == id) {
+            return col;
+        }
+    }
+
+    param_archive_col_t * col = malloc(sizeof(param_archive_col_t));
+    if (col == NULL) {
+        return NULL;
+    }
+    col->node = node;
+    col->id = id;
+    col->count = 0;
+    col->value_size = 0;
+    col->next = archive_buckets[bucket];
+    archive_buckets[bucket] = col;
+    col->all_next = archive_columns;
+    archive_columns = col;
+    return col;
+
+}
+
+static void archive_sweep(time_t now) {
+    for (param_archive_col_t * col = archive_columns; col != NULL; col = col->all_next) {
+        if (col->count > 0 && now - col->opened >= archive_flush_interval) {
+            archive_flush_col(col);
+        }
+    }
+    archive_last_sweep = now;
+}
+
+void param_archive_add(param_t * param, unsigned int idx, param_sniffer_value_t value, uint64_t time_ms) {
+
+    uint8_t kind, value_size;
+    if (archive_kind(param->type, &kind, &value_size) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&archive_lock);
+
+    if (archive_file == NULL) {
+        pthread_mutex_unlock(&archive_lock);
+        return;
+    }
+
+    param_archive_col_t * col = archive_col_get(param->node, param->id);
+    if (col == NULL) {
+        pthread_mutex_unlock(&archive_lock);
+        return;
+    }
+
+    /* Parameter type changed (list re-downloaded), start a new block */
+    if (col->count > 0 && (col->kind != kind || col->value_size != value_size)) {
+        archive_flush_col(col);
+    }
+
+    time_t now = archive_now();
+
+    if (col->count == 0) {
+        col->kind = kind;
+        col->value_size = value_size;
+        col->t_first = time_ms;
+        col->t_last = time_ms;
+        col->opened = now;
+    }
+
+    col->time[col->count] = time_ms;
+    col->idx[col->count] = idx;
+    archive_store(col, value);
+    col->count++;
+
+    if (time_ms < col->t_first)
+        col->t_first = time_ms;
+    if (time_ms > col->t_last)
+        col->t_last = time_ms;
+
+    if (col->count >= PARAM_ARCHIVE_BLOCK_SAMPLES) {
+        archive_flush_col(col);
+    }
+
+    if (now != archive_last_sweep) {
+        archive_sweep(now);
+    }
+
+    pthread_mutex_unlock(&archive_lock);
+
+}
+
+void param_archive_flush(void) {
+    pthread_mutex_lock(&archive_lock);
+    for (param_archive_col_t * col = archive_columns; col != NULL; col = col->all_next) {
+        archive_flush_col(col);
+    }
+    pthread_mutex_unlock(&archive_lock);
+}
+
+int param_archive_open(const char * path, unsigned int flush_interval_s) {
+
+    char index_path[PATH_MAX];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int) sizeof(index_path)) {
+        printf("Archive path too long: %s\n", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&archive_lock);
+
+    if (archive_file != NULL) {
+        pthread_mutex_unlock(&archive_lock);
+        printf("Archive already open\n");
+        return -1;
+    }
+
+    archive_file = fopen(path, "ab");
+    if (archive_file == NULL) {
+        pthread_mutex_unlock(&archive_lock);
+        printf("Couldn't open %s for append\n", path);
+        return -1;
+    }
+
+    index_file = fopen(index_path, "ab");
+    if (index_file == NULL) {
+        printf("Couldn't open %s for append, archive will not be indexed\n", index_path);
+    }
+
+    if (archive_write_header(archive_file, PARAM_ARCHIVE_MAGIC) < 0 ||
+        (index_file && archive_write_header(index_file, PARAM_ARCHIVE_INDEX_MAGIC) < 0)) {
+        printf("Couldn't write archive header\n");
+    }
+
+    archive_offset = ftell(archive_file);
+    if (flush_interval_s > 0) {
+        archive_flush_interval = flush_interval_s;
+    }
+    param_archive_running = 1;
+
+    pthread_mutex_unlock(&archive_lock);
+
+    printf("Archiving parameters to %s\n", path);
+    return 0;
+
+}
+
+void param_archive_close(void) {
+
+    param_archive_flush();
+
+    pthread_mutex_lock(&archive_lock);
+
+    param_archive_running = 0;
+
+    if (archive_file) {
+        fclose(archive_file);
+        archive_file = NULL;
+    }
+    if (index_file) {
+        fclose(index_file);
+        index_file = NULL;
+    }
+
+    while (archive_columns) {
+        param_archive_col_t * col = archive_columns;
+        archive_columns = col->all_next;
+        free(col);
+    }
+    memset(archive_buckets, 0, sizeof(archive_buckets));
+
+    pthread_mutex_unlock(&archive_lock);
+
+}
+
+static int sniffer_archive_start_cmd(struct slash * slash) {
+
+    int hk_node = 0;
+    unsigned int interval = 10;
+
+    optparse_t * parser = optparse_new("sniffer archive start", "<file>");
+    optparse_add_help(parser);
+    optparse_add_int(parser, 'n', "hk_node", "NUM", 0, &hk_node, "Housekeeping node");
+    optparse_add_unsigned(parser, 'i', "interval", "NUM", 0, &interval, "Max seconds a sample is buffered before written (default = 10)");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (++argi >= slash->argc) {
+        printf("Missing archive filename\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (param_archive_open(slash->argv[argi], interval) < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    param_sniffer_init(0, hk_node);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+}
+slash_command_subsub(sniffer, archive, start, sniffer_archive_start_cmd, "<file>", "Archive sniffed parameters to binary file");
+
+static int sniffer_archive_stop_cmd(struct slash * slash) {
+    param_archive_close();
+    return SLASH_SUCCESS;
+}
+slash_command_subsub(sniffer, archive, stop, sniffer_archive_stop_cmd, "", "Flush and close parameter archive");
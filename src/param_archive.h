@@ -0,0 +1,23 @@
+/*
+ * param_archive.h
+ *
+ * Append-only binary archive of sniffed parameter values.
+ * See param_archive_format.h for the file layout.
+ */
+
+#ifndef SRC_PARAM_ARCHIVE_H_
+#define SRC_PARAM_ARCHIVE_H_
+
+#include <stdint.h>
+#include <param/param.h>
+
+#include "param_sniffer.h"
+
+extern int param_archive_running;
+
+int param_archive_open(const char * path, unsigned int flush_interval_s);
+void param_archive_close(void);
+void param_archive_add(param_t * param, unsigned int idx, param_sniffer_value_t value, uint64_t time_ms);
+void param_archive_flush(void);
+
+#endif /* SRC_PARAM_ARCHIVE_H_ */
@@ -0,0 +1,292 @@
+/*
+ * param_archive_dump.c
+ *
+ * Standalone reader for archives written by "sniffer archive start".
+ * Uses the sidecar index to seek directly to the blocks of the requested
+ * parameter and time range. Falls back to walking the block headers
+ * (skipping payloads) if the index file is missing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "param_archive_format.h"
+
+typedef struct {
+    uint16_t node;
+    uint16_t id;
+    unsigned int blocks;
+    uint64_t samples;
+    uint64_t t_first;
+    uint64_t t_last;
+} series_t;
+
+static int opt_node = -1;
+static int opt_id = -1;
+static uint64_t opt_from = 0;
+static uint64_t opt_to = UINT64_MAX;
+static int opt_list = 0;
+
+static series_t * series;
+static unsigned int series_count;
+static unsigned int series_alloc;
+
+void usage(void) {
+    printf("usage: param_archive_dump [options] ARCHIVE\n");
+    printf("\n");
+    printf("Options:\n");
+    printf(" -n NODE\tOnly parameters from NODE\n");
+    printf(" -i ID\t\tOnly parameter ID\n");
+    printf(" -f FROM\tStart time [ms since epoch]\n");
+    printf(" -t TO\t\tEnd time [ms since epoch]\n");
+    printf(" -l\t\tList series in archive instead of dumping samples\n");
+}
+
+static void series_add(const param_archive_index_t * idx) {
+
+    for (unsigned int i = 0; i < series_count; i++) {
+        series_t * s = &series[i];
+        if (s->node == idx->node && s->id == idx->id) {
+            s->blocks++;
+            s->samples += idx->count;
+            if (idx->t_first < s->t_first)
+                s->t_first = idx->t_first;
+            if (idx->t_last > s->t_last)
+                s->t_last = idx->t_last;
+            return;
+        }
+    }
+
+    if (series_count == series_alloc) {
+        series_alloc = series_alloc ? series_alloc * 2 : 64;
+        series = realloc(series, series_alloc * sizeof(series_t));
+        if (series == NULL) {
+            printf("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    series[series_count++] = (series_t) {
+        .node = idx->node,
+        .id = idx->id,
+        .blocks = 1,
+        .samples = idx->count,
+        .t_first = idx->t_first,
+        .t_last = idx->t_last,
+    };
+
+}
+
+static int block_matches(const param_archive_index_t * idx) {
+    if (opt_node >= 0 && idx->node != opt_node)
+        return 0;
+    if (opt_id >= 0 && idx->id != opt_id)
+        return 0;
+    if (idx->t_last < opt_from || idx->t_first > opt_to)
+        return 0;
+    return 1;
+}
+
+static void print_value(uint8_t kind, uint8_t value_size, const uint8_t * v) {
+
+    if (kind == PARAM_ARCHIVE_KIND_FLOAT) {
+        if (value_size == 4) {
+            float f;
+            memcpy(&f, v, sizeof(f));
+            printf("%.9g", f);
+        } else {
+            double d;
+            memcpy(&d, v, sizeof(d));
+            printf("%.17g", d);
+        }
+        return;
+    }
+
+    uint64_t u = 0;
+    memcpy(&u, v, value_size);
+
+    if (kind == PARAM_ARCHIVE_KIND_INT) {
+        /* Sign extend */
+        int shift = 64 - 8 * value_size;
+        int64_t i = (int64_t) (u << shift) >> shift;
+        printf("%"PRIi64, i);
+    } else {
+        printf("%"PRIu64, u);
+    }
+
+}
+
+static int dump_block(FILE * fp, const param_archive_index_t * idx) {
+
+    param_archive_block_t block;
+    if (fseeko(fp, idx->offset, SEEK_SET) != 0 || fread(&block, sizeof(block), 1, fp) != 1) {
+        printf("Failed to read block at offset %"PRIu64"\n", idx->offset);
+        return -1;
+    }
+
+    if (block.magic != PARAM_ARCHIVE_BLOCK_MAGIC || block.node != idx->node || block.id != idx->id ||
+        block.payload_len != param_archive_payload_len(block.count, block.value_size)) {
+        printf("Corrupt block at offset %"PRIu64"\n", idx->offset);
+        return -1;
+    }
+
+    uint8_t * payload = malloc(block.payload_len);
+    if (payload == NULL) {
+        return -1;
+    }
+    if (fread(payload, block.payload_len, 1, fp) != 1) {
+        printf("Truncated block at offset %"PRIu64"\n", idx->offset);
+        free(payload);
+        return -1;
+    }
+
+    const uint8_t * times = payload;
+    const uint8_t * idxs = times + block.count * sizeof(uint64_t);
+    const uint8_t * values = idxs + block.count * sizeof(uint16_t);
+
+    for (unsigned int i = 0; i < block.count; i++) {
+        uint64_t t;
+        uint16_t element;
+        memcpy(&t, times + i * sizeof(uint64_t), sizeof(t));
+        memcpy(&element, idxs + i * sizeof(uint16_t), sizeof(element));
+        if (t < opt_from || t > opt_to)
+            continue;
+        printf("%"PRIu64" %u %u %u ", t, block.node, block.id, element);
+        print_value(block.kind, block.value_size, values + i * block.value_size);
+        printf("\n");
+    }
+
+    free(payload);
+    return 0;
+
+}
+
+static int check_header(FILE * fp, const char * magic) {
+    param_archive_file_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+        return -1;
+    if (memcmp(hdr.magic, magic, sizeof(hdr.magic)) != 0 || hdr.version != PARAM_ARCHIVE_VERSION)
+        return -1;
+    return 0;
+}
+
+/* Fallback when no index exists: walk block headers, seeking past payloads */
+static FILE * build_index(FILE * fp) {
+
+    FILE * tmp = tmpfile();
+    if (tmp == NULL)
+        return NULL;
+
+    off_t offset = sizeof(param_archive_file_t);
+    param_archive_block_t block;
+
+    while (fseeko(fp, offset, SEEK_SET) == 0 && fread(&block, sizeof(block), 1, fp) == 1) {
+        if (block.magic != PARAM_ARCHIVE_BLOCK_MAGIC) {
+            printf("Corrupt block at offset %jd, stopping scan\n", (intmax_t) offset);
+            break;
+        }
+        param_archive_index_t idx = {
+            .node = block.node,
+            .id = block.id,
+            .kind = block.kind,
+            .value_size = block.value_size,
+            .count = block.count,
+            .t_first = block.t_first,
+            .t_last = block.t_last,
+            .offset = offset,
+        };
+        fwrite(&idx, sizeof(idx), 1, tmp);
+        offset += sizeof(block) + block.payload_len;
+    }
+
+    rewind(tmp);
+    return tmp;
+
+}
+
+int main(int argc, char ** argv) {
+
+    int c;
+    while ((c = getopt(argc, argv, "hln:i:f:t:")) != -1) {
+        switch (c) {
+            case 'n':
+                opt_node = atoi(optarg);
+                break;
+            case 'i':
+                opt_id = atoi(optarg);
+                break;
+            case 'f':
+                opt_from = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                opt_to = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                opt_list = 1;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    const char * path = argv[optind];
+    FILE * fp = fopen(path, "rb");
+    if (fp == NULL || check_header(fp, PARAM_ARCHIVE_MAGIC) < 0) {
+        printf("%s is not a parameter archive\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char index_path[PATH_MAX];
+    if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >= (int) sizeof(index_path)) {
+        printf("Archive path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    FILE * index = fopen(index_path, "rb");
+    if (index == NULL || check_header(index, PARAM_ARCHIVE_INDEX_MAGIC) < 0) {
+        printf("No usable index %s, scanning block headers\n", index_path);
+        if (index)
+            fclose(index);
+        index = build_index(fp);
+        if (index == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    param_archive_index_t idx;
+    while (fread(&idx, sizeof(idx), 1, index) == 1) {
+        if (!block_matches(&idx))
+            continue;
+        if (opt_list) {
+            series_add(&idx);
+        } else {
+            dump_block(fp, &idx);
+        }
+    }
+
+    if (opt_list) {
+        printf("node id blocks samples t_first t_last\n");
+        for (unsigned int i = 0; i < series_count; i++) {
+            series_t * s = &series[i];
+            printf("%u %u %u %"PRIu64" %"PRIu64" %"PRIu64"\n", s->node, s->id, s->blocks, s->samples, s->t_first, s->t_last);
+        }
+        free(series);
+    }
+
+    fclose(index);
+    fclose(fp);
+    return 0;
+
+}
@@ -0,0 +1,74 @@
+/*
+ * param_archive_format.h
+ *
+ * On-disk layout of the binary parameter archive. Shared between the
+ * writer in csh (param_archive.c) and the standalone reader
+ * (param_archive_dump.c), so this header must not depend on libparam.
+ *
+ * Archive file:
+ *   param_archive_file_t
+ *   param_archive_block_t, payload, param_archive_block_t, payload, ...
+ *
+ * Block payload (one column per field, all samples of a single node:id):
+ *   uint64_t time_ms[count]
+ *   uint16_t idx[count]
+ *   value[count]           (value_size bytes each, see param_archive_kind_e)
+ *
+ * Index file (<archive>.idx), one record per block written:
+ *   param_archive_file_t
+ *   param_archive_index_t, param_archive_index_t, ...
+ *
+ * All fields are stored in host byte order (little endian on every
+ * ground station we run).
+ */
+
+#ifndef SRC_PARAM_ARCHIVE_FORMAT_H_
+#define SRC_PARAM_ARCHIVE_FORMAT_H_
+
+#include <stdint.h>
+
+#define PARAM_ARCHIVE_MAGIC         "CSHARCH1"
+#define PARAM_ARCHIVE_INDEX_MAGIC   "CSHAIDX1"
+#define PARAM_ARCHIVE_VERSION       1
+#define PARAM_ARCHIVE_BLOCK_MAGIC   0x4B4C4241  /* "ABLK" */
+
+typedef enum {
+    PARAM_ARCHIVE_KIND_UINT = 0,
+    PARAM_ARCHIVE_KIND_INT = 1,
+    PARAM_ARCHIVE_KIND_FLOAT = 2,
+} param_archive_kind_e;
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} param_archive_file_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t node;
+    uint16_t id;
+    uint8_t kind;           /* param_archive_kind_e */
+    uint8_t value_size;     /* 1, 2, 4 or 8 bytes */
+    uint16_t count;         /* Number of samples in block */
+    uint64_t t_first;       /* Lowest timestamp in block [ms] */
+    uint64_t t_last;        /* Highest timestamp in block [ms] */
+    uint32_t payload_len;
+} param_archive_block_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t node;
+    uint16_t id;
+    uint8_t kind;
+    uint8_t value_size;
+    uint16_t count;
+    uint64_t t_first;
+    uint64_t t_last;
+    uint64_t offset;        /* File offset of param_archive_block_t */
+} param_archive_index_t;
+
+static inline uint32_t param_archive_payload_len(unsigned int count, unsigned int value_size) {
+    return count * (sizeof(uint64_t) + sizeof(uint16_t) + value_size);
+}
+
+#endif /* SRC_PARAM_ARCHIVE_FORMAT_H_ */
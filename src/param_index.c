@@ -0,0 +1,289 @@
+/*
+ * param_index.c
+ *
+ * Open addressing hash table (linear probing) from node:id to a pinned
+ * copy of the param. libparam adds and frees list entries on its own (list
+ * download, remove), so the table never holds list entries: it is rebuilt
+ * from the list once per PARAM_INDEX_REFRESH_S, and a lookup miss falls
+ * back to the list. The rebuild runs on its own thread, off the decode
+ * path. Readers take a shared lock, so the sniffer threads never contend
+ * with each other, only with a miss or the table swap.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <param/param.h>
+#include <param/param_list.h>
+
+#include "param_index.h"
+
+#define PARAM_INDEX_MIN_BITS 10
+#define PARAM_INDEX_REFRESH_S 1
+#define PARAM_PIN_BITS 12
+
+typedef struct {
+    uint32_t key;
+    param_t * param;
+} param_index_slot_t;
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static param_index_slot_t * index_slots;
+static unsigned int index_bits;
+static unsigned int index_used;
+
+/* Serializes rebuilds, the refresh thread against a direct param_index_refresh() */
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t refresh_thread;
+static int refresh_running;
+
+static inline uint32_t index_key(int node, int id) {
+    return ((uint32_t) (node & 0xFFFF) << 16) | (id & 0xFFFF);
+}
+
+static inline uint32_t index_home(uint32_t key, unsigned int bits) {
+    return (key * 2654435761u) >> (32 - bits);
+}
+
+static param_t * index_lookup(uint32_t key) {
+
+    if (index_slots == NULL) {
+        return NULL;
+    }
+
+    uint32_t mask = (1u << index_bits) - 1;
+    for (uint32_t i = index_home(key, index_bits);; i = (i + 1) & mask) {
+        if (index_slots[i].param == NULL)
+            return NULL;
+        if (index_slots[i].key == key)
+            return index_slots[i].param;
+    }
+
+}
+
+/* Returns 1 if key was not in slots before */
+static int index_insert(param_index_slot_t * slots, unsigned int bits, uint32_t key, param_t * param) {
+
+    uint32_t mask = (1u << bits) - 1;
+    for (uint32_t i = index_home(key, bits);; i = (i + 1) & mask) {
+        if (slots[i].param == NULL) {
+            slots[i].key = key;
+            slots[i].param = param;
+            return 1;
+        }
+        if (slots[i].key == key) {
+            slots[i].param = param;
+            return 0;
+        }
+    }
+
+}
+
+/* Keep load factor below 1/2, so probe sequences stay short */
+static int index_grow(void) {
+
+    if (index_slots != NULL && (index_used + 1) * 2 <= (1u << index_bits)) {
+        return 0;
+    }
+
+    unsigned int bits = index_slots ? index_bits + 1 : PARAM_INDEX_MIN_BITS;
+    param_index_slot_t * slots = calloc(1u << bits, sizeof(param_index_slot_t));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    param_index_slot_t * old = index_slots;
+    unsigned int old_size = old ? 1u << index_bits : 0;
+
+    index_used = 0;
+    for (unsigned int i = 0; i < old_size; i++) {
+        if (old[i].param) {
+            index_used += index_insert(slots, bits, old[i].key, old[i].param);
+        }
+    }
+
+    index_slots = slots;
+    index_bits = bits;
+    free(old);
+    return 0;
+
+}
+
+void param_index_refresh(void) {
+
+    pthread_mutex_lock(&refresh_lock);
+
+    unsigned int count = 0;
+    param_list_iterator it = {};
+    while (param_list_iterate(&it) != NULL) {
+        count++;
+    }
+
+    unsigned int bits = PARAM_INDEX_MIN_BITS;
+    while ((1u << bits) < (count + 1) * 2) {
+        bits++;
+    }
+
+    param_index_slot_t * slots = calloc(1u << bits, sizeof(param_index_slot_t));
+    if (slots) {
+        unsigned int used = 0;
+        param_t * param;
+        it = (param_list_iterator) {};
+        while ((param = param_list_iterate(&it)) != NULL) {
+            /* Params added since the count are left to the lookup miss */
+            if ((used + 1) * 2 > (1u << bits))
+                break;
+            param_t * pinned = param_index_pin(param);
+            if (pinned) {
+                used += index_insert(slots, bits, index_key(param->node, param->id), pinned);
+            }
+        }
+
+        pthread_rwlock_wrlock(&index_lock);
+        param_index_slot_t * old = index_slots;
+        index_slots = slots;
+        index_bits = bits;
+        index_used = used;
+        pthread_rwlock_unlock(&index_lock);
+        free(old);
+    }
+
+    pthread_mutex_unlock(&refresh_lock);
+
+}
+
+static void * index_refresh_thread(void * arg) {
+    while (1) {
+        sleep(PARAM_INDEX_REFRESH_S);
+        param_index_refresh();
+    }
+    return NULL;
+}
+
+int param_index_start(void) {
+
+    if (__atomic_exchange_n(&refresh_running, 1, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    param_index_refresh();
+    if (pthread_create(&refresh_thread, NULL, index_refresh_thread, NULL) != 0) {
+        printf("Cannot start param index refresh\n");
+        __atomic_store_n(&refresh_running, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    pthread_detach(refresh_thread);
+    return 0;
+
+}
+
+param_t * param_index_find(int node, int id) {
+
+    uint32_t key = index_key(node, id);
+
+    pthread_rwlock_rdlock(&index_lock);
+    param_t * param = index_lookup(key);
+    pthread_rwlock_unlock(&index_lock);
+
+    if (param) {
+        return param;
+    }
+
+    /* Not indexed yet, added since the last refresh */
+    param = param_list_find_id(node, id);
+    if (param == NULL) {
+        return NULL;
+    }
+
+    param_t * pinned = param_index_pin(param);
+    if (pinned) {
+        pthread_rwlock_wrlock(&index_lock);
+        if (index_grow() == 0) {
+            index_used += index_insert(index_slots, index_bits, key, pinned);
+        }
+        pthread_rwlock_unlock(&index_lock);
+    }
+
+    return pinned;
+
+}
+
+unsigned int param_index_count(void) {
+    return index_used;
+}
+
+/**
+ * Pinned copies are chained per node:id bucket and never freed, so they stay
+ * valid in sink queues and caches after the list entry is gone. A copy is
+ * only made for metadata not seen before, so list refreshes reuse them.
+ */
+
+typedef struct param_pin_s {
+    param_t param;
+    struct param_pin_s * next;
+    char strings[];
+} param_pin_t;
+
+static pthread_rwlock_t pin_lock = PTHREAD_RWLOCK_INITIALIZER;
+static param_pin_t * pin_buckets[1u << PARAM_PIN_BITS];
+
+static int pin_match(const param_t * pin, const param_t * param) {
+    return pin->node == param->node && pin->id == param->id && pin->type == param->type &&
+           pin->mask == param->mask && pin->array_size == param->array_size &&
+           strcmp(pin->name, param->name) == 0 &&
+           strcmp(pin->unit, param->unit ? param->unit : "") == 0;
+}
+
+static param_t * pin_lookup(param_pin_t * pin, const param_t * param) {
+    for (; pin != NULL; pin = pin->next) {
+        if (pin_match(&pin->param, param))
+            return &pin->param;
+    }
+    return NULL;
+}
+
+param_t * param_index_pin(const param_t * param) {
+
+    param_pin_t ** bucket = &pin_buckets[index_home(index_key(param->node, param->id), PARAM_PIN_BITS)];
+
+    pthread_rwlock_rdlock(&pin_lock);
+    param_t * found = pin_lookup(*bucket, param);
+    pthread_rwlock_unlock(&pin_lock);
+
+    if (found) {
+        return found;
+    }
+
+    const char * unit = param->unit ? param->unit : "";
+    size_t name_len = strlen(param->name) + 1;
+    size_t unit_len = strlen(unit) + 1;
+
+    pthread_rwlock_wrlock(&pin_lock);
+
+    /* Another thread may have pinned it in the meantime */
+    found = pin_lookup(*bucket, param);
+    if (found == NULL) {
+        param_pin_t * pin = malloc(sizeof(param_pin_t) + name_len + unit_len);
+        if (pin) {
+            /* Metadata only, the sinks never touch the value or the list links */
+            pin->param = *param;
+            pin->param.name = memcpy(pin->strings, param->name, name_len);
+            pin->param.unit = memcpy(pin->strings + name_len, unit, unit_len);
+            pin->param.docstr = "";
+            pin->param.addr = NULL;
+            pin->param.timestamp = NULL;
+            pin->param.callback = NULL;
+            pin->next = *bucket;
+            *bucket = pin;
+            found = &pin->param;
+        }
+    }
+
+    pthread_rwlock_unlock(&pin_lock);
+    return found;
+
+}
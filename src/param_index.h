@@ -0,0 +1,36 @@
+/*
+ * param_index.h
+ *
+ * Hashed node:id -> param_t lookup for the sniffer hot path.
+ *
+ * The index is rebuilt from the parameter list every second by a refresh
+ * thread and filled from param_list_find_id() on a miss. It returns pinned
+ * copies (see param_index_pin()), so a param that libparam frees in
+ * between is never handed out. Params removed from the list are still
+ * found until the next rebuild.
+ */
+
+#ifndef SRC_PARAM_INDEX_H_
+#define SRC_PARAM_INDEX_H_
+
+#include <param/param.h>
+
+/* Returns a pinned copy, only the metadata can be used */
+param_t * param_index_find(int node, int id);
+unsigned int param_index_count(void);
+
+/* Rebuilds the index from the list now, in the calling thread */
+void param_index_refresh(void);
+
+/* Starts the refresh thread, once. Returns -1 if it could not start */
+int param_index_start(void);
+
+/**
+ * Returns a copy of the metadata of param (node, id, type, mask, name, unit
+ * and array size) that is never freed, for use after param may have been
+ * removed from the list. Calls with equal metadata return the same copy.
+ * Returns NULL if out of memory.
+ */
+param_t * param_index_pin(const param_t * param);
+
+#endif /* SRC_PARAM_INDEX_H_ */
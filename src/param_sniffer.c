@@ -3,9 +3,26 @@
  *
  *  Created on: Aug 29, 2018
  *      Author: johan
+ *
+ * The sniffer runs as a three stage pipeline:
+ *
+ *   reader   csp_promisc_read() and header filtering only (sniffer_filter.c)
+ *   decoder  N threads, sharded by source node: CRC, mpack decode
+ *   sinks    one thread per sink with its own queue (sniffer_sink.c):
+ *            archive, logfile, Victoria Metrics, Prometheus, VTS and any
+ *            sink registered by an APM
+ *
+ * The logfile is written by its own thread (log_writer.c), so disk stalls
+ * do not reach the sink stage.
+ *
+ * Stages are connected by lock-free rings (ring.c). If a decoder falls
+ * behind, its packet ring fills and the reader drops (and reports)
+ * packets, instead of letting the promiscuous queue overflow silently.
  */
 
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <param/param_server.h>
@@ -14,10 +31,30 @@
 #include <csp/csp.h>
 #include <csp/csp_crc32.h>
 
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include "param_sniffer.h"
 #include "hk_param_sniffer.h"
 #include "prometheus.h"
 #include "victoria_metrics.h"
 #include "vts.h"
+#include "param_archive.h"
+#include "param_index.h"
+#include "ring.h"
+#include "metric_format.h"
+#include "sniffer_stats.h"
+#include "sniffer_filter.h"
+#include "log_writer.h"
+#include "sniffer_replay.h"
+#include "sniffer_sink.h"
+#include "remote_write.h"
+#include "sniffer_aggregate.h"
+
+#define SNIFFER_WORKERS_MAX     8
+#define SNIFFER_PACKET_QUEUE    256
+
+uint64_t clock_get_nsec(void);
 
 extern int prometheus_started;
 
@@ -25,13 +62,131 @@ extern int vm_running;
 
 int sniffer_running = 0;
 pthread_t param_sniffer_thread;
-FILE *logfile;
+static log_writer_t * logfile;
+static log_writer_conf_t logfile_conf = {
+    .path = "param_sniffer.log",
+};
 
 static unsigned int hk_node = 0;
 
-int param_sniffer_log(void * ctx, param_queue_t *queue, param_t *param, int offset, void *reader, long unsigned int timestamp) {
+static unsigned int sniffer_workers = 2;
+static pthread_t sniffer_worker_threads[SNIFFER_WORKERS_MAX];
+static ring_t * sniffer_packet_rings[SNIFFER_WORKERS_MAX];
+
+/* A packet queued for a decoder, with the options of its source */
+typedef struct {
+    csp_packet_t * packet;
+    unsigned int hk_node;
+    int mute;
+} sniffer_job_t;
+
+/* Per decoder queue, so param_sniffer_drain() knows when a packet is done */
+static struct {
+    uint64_t queued;
+    uint64_t done;
+} __attribute__((aligned(64))) sniffer_packet_counts[SNIFFER_WORKERS_MAX];
+
+/* Set by a decoder while it handles a muted job */
+static __thread int sniffer_muted;
+
+/* Built-in sinks, each called on its own thread by sniffer_sink.c */
+
+static int param_sniffer_archive_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return param_archive_running;
+}
+
+static void param_sniffer_archive_add(const param_sniffer_sample_t * sample, void * ctx) {
+    param_archive_add(sample->param, sample->idx, sample->value, sample->time_ms);
+}
+
+static int param_sniffer_vm_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return vm_running && !sniffer_aggregate_replaces(sample->param);
+}
+
+static void param_sniffer_vm_add(const param_sniffer_sample_t * sample, void * ctx) {
+    vm_add_sample(sample);
+}
+
+static int param_sniffer_rw_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return rw_running;
+}
 
-    char tmp[1000] = {};
+static void param_sniffer_rw_add(const param_sniffer_sample_t * sample, void * ctx) {
+    rw_add_sample(sample);
+}
+
+static int param_sniffer_prometheus_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return prometheus_started && !sniffer_aggregate_replaces(sample->param);
+}
+
+static void param_sniffer_prometheus_add(const param_sniffer_sample_t * sample, void * ctx) {
+    prometheus_add_sample(sample);
+}
+
+static int param_sniffer_aggregate_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return sniffer_aggregate_match(sample->param);
+}
+
+static void param_sniffer_aggregate_add(const param_sniffer_sample_t * sample, void * ctx) {
+    sniffer_aggregate_add(sample);
+}
+
+static int param_sniffer_logfile_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return logfile != NULL;
+}
+
+static void param_sniffer_logfile_add(const param_sniffer_sample_t * sample, void * ctx) {
+    char line[METRIC_LINE_MAX];
+    size_t len = metric_format_sample(line, sizeof(line), sample);
+    log_writer_write(logfile, line, len);
+}
+
+static int param_sniffer_vts_accept(const param_sniffer_sample_t * sample, void * ctx) {
+    return check_vts(sample->param->node, sample->param->id);
+}
+
+static void param_sniffer_vts_add(const param_sniffer_sample_t * sample, void * ctx) {
+    vts_add_sample(sample);
+}
+
+static void param_sniffer_register_sinks(void) {
+
+    /* Files keep every sample, live views prefer fresh samples over old ones */
+    static const sniffer_sink_conf_t builtin[] = {
+        {.name = "archive", .add = param_sniffer_archive_add, .accept = param_sniffer_archive_accept, .policy = SNIFFER_SINK_BLOCK},
+        {.name = "logfile", .add = param_sniffer_logfile_add, .accept = param_sniffer_logfile_accept, .policy = SNIFFER_SINK_BLOCK},
+        {.name = "vm", .add = param_sniffer_vm_add, .accept = param_sniffer_vm_accept, .policy = SNIFFER_SINK_DROP_OLDEST},
+        {.name = "remote_write", .add = param_sniffer_rw_add, .accept = param_sniffer_rw_accept, .policy = SNIFFER_SINK_DROP_OLDEST},
+        {.name = "prometheus", .add = param_sniffer_prometheus_add, .accept = param_sniffer_prometheus_accept, .policy = SNIFFER_SINK_DROP_OLDEST},
+        {.name = "aggregate", .add = param_sniffer_aggregate_add, .accept = param_sniffer_aggregate_accept, .policy = SNIFFER_SINK_BLOCK},
+        {.name = "vts", .add = param_sniffer_vts_add, .accept = param_sniffer_vts_accept, .policy = SNIFFER_SINK_DROP_OLDEST},
+    };
+
+    for (unsigned int i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+        sniffer_sink_register(&builtin[i]);
+    }
+
+}
+
+static void param_sniffer_emit(const param_sniffer_sample_t * sample) {
+
+    switch (sample->param->type) {
+        case PARAM_TYPE_STRING:
+        case PARAM_TYPE_DATA:
+            return;
+        default:
+            break;
+    }
+
+    if (sniffer_muted) {
+        return;
+    }
+
+    sniffer_sink_emit(sample);
+
+}
+
+int param_sniffer_log(void * ctx, param_queue_t *queue, param_t *param, int offset, void *reader, long unsigned int timestamp) {
 
     if (offset < 0)
         offset = 0;
@@ -44,9 +199,6 @@ int param_sniffer_log(void * ctx, param_queue_t *queue, param_t *param, int offs
         count = mpack_expect_array(reader);
     }
 
-    double vts_arr[4];
-    int vts = check_vts(param->node, param->id);
-
     uint64_t time_ms;
     if (timestamp > 0) {
         time_ms = timestamp * 1000;
@@ -58,6 +210,14 @@ int param_sniffer_log(void * ctx, param_queue_t *queue, param_t *param, int offs
 
     for (int i = offset; i < offset + count; i++) {
 
+        param_sniffer_sample_t sample = {
+            .param = param,
+            .time_ms = time_ms,
+            .idx = i,
+            .offset = offset,
+            .count = count,
+        };
+
         switch (param->type) {
             case PARAM_TYPE_UINT8:
             case PARAM_TYPE_XINT8:
@@ -65,62 +225,43 @@ int param_sniffer_log(void * ctx, param_queue_t *queue, param_t *param, int offs
             case PARAM_TYPE_XINT16:
             case PARAM_TYPE_UINT32:
             case PARAM_TYPE_XINT32:
-                sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %u %"PRIu64"\n", param->name, param->node, i, mpack_expect_uint(reader), time_ms);
+                sample.value.u = mpack_expect_uint(reader);
                 break;
             case PARAM_TYPE_UINT64:
             case PARAM_TYPE_XINT64:
-                sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %"PRIu64" %"PRIu64"\n", param->name, param->node, i, mpack_expect_u64(reader), time_ms);
+                sample.value.u = mpack_expect_u64(reader);
                 break;
             case PARAM_TYPE_INT8:
             case PARAM_TYPE_INT16:
             case PARAM_TYPE_INT32:
-                sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %d %"PRIu64"\n", param->name, param->node, i, mpack_expect_int(reader), time_ms);
+                sample.value.i = mpack_expect_int(reader);
                 break;
             case PARAM_TYPE_INT64:
-                sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %"PRIi64" %"PRIu64"\n", param->name, param->node, i, mpack_expect_i64(reader), time_ms);
+                sample.value.i = mpack_expect_i64(reader);
                 break;
             case PARAM_TYPE_FLOAT:
-                sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %e %"PRIu64"\n", param->name, param->node, i, mpack_expect_float(reader), time_ms);
+                sample.value.d = mpack_expect_float(reader);
                 break;
-            case PARAM_TYPE_DOUBLE: {
-                double tmp_dbl = mpack_expect_double(reader);
-                sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %e %"PRIu64"\n", param->name, param->node, i, tmp_dbl, time_ms);
-                if(vts){
-                    vts_arr[i] = tmp_dbl;
-                }
+            case PARAM_TYPE_DOUBLE:
+                sample.value.d = mpack_expect_double(reader);
                 break;
-            }
-                
 
             case PARAM_TYPE_STRING:
             case PARAM_TYPE_DATA:
             default:
                 mpack_discard(reader);
-                break;
+                continue;
         }
 
         if (mpack_reader_error(reader) != mpack_ok) {
+            sniffer_stat_inc(SNIFFER_STAT_MPACK_ERR);
             break;
         }
 
-        if(vm_running){
-            vm_add(tmp);
-        }
-
-        if(prometheus_started){
-            prometheus_add(tmp);
-        }
-
-        if (logfile) {
-            fprintf(logfile, "%s", tmp);
-            fflush(logfile);
-        }
+        sniffer_stat_inc(SNIFFER_STAT_SAMPLES);
+        param_sniffer_emit(&sample);
     }
 
-    if(vts){
-        vts_add(vts_arr, param->id, count, time_ms);
-    } 
-
     return 0;
 }
 
@@ -130,99 +271,280 @@ int param_sniffer_crc(csp_packet_t * packet) {
     if (packet->id.flags & CSP_FCRC32) {
         if (packet->length < 4) {
             printf("Too short packet for CRC32, %u\n", packet->length);
+            sniffer_stat_inc(SNIFFER_STAT_CRC_ERR);
             return -1;
         }
         /* Verify CRC32 (does not include header for backwards compatability with csp1.x) */
         if (csp_crc32_verify(packet) != 0) {
             /* Checksum failed */
             printf("CRC32 verification error! Discarding packet\n");
+            sniffer_stat_inc(SNIFFER_STAT_CRC_ERR);
             return -1;
         }
     }
     return 0;
 }
 
-static void * param_sniffer(void * param) {
-    csp_promisc_enable(100);
-    while(1) {
-        csp_packet_t * packet = csp_promisc_read(CSP_MAX_DELAY);
+/* Decoder stage for param server pull responses */
+static void param_sniffer_decode(csp_packet_t * packet) {
 
-        if (packet->id.src == hk_node) {
-            hk_param_sniffer(packet);
-            csp_buffer_free(packet);
-            continue;
-        }
+    if (param_sniffer_crc(packet) < 0) {
+        return;
+    }
+
+    uint8_t type = packet->data[0];
+    int queue_version;
+    if (type == PARAM_PULL_RESPONSE) {
+        queue_version = 1;
+    } else {
+        queue_version = 2;
+    }
 
-        if (packet->id.sport != PARAM_PORT_SERVER) {
-            csp_buffer_free(packet);
+    param_queue_t queue;
+    param_queue_init(&queue, &packet->data[2], packet->length - 2, packet->length - 2, PARAM_QUEUE_TYPE_SET, queue_version);
+    queue.last_node = packet->id.src;
+
+    /* Ids are only tested against the rules this packet matched */
+    uint64_t rules = sniffer_filter_packet(packet->id.src, packet->id.sport);
+
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, queue.buffer, queue.used);
+    while(reader.data < reader.end) {
+        int id, node, offset = -1;
+        long unsigned int timestamp = 0;
+        param_deserialize_id(&reader, &id, &node, &timestamp, &offset, &queue);
+        if (node == 0) {
+            node = packet->id.src;
+        }
+        if (!sniffer_filter_param(rules, id)) {
+            mpack_discard(&reader);
+            if (mpack_reader_error(&reader) != mpack_ok) {
+                sniffer_stat_inc(SNIFFER_STAT_MPACK_ERR);
+                break;
+            }
             continue;
         }
+        /* If parameter timestamp is not inside the header, and the lower layer found a timestamp*/
+        if ((timestamp == 0) && (packet->timestamp_rx != 0)) {
+            timestamp = packet->timestamp_rx;
+        }
+        param_t * param = param_index_find(node, id);
+        if (param) {
+            param_sniffer_log(NULL, &queue, param, offset, &reader, timestamp);
+        } else {
+            printf("Found unknown param node %d id %d\n", node, id);
+            sniffer_stat_inc(SNIFFER_STAT_UNKNOWN);
+            break;
+        }
+    }
+
+}
+
+static void * param_sniffer_worker(void * arg) {
+
+    unsigned int worker = (uintptr_t) arg;
+    ring_t * ring = sniffer_packet_rings[worker];
+    sniffer_job_t job;
 
-        if (param_sniffer_crc(packet) < 0) {
-            csp_buffer_free(packet);
+    while (1) {
+        if (ring_pop_wait(ring, &job, 1000) < 0) {
             continue;
         }
+        uint64_t start = clock_get_nsec();
+        sniffer_muted = job.mute;
+        if (job.packet->id.src == job.hk_node) {
+            hk_param_sniffer(job.packet);
+            sniffer_hist_add(SNIFFER_HIST_HK, clock_get_nsec() - start);
+        } else {
+            param_sniffer_decode(job.packet);
+            sniffer_hist_add(SNIFFER_HIST_DECODE, clock_get_nsec() - start);
+        }
+        csp_buffer_free(job.packet);
+        __atomic_fetch_add(&sniffer_packet_counts[worker].done, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/* Reader stage: header checks only, everything else happens on the decoders */
+static int param_sniffer_accept(csp_packet_t * packet, unsigned int hk) {
 
-        uint8_t type = packet->data[0];
-        if ((type != PARAM_PULL_RESPONSE) && (type != PARAM_PULL_RESPONSE_V2)) {
-            csp_buffer_free(packet);
+    if (!sniffer_filter_packet(packet->id.src, packet->id.sport)) {
+        sniffer_stat_inc(SNIFFER_STAT_FILTERED);
+        return 0;
+    }
+
+    if (packet->id.src == hk) {
+        return packet->id.sport == HK_PARAM_PORT;
+    }
+
+    if (packet->id.sport != PARAM_PORT_SERVER || packet->length < 2) {
+        return 0;
+    }
+
+    uint8_t type = packet->data[0];
+    return (type == PARAM_PULL_RESPONSE) || (type == PARAM_PULL_RESPONSE_V2);
+
+}
+
+void param_sniffer_dispatch(csp_packet_t * packet, const param_sniffer_source_t * source) {
+
+    static unsigned int dropped = 0;
+    static time_t last_report = 0;
+
+    sniffer_job_t job = {
+        .packet = packet,
+        .hk_node = (source && source->hk_node) ? (unsigned int) source->hk_node : hk_node,
+        .mute = source && source->mute,
+    };
+
+    if (!param_sniffer_accept(packet, job.hk_node)) {
+        csp_buffer_free(packet);
+        return;
+    }
+    sniffer_stat_inc(SNIFFER_STAT_ACCEPTED);
+
+    unsigned int worker = packet->id.src % sniffer_workers;
+    while (ring_push(sniffer_packet_rings[worker], &job) < 0) {
+        if (source && source->wait) {
+            usleep(50);
             continue;
         }
+        csp_buffer_free(packet);
+        sniffer_stat_inc(SNIFFER_STAT_DROPPED);
+        dropped++;
+        time_t now = time(NULL);
+        if (now != last_report) {
+            printf("Sniffer decoder %u is behind, %u packets dropped\n", worker, dropped);
+            last_report = now;
+        }
+        return;
+    }
+    __atomic_fetch_add(&sniffer_packet_counts[worker].queued, 1, __ATOMIC_RELAXED);
 
-        int queue_version;
-        if (type == PARAM_PULL_RESPONSE) {
-            queue_version = 1;
-        } else {
-            queue_version = 2;
+}
+
+void param_sniffer_drain(void) {
+
+    if (!sniffer_running) {
+        return;
+    }
+
+    /* Packets queued later, e.g. live traffic, are not waited for */
+    for (unsigned int i = 0; i < sniffer_workers; i++) {
+        uint64_t queued = __atomic_load_n(&sniffer_packet_counts[i].queued, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&sniffer_packet_counts[i].done, __ATOMIC_ACQUIRE) < queued) {
+            usleep(1000);
         }
+    }
+    sniffer_sink_drain();
 
-        param_queue_t queue;
-        param_queue_init(&queue, &packet->data[2], packet->length - 2, packet->length - 2, PARAM_QUEUE_TYPE_SET, queue_version);
-        queue.last_node = packet->id.src;
+}
 
-        mpack_reader_t reader;
-        mpack_reader_init_data(&reader, queue.buffer, queue.used);
-        while(reader.data < reader.end) {
-            int id, node, offset = -1;
-            long unsigned int timestamp = 0;
-            param_deserialize_id(&reader, &id, &node, &timestamp, &offset, &queue);
-            if (node == 0) {
-                node = packet->id.src;
-            }
-            /* If parameter timestamp is not inside the header, and the lower layer found a timestamp*/
-            if ((timestamp == 0) && (packet->timestamp_rx != 0)) {
-                timestamp = packet->timestamp_rx;
-            }
-            param_t * param = param_list_find_id(node, id);
-            if (param) {	
-                param_sniffer_log(NULL, &queue, param, offset, &reader, timestamp);
-            } else {
-                printf("Found unknown param node %d id %d\n", node, id);
-                break;
-            }
+static void * param_sniffer(void * param) {
+
+    csp_promisc_enable(100);
+    while(1) {
+        csp_packet_t * packet = csp_promisc_read(CSP_MAX_DELAY);
+        if (packet == NULL) {
+            continue;
         }
-        csp_buffer_free(packet);
+        sniffer_stat_inc(SNIFFER_STAT_RX);
+
+        if (sniffer_recording) {
+            sniffer_record(packet);
+        }
+
+        param_sniffer_dispatch(packet, NULL);
     }
     return NULL;
 }
 
-void param_sniffer_init(int add_logfile, int node) {
+int param_sniffer_init(int add_logfile, int node) {
 
     if(sniffer_running){
-        return;
+        if (node && (unsigned int) node != hk_node) {
+            printf("Sniffer already running with housekeeping node %u, cannot change it to %d\n", hk_node, node);
+            return -1;
+        }
+        return 0;
     }
 
     hk_node = node;
 
     if (add_logfile) {
-        logfile = fopen("param_sniffer.log", "a");
+        logfile = log_writer_open(&logfile_conf);
         if (logfile) {
-            printf("Logging parameters to param_sniffer.log\n");
+            printf("Logging parameters to %s\n", logfile_conf.path);
         } else {
-            printf("Couldn't open param_sniffer.log for append\n");
+            printf("Couldn't open %s for append\n", logfile_conf.path);
+        }
+    }
+
+    for (unsigned int i = 0; i < sniffer_workers; i++) {
+        sniffer_packet_rings[i] = ring_create(sizeof(sniffer_job_t), SNIFFER_PACKET_QUEUE);
+        if (sniffer_packet_rings[i] == NULL) {
+            printf("Failed to allocate sniffer queues\n");
+            return -1;
         }
-    }	
+    }
+
+    param_sniffer_register_sinks();
+    param_index_start();
 
     sniffer_running = 1;
+    for (unsigned int i = 0; i < sniffer_workers; i++) {
+        pthread_create(&sniffer_worker_threads[i], NULL, &param_sniffer_worker, (void *) (uintptr_t) i);
+    }
     pthread_create(&param_sniffer_thread, NULL, &param_sniffer, NULL);
+    return 0;
+}
+
+static int sniffer_start_cmd(struct slash * slash) {
+
+    int hk = 0;
+    int add_logfile = 0;
+    unsigned int workers = sniffer_workers;
+    unsigned int flush_ms = 1000;
+    unsigned int rotate_mb = 0;
+    unsigned int rotate_s = 0;
+
+    optparse_t * parser = optparse_new("sniffer start", "");
+    optparse_add_help(parser);
+    optparse_add_int(parser, 'n', "hk_node", "NUM", 0, &hk, "Housekeeping node");
+    optparse_add_set(parser, 'l', "logfile", 1, &add_logfile, "Enable logging to param_sniffer.log");
+    optparse_add_unsigned(parser, 'w', "workers", "NUM", 0, &workers, "Number of decoder threads (default = 2)");
+    optparse_add_unsigned(parser, 'f', "flush", "MS", 0, &flush_ms, "Max time log lines stay buffered (default = 1000)");
+    optparse_add_set(parser, 's', "sync", 1, &logfile_conf.sync, "fdatasync the logfile on every flush");
+    optparse_add_unsigned(parser, 'r', "rotate-mb", "NUM", 0, &rotate_mb, "Rotate the logfile at this size in MB (default = never)");
+    optparse_add_unsigned(parser, 't', "rotate-s", "NUM", 0, &rotate_s, "Rotate the logfile at this age in seconds (default = never)");
+    optparse_add_set(parser, 'z', "gzip", 1, &logfile_conf.compress, "gzip rotated logfiles");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (sniffer_running) {
+        printf("Sniffer already running with %u decoders\n", sniffer_workers);
+        optparse_del(parser);
+        return SLASH_SUCCESS;
+    }
+
+    if (workers < 1 || workers > SNIFFER_WORKERS_MAX) {
+        printf("Workers must be between 1 and %u\n", SNIFFER_WORKERS_MAX);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    sniffer_workers = workers;
+    logfile_conf.flush_ms = flush_ms;
+    logfile_conf.rotate_size = (size_t) rotate_mb * 1024 * 1024;
+    logfile_conf.rotate_s = rotate_s;
+    param_sniffer_init(add_logfile, hk);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
 }
+slash_command_sub(sniffer, start, sniffer_start_cmd, "", "Start parameter sniffer");
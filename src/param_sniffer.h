@@ -8,10 +8,61 @@
 #ifndef SRC_PARAM_SNIFFER_H_
 #define SRC_PARAM_SNIFFER_H_
 
+#include <stdint.h>
 #include <csp/csp.h>
+#include <param/param.h>
+#include <param/param_queue.h>
+
+typedef union {
+    uint64_t u;
+    int64_t i;
+    double d;
+} param_sniffer_value_t;
+
+/* One decoded array element, as handed from the decoders to the sinks */
+typedef struct {
+    param_t * param;        /* Pinned copy, see param_index_pin() */
+    uint64_t time_ms;
+    param_sniffer_value_t value;
+    uint16_t idx;
+    uint16_t offset;        /* First index of the array run this sample belongs to */
+    uint16_t count;         /* Number of elements in that run */
+} param_sniffer_sample_t;
+
+static inline double param_sniffer_value_double(const param_sniffer_sample_t * sample) {
+    switch (sample->param->type) {
+        case PARAM_TYPE_INT8:
+        case PARAM_TYPE_INT16:
+        case PARAM_TYPE_INT32:
+        case PARAM_TYPE_INT64:
+            return sample->value.i;
+        case PARAM_TYPE_FLOAT:
+        case PARAM_TYPE_DOUBLE:
+            return sample->value.d;
+        default:
+            return sample->value.u;
+    }
+}
 
 int param_sniffer_crc(csp_packet_t * packet);
+/* param must come from param_index_find(), the samples outlive this call in the sink queues */
 int param_sniffer_log(void * ctx, param_queue_t *queue, param_t *param, int offset, void *reader, long unsigned int timestamp);
-void param_sniffer_init(int add_logfile, int node);
+/* Returns -1 if the sniffer could not start, or is already running with another hk node */
+int param_sniffer_init(int add_logfile, int node);
+
+/* Options for packets not read by the sniffer itself */
+typedef struct {
+    int wait;       /* Wait for room in a full decoder queue instead of dropping the packet */
+    int mute;       /* Decode only, do not feed the samples to any sink */
+    int hk_node;    /* Housekeeping node of these packets, 0 = the sniffer's */
+} param_sniffer_source_t;
+
+/* Hands a received packet to the decoders, as the reader thread does. Takes
+ * ownership of packet. source NULL = as a live packet */
+void param_sniffer_dispatch(csp_packet_t * packet, const param_sniffer_source_t * source);
+
+/* Waits until every packet dispatched so far, and the samples decoded from
+ * it, has been processed */
+void param_sniffer_drain(void);
 
 #endif /* SRC_PARAM_SNIFFER_H_ */
@@ -6,11 +6,11 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+#include <sched.h>
 
 #include <slash/slash.h>
 #include <slash/optparse.h>
@@ -21,96 +21,277 @@
 #include "prometheus.h"
 #include "param_sniffer.h"
 #include "hk_param_sniffer.h"
+#include "metric_format.h"
+#include "prometheus_series.h"
+#include "sniffer_stats.h"
+#include "sniffer_sink.h"
+#include "sniffer_aggregate.h"
+#include "http_server.h"
+#include "compress.h"
 
-static pthread_t prometheus_tread;
-int prometheus_started = 0;
+uint64_t clock_get_nsec(void);
 
-static char prometheus_buf[10*1024*1024] = {0};
-static int prometheus_buf_len = 0;
-static int listen_fd;
+static http_server_t * prometheus_server;
+int prometheus_started = 0;
 
-static char header[1024] =
-		"HTTP/1.1 200 OK;\r\n"
-		"Content-Type: text/plain;\r\n\r\n";
+/* Free form lines from prometheus_add(), sent once on the next scrape.
+ * Writers append to the active buffer without locking: one atomic add on
+ * prometheus_buf_state picks both the buffer and the offset. The scraper
+ * swaps buffers and drains the frozen one once its writers are done. */
+#define PROMETHEUS_BUF_SIZE	(1024*1024)
+#define PROMETHEUS_BUF_ACTIVE	(1ull << 63)
+
+typedef struct {
+	uint32_t done;		/* Bytes fully written */
+	char data[PROMETHEUS_BUF_SIZE];
+} prometheus_buf_t;
+
+static prometheus_buf_t prometheus_bufs[2];
+static uint64_t prometheus_buf_state;
+
+/* Only serializes the readers, the scraper and prometheus_clear() */
+static pthread_mutex_t prometheus_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Scrape response, reused between scrapes. Only the server thread renders */
+static char * scrape_buf;
+static size_t scrape_size;
+static size_t scrape_len;
+
+/* A scrape is served again from cache while nothing it shows has changed,
+ * for at most PROMETHEUS_CACHE_S so our own counters do not go stale */
+#define PROMETHEUS_CACHE_S	30
+static uint64_t scrape_key;
+static uint64_t scrape_time;
+
+/* Compressed copies of the current scrape, made on first request */
+typedef struct {
+	compress_t * compress;
+	char * buf;
+	size_t size;
+	long len;		/* -1 = not made for this scrape */
+} prometheus_encoded_t;
+
+static prometheus_encoded_t scrape_encoded[] = {
+	[COMPRESS_GZIP] = {.len = -1},
+	[COMPRESS_ZSTD] = {.len = -1},
+};
+
+/* Swaps buffers and returns the frozen one, complete. Call with prometheus_drain_lock held */
+static prometheus_buf_t * prometheus_buf_freeze(uint32_t * len) {
+
+	uint64_t state = __atomic_load_n(&prometheus_buf_state, __ATOMIC_RELAXED);
+	state = __atomic_exchange_n(&prometheus_buf_state, (state & PROMETHEUS_BUF_ACTIVE) ^ PROMETHEUS_BUF_ACTIVE, __ATOMIC_ACQ_REL);
+
+	prometheus_buf_t * buf = &prometheus_bufs[state >> 63];
+	uint64_t used = state & ~PROMETHEUS_BUF_ACTIVE;
+	*len = used < PROMETHEUS_BUF_SIZE ? used : PROMETHEUS_BUF_SIZE;
+
+	/* Writers that got an offset before the swap may still be copying */
+	while (__atomic_load_n(&buf->done, __ATOMIC_ACQUIRE) < *len) {
+		sched_yield();
+	}
+	return buf;
 
+}
 
-void * prometheus_exporter(void * param) {
+static size_t prometheus_scrape(void) {
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	size_t len = 0;
 
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
-    	printf("setsockopt(SO_REUSEADDR) failed\n");
+	/* Latest value of every series */
+	len = prometheus_series_render(&scrape_buf, &scrape_size, len);
+	sniffer_stat_set(SNIFFER_STAT_PROM_SERIES, prometheus_series_count());
 
-	struct sockaddr_in server_addr = {0};
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	server_addr.sin_port = htons(9101);
+	/* Summaries of the last completed aggregation window */
+	uint64_t completed = sniffer_aggregate_completed();
+	if (completed) {
+		len = sniffer_aggregate_render(&scrape_buf, &scrape_size, len, completed - 1);
+	}
 
-retry_bind:
-	if (bind(listen_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-		printf("Cannot bind prometheus to port 9101\n");
-		sleep(1);
-		goto retry_bind;
+	/* Our own counters */
+	len = sniffer_stats_render(&scrape_buf, &scrape_size, len);
+	len = sniffer_sink_render(&scrape_buf, &scrape_size, len);
+
+	/* Queued free form lines */
+	pthread_mutex_lock(&prometheus_drain_lock);
+	uint32_t lines_len;
+	prometheus_buf_t * lines = prometheus_buf_freeze(&lines_len);
+	if (scrape_size < len + lines_len) {
+		char * grown = realloc(scrape_buf, len + lines_len);
+		if (grown) {
+			scrape_buf = grown;
+			scrape_size = len + lines_len;
+		}
+	}
+	if (scrape_size >= len + lines_len) {
+		memcpy(scrape_buf + len, lines->data, lines_len);
+		len += lines_len;
 	} else {
-		printf("Prometheus exporter listening on port 9101\n");
+		sniffer_stat_add(SNIFFER_STAT_PROM_FULL, lines_len);
 	}
+	lines->done = 0;
+	pthread_mutex_unlock(&prometheus_drain_lock);
 
-	listen(listen_fd, 100);
+	return len;
 
-	while(1) {
+}
 
-		struct sockaddr_in client_addr;
-		socklen_t client_addr_len;
-		int conn_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_addr_len);
+static uint64_t prometheus_scrape_key(void) {
 
-		char in[1024];
-		int bread = recv(conn_fd, in, 1024, MSG_NOSIGNAL);
-		if (bread == 0) {
-			close(conn_fd);
-			continue;
-		}
+	uint64_t key = prometheus_series_generation();
+	key = key * 31 + sniffer_stats[SNIFFER_STAT_RX];
+	key = key * 31 + sniffer_stats[SNIFFER_STAT_VM_PUSHES];
+	key = key * 31 + sniffer_stats[SNIFFER_STAT_VM_PUSH_ERR];
+	key = key * 31 + sniffer_aggregate_completed();
+	return key;
 
-		if (strncmp(in, "GET /metrics", 12) != 0) {
-			close(conn_fd);
-			continue;
-		}
+}
+
+/* Renders a new scrape unless the last one is still current */
+static void prometheus_scrape_update(void) {
+
+	uint64_t now = clock_get_nsec();
+	uint64_t key = prometheus_scrape_key();
 
-		int written = send(conn_fd, header, strlen(header), MSG_NOSIGNAL);
+	int pending = (__atomic_load_n(&prometheus_buf_state, __ATOMIC_RELAXED) & ~PROMETHEUS_BUF_ACTIVE) > 0;
 
-		/* Dump queued data */
-		written += send(conn_fd, prometheus_buf, prometheus_buf_len, MSG_NOSIGNAL);
-		//printf("Prometheus sent %d bytes\n", written);
+	if (scrape_time && key == scrape_key && !pending && now - scrape_time < PROMETHEUS_CACHE_S * 1000000000ULL) {
+		return;
+	}
 
-		prometheus_clear();
+	scrape_len = prometheus_scrape();
+	scrape_key = key;
+	scrape_time = now;
+	for (unsigned int i = 0; i < sizeof(scrape_encoded) / sizeof(scrape_encoded[0]); i++) {
+		scrape_encoded[i].len = -1;
+	}
 
-		shutdown(conn_fd, SHUT_RDWR);
+}
 
-		close(conn_fd);
+/* Returns the compressed scrape, or NULL if it cannot be made */
+static prometheus_encoded_t * prometheus_scrape_encode(compress_type_e type) {
 
+	prometheus_encoded_t * encoded = &scrape_encoded[type];
+	if (encoded->len >= 0) {
+		return encoded;
 	}
 
-	return NULL;
+	if (encoded->compress == NULL) {
+		encoded->compress = compress_create(type, 0);
+		if (encoded->compress == NULL) {
+			return NULL;
+		}
+	}
+
+	encoded->len = compress_run(encoded->compress, scrape_buf, scrape_len, &encoded->buf, &encoded->size);
+	return encoded->len >= 0 ? encoded : NULL;
+
+}
+
+static void prometheus_handler(const http_request_t * request, http_response_t * response, void * ctx) {
+
+	if (strcmp(request->method, "GET") != 0 && !request->head) {
+		response->status = 405;
+		response->headers = "Allow: GET, HEAD\r\n";
+		return;
+	}
+
+	if (strcmp(request->path, "/metrics") == 0) {
+		uint64_t start = clock_get_nsec();
+		prometheus_scrape_update();
+
+		response->content_type = "text/plain; version=0.0.4";
+		response->headers = "Vary: Accept-Encoding\r\n";
+		response->body = scrape_buf;
+		response->len = scrape_len;
+
+		char accept[128];
+		compress_type_e type = COMPRESS_NONE;
+		if (http_request_header(request, "Accept-Encoding", accept, sizeof(accept)) == 0) {
+			type = compress_negotiate(accept);
+		}
+		prometheus_encoded_t * encoded = type != COMPRESS_NONE ? prometheus_scrape_encode(type) : NULL;
+		if (encoded) {
+			response->headers = type == COMPRESS_ZSTD ?
+				"Content-Encoding: zstd\r\nVary: Accept-Encoding\r\n" :
+				"Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+			response->body = encoded->buf;
+			response->len = encoded->len;
+		}
+
+		sniffer_stat_inc(SNIFFER_STAT_PROM_SCRAPES);
+		sniffer_hist_add(SNIFFER_HIST_SCRAPE, clock_get_nsec() - start);
+	} else if (strcmp(request->path, "/health") == 0 || strcmp(request->path, "/-/healthy") == 0) {
+		response->body = "OK\n";
+		response->len = 3;
+	} else {
+		response->status = 404;
+	}
 
 }
 
 void prometheus_add(char * str) {
-	if (prometheus_buf_len + strlen(str) < 1024 * 1024 * 10) {
-		strcpy(prometheus_buf + prometheus_buf_len, str);
-		prometheus_buf_len += strlen(str);
+
+	size_t len = strlen(str);
+	if (len == 0 || len > PROMETHEUS_BUF_SIZE) {
+		return;
 	}
-	printf("prometheus add %s", str);
+
+	uint64_t state = __atomic_fetch_add(&prometheus_buf_state, len, __ATOMIC_ACQ_REL);
+	prometheus_buf_t * buf = &prometheus_bufs[state >> 63];
+	uint64_t offset = state & ~PROMETHEUS_BUF_ACTIVE;
+
+	if (offset + len <= PROMETHEUS_BUF_SIZE) {
+		memcpy(buf->data + offset, str, len);
+		__atomic_fetch_add(&buf->done, len, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* The line straddling the end still owns its part, blank lines are ignored by Prometheus */
+	if (offset < PROMETHEUS_BUF_SIZE) {
+		memset(buf->data + offset, '\n', PROMETHEUS_BUF_SIZE - offset);
+		__atomic_fetch_add(&buf->done, PROMETHEUS_BUF_SIZE - offset, __ATOMIC_RELEASE);
+	}
+	sniffer_stat_inc(SNIFFER_STAT_PROM_FULL);
+
+}
+
+void prometheus_add_sample(const param_sniffer_sample_t * sample) {
+	prometheus_series_update(sample);
 }
 
 void prometheus_clear(void) {
-	prometheus_buf_len = 0;
+	uint32_t len;
+	pthread_mutex_lock(&prometheus_drain_lock);
+	prometheus_buf_freeze(&len)->done = 0;
+	pthread_mutex_unlock(&prometheus_drain_lock);
 }
 
-void prometheus_init(void) {
-	pthread_create(&prometheus_tread, NULL, &prometheus_exporter, NULL);
+int prometheus_init(const char * addr, uint16_t port) {
+
+	if (scrape_buf == NULL) {
+		scrape_size = 64 * 1024;
+		scrape_buf = malloc(scrape_size);
+		if (scrape_buf == NULL) {
+			printf("Cannot allocate prometheus scrape buffer\n");
+			return -1;
+		}
+	}
+
+	http_server_conf_t conf = {
+		.name = "Prometheus exporter",
+		.addr = addr,
+		.port = port,
+		.handler = prometheus_handler,
+	};
+	prometheus_server = http_server_start(&conf);
+	return prometheus_server ? 0 : -1;
+
 }
 
 void prometheus_close(void) {
-	close(listen_fd);
+	http_server_stop(prometheus_server);
+	prometheus_server = NULL;
 }
 
 
@@ -120,20 +301,37 @@ static int prometheus_start_cmd(struct slash *slash) {
 
     int hk_node = 0;
     int logfile = 0;
+    unsigned int expire = 300;
+    char * addr = "0.0.0.0";
+    unsigned int port = 9101;
 
     optparse_t * parser = optparse_new("prometheus start", "");
     optparse_add_help(parser);
     optparse_add_int(parser, 'n', "hk_node", "NUM", 0, &hk_node, "Housekeeping node");
     optparse_add_set(parser, 'l', "logfile", 1, &logfile, "Enable logging to param_sniffer.log");
+    optparse_add_unsigned(parser, 'e', "expire", "SEC", 0, &expire, "Drop series not updated for SEC seconds, 0 = never (default = 300)");
+    optparse_add_string(parser, 'a', "addr", "ADDR", &addr, "Listen address (default = 0.0.0.0)");
+    optparse_add_unsigned(parser, 'p', "port", "NUM", 0, &port, "Listen port (default = 9101)");
 
     int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
 
     if (argi < 0) {
+        optparse_del(parser);
         return SLASH_EINVAL;
+    }
+
+    if (port == 0 || port > 65535) {
+        printf("Invalid port %u\n", port);
         optparse_del(parser);
+        return SLASH_EINVAL;
     }
 
-    prometheus_init();
+    prometheus_series_set_expiry(expire);
+    if (prometheus_init(addr, port) < 0) {
+        printf("Cannot start prometheus exporter\n");
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
     param_sniffer_init(logfile, hk_node);
     prometheus_started = 1;
     optparse_del(parser);
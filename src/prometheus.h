@@ -8,9 +8,15 @@
 #ifndef SRC_PROMETHEUS_H_
 #define SRC_PROMETHEUS_H_
 
+#include <stdint.h>
+
+#include "param_sniffer.h"
+
 void prometheus_clear(void);
 void prometheus_add(char * str);
-void prometheus_init(void);
+void prometheus_add_sample(const param_sniffer_sample_t * sample);
+/* Starts the exporter on addr:port, serving /metrics and /health */
+int prometheus_init(const char * addr, uint16_t port);
 void prometheus_close(void);
 
 #endif /* SRC_PROMETHEUS_H_ */
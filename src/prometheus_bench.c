@@ -0,0 +1,306 @@
+/*
+ * prometheus_bench.c
+ *
+ * Load test for the Prometheus exporter, or any HTTP endpoint. Keeps a
+ * number of concurrent clients scraping as fast as the server answers
+ * and reports throughput and latency percentiles.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+uint64_t clock_get_nsec(void);
+
+typedef struct {
+    int fd;
+    uint64_t start;
+    size_t header_len;
+    size_t remaining;       // Body bytes still to come, once the header is in
+    char header[4096];
+} bench_client_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    char request[256];
+    size_t request_len;
+    int keep_alive;
+    int epoll_fd;
+
+    unsigned int requests;
+    unsigned int errors;
+    uint64_t bytes;
+    uint32_t * latency_us;
+    size_t latency_size;
+} bench_t;
+
+static int bench_connect(bench_t * bench, bench_client_t * client) {
+
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        return -1;
+    }
+    if (connect(client->fd, (struct sockaddr *) &bench->addr, sizeof(bench->addr)) < 0) {
+        close(client->fd);
+        client->fd = -1;
+        return -1;
+    }
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = client,
+    };
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+    return 0;
+
+}
+
+static void bench_disconnect(bench_t * bench, bench_client_t * client) {
+    epoll_ctl(bench->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+}
+
+static int bench_send(bench_t * bench, bench_client_t * client) {
+
+    if (client->fd < 0 && bench_connect(bench, client) < 0) {
+        return -1;
+    }
+
+    client->header_len = 0;
+    client->remaining = SIZE_MAX;
+    client->start = clock_get_nsec();
+
+    /* Requests are tiny, a blocking send completes at once */
+    if (send(client->fd, bench->request, bench->request_len, MSG_NOSIGNAL) != (ssize_t) bench->request_len) {
+        bench_disconnect(bench, client);
+        return -1;
+    }
+    return 0;
+
+}
+
+static void bench_done(bench_t * bench, bench_client_t * client) {
+
+    if (bench->requests >= bench->latency_size) {
+        size_t size = bench->latency_size ? bench->latency_size * 2 : 65536;
+        uint32_t * grown = realloc(bench->latency_us, size * sizeof(uint32_t));
+        if (grown) {
+            bench->latency_us = grown;
+            bench->latency_size = size;
+        }
+    }
+    if (bench->requests < bench->latency_size) {
+        bench->latency_us[bench->requests] = (clock_get_nsec() - client->start) / 1000;
+    }
+    bench->requests++;
+
+    if (!bench->keep_alive) {
+        bench_disconnect(bench, client);
+    }
+
+}
+
+/* Returns 1 when a full response has been read, 0 if more is to come, -1 on error */
+static int bench_receive(bench_t * bench, bench_client_t * client) {
+
+    char buf[65536];
+    ssize_t got = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (got <= 0) {
+        return -1;
+    }
+    bench->bytes += got;
+
+    if (client->remaining != SIZE_MAX) {
+        if ((size_t) got > client->remaining) {
+            return -1;
+        }
+        client->remaining -= got;
+        return client->remaining == 0;
+    }
+
+    size_t copy = got;
+    if (copy > sizeof(client->header) - 1 - client->header_len) {
+        copy = sizeof(client->header) - 1 - client->header_len;
+    }
+    memcpy(client->header + client->header_len, buf, copy);
+    client->header_len += copy;
+    client->header[client->header_len] = '\0';
+
+    char * end = strstr(client->header, "\r\n\r\n");
+    if (end == NULL) {
+        return client->header_len < sizeof(client->header) - 1 ? 0 : -1;
+    }
+    if (strncmp(client->header, "HTTP/1.1 200", 12) != 0) {
+        return -1;
+    }
+
+    char * length = strcasestr(client->header, "\r\nContent-Length:");
+    if (length == NULL || length > end) {
+        return -1;
+    }
+    size_t body = strtoul(length + 17, NULL, 10);
+
+    /* Body bytes that arrived together with the header */
+    size_t header_size = end + 4 - client->header;
+    size_t received = (client->header_len - copy) + got - header_size;
+    if (received > body) {
+        return -1;
+    }
+    client->remaining = body - received;
+    return client->remaining == 0;
+
+}
+
+static int bench_compare(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int prometheus_bench_cmd(struct slash * slash) {
+
+    char * addr = "127.0.0.1";
+    unsigned int port = 9101;
+    unsigned int clients = 50;
+    unsigned int duration = 5;
+    int close_conn = 0;
+
+    optparse_t * parser = optparse_new("prometheus bench", "[path]");
+    optparse_add_help(parser);
+    optparse_add_string(parser, 'a', "addr", "ADDR", &addr, "Server IPv4 address (default = 127.0.0.1)");
+    optparse_add_unsigned(parser, 'p', "port", "NUM", 0, &port, "Server port (default = 9101)");
+    optparse_add_unsigned(parser, 'c', "clients", "NUM", 0, &clients, "Concurrent clients (default = 50)");
+    optparse_add_unsigned(parser, 'd', "duration", "SEC", 0, &duration, "Test duration (default = 5)");
+    optparse_add_set(parser, 'k', "close", 1, &close_conn, "Open a new connection for every request");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    const char * path = (++argi < slash->argc) ? slash->argv[argi] : "/metrics";
+
+    if (clients == 0 || duration == 0) {
+        printf("Need at least one client and one second\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    bench_t bench = {
+        .keep_alive = !close_conn,
+    };
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &bench.addr.sin_addr) != 1) {
+        printf("Invalid address %s\n", addr);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+    bench.request_len = snprintf(bench.request, sizeof(bench.request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", path, addr, close_conn ? "close" : "keep-alive");
+    if (bench.request_len >= sizeof(bench.request)) {
+        printf("Path too long\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    bench_client_t * client = calloc(clients, sizeof(bench_client_t));
+    bench.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (client == NULL || bench.epoll_fd < 0) {
+        free(client);
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
+
+    printf("Scraping http://%s:%u%s with %u clients for %u s\n", addr, port, path, clients, duration);
+
+    unsigned int active = 0;
+    for (unsigned int i = 0; i < clients; i++) {
+        client[i].fd = -1;
+        if (bench_send(&bench, &client[i]) == 0) {
+            active++;
+        } else {
+            bench.errors++;
+        }
+    }
+
+    uint64_t start = clock_get_nsec();
+    uint64_t stop = start + duration * 1000000000ULL;
+    struct epoll_event events[64];
+
+    while (active > 0) {
+        int count = epoll_wait(bench.epoll_fd, events, 64, 100);
+        int stopping = clock_get_nsec() >= stop;
+
+        for (int e = 0; e < count; e++) {
+            bench_client_t * c = events[e].data.ptr;
+            int res = bench_receive(&bench, c);
+            if (res == 0) {
+                continue;
+            }
+
+            if (res > 0) {
+                bench_done(&bench, c);
+            } else {
+                bench.errors++;
+                bench_disconnect(&bench, c);
+            }
+
+            if (stopping || bench_send(&bench, c) < 0) {
+                if (c->fd >= 0) {
+                    bench_disconnect(&bench, c);
+                }
+                active--;
+            }
+        }
+
+        if (stopping && count == 0) {
+            /* Give up on responses that never came */
+            bench.errors += active;
+            break;
+        }
+    }
+
+    double elapsed = (clock_get_nsec() - start) / 1E9;
+
+    for (unsigned int i = 0; i < clients; i++) {
+        if (client[i].fd >= 0) {
+            close(client[i].fd);
+        }
+    }
+    close(bench.epoll_fd);
+    free(client);
+
+    printf("%u requests, %u errors in %.2f s: %.0f requests/s, %.1f MB/s\n",
+        bench.requests, bench.errors, elapsed, bench.requests / elapsed, bench.bytes / elapsed / 1E6);
+
+    size_t n = bench.requests < bench.latency_size ? bench.requests : bench.latency_size;
+    if (n > 0) {
+        qsort(bench.latency_us, n, sizeof(uint32_t), bench_compare);
+        printf("Latency us: p50 %u  p90 %u  p99 %u  max %u\n",
+            bench.latency_us[n / 2], bench.latency_us[n * 9 / 10], bench.latency_us[n * 99 / 100], bench.latency_us[n - 1]);
+    }
+    free(bench.latency_us);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+
+}
+slash_command_sub(prometheus, bench, prometheus_bench_cmd, "[path]", "Load test the Prometheus exporter with concurrent clients");
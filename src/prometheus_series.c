@@ -0,0 +1,247 @@
+/*
+ * prometheus_series.c
+ *
+ * Open addressing table of the latest sample per series. Written by the
+ * sniffer sink thread, rendered by the exporter thread on scrape.
+ *
+ * Updates do not touch the table. They are appended without locking to
+ * the active one of two update logs: a single atomic add on series_log_state
+ * picks both the log and the slot. Whoever holds series_lock (the scraper,
+ * or a writer that found the log full) swaps the logs, waits for writers
+ * still copying into the frozen log, and applies it to the table in order.
+ * A writer finding the log full waits for that, so no update is lost.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <param/param.h>
+
+#include "prometheus_series.h"
+#include "metric_format.h"
+#include "param_index.h"
+
+#define SERIES_MIN_BITS 10
+#define SERIES_LOG_LEN  16384
+
+/* Top bit selects the active log, the rest counts slots handed out in it */
+#define SERIES_LOG_ACTIVE   (1ull << 63)
+
+typedef struct {
+	uint64_t key;
+	param_t * param;
+	param_sniffer_value_t value;
+	uint64_t time_ms;
+	uint16_t idx;
+	time_t updated;
+} prometheus_series_t;
+
+typedef struct {
+	param_t * param;
+	param_sniffer_value_t value;
+	uint64_t time_ms;
+	uint16_t idx;
+} series_update_t;
+
+typedef struct {
+	uint32_t done;          /* Slots fully written */
+	series_update_t updates[SERIES_LOG_LEN];
+} series_log_t;
+
+static series_log_t series_logs[2];
+static uint64_t series_log_state;
+static uint64_t series_applied;
+
+/* Guards the table and the log swap */
+static pthread_mutex_t series_lock = PTHREAD_MUTEX_INITIALIZER;
+static prometheus_series_t * series_slots;
+static unsigned int series_bits;
+static unsigned int series_used;
+static unsigned int series_expiry = 300;
+static unsigned int series_generation;
+
+static time_t series_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static inline uint32_t series_home(uint64_t key, unsigned int bits) {
+	return (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+static prometheus_series_t * series_slot(prometheus_series_t * slots, unsigned int bits, uint64_t key) {
+	uint32_t mask = (1u << bits) - 1;
+	uint32_t i = series_home(key, bits);
+	while (slots[i].param != NULL && slots[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	return &slots[i];
+}
+
+/* Rehash into a table of 2^bits slots, leaving out series last updated before expired_before */
+static int series_rehash(unsigned int bits, time_t expired_before) {
+
+	prometheus_series_t * slots = calloc(1u << bits, sizeof(prometheus_series_t));
+	if (slots == NULL) {
+		return -1;
+	}
+
+	unsigned int old_size = series_slots ? 1u << series_bits : 0;
+	series_used = 0;
+	for (unsigned int i = 0; i < old_size; i++) {
+		prometheus_series_t * s = &series_slots[i];
+		if (s->param == NULL || s->updated < expired_before) {
+			continue;
+		}
+		*series_slot(slots, bits, s->key) = *s;
+		series_used++;
+	}
+
+	free(series_slots);
+	series_slots = slots;
+	series_bits = bits;
+	return 0;
+
+}
+
+static void series_apply(const series_update_t * update) {
+
+	uint64_t key = ((uint64_t) update->param->node << 32) | ((uint64_t) update->param->id << 16) | update->idx;
+
+	/* Keep load factor below 1/2 */
+	if (series_slots == NULL || (series_used + 1) * 2 > (1u << series_bits)) {
+		if (series_rehash(series_slots ? series_bits + 1 : SERIES_MIN_BITS, 0) < 0) {
+			return;
+		}
+	}
+
+	prometheus_series_t * s = series_slot(series_slots, series_bits, key);
+	if (s->param == NULL) {
+		s->key = key;
+		s->idx = update->idx;
+		series_used++;
+	}
+	s->param = update->param;
+	s->value = update->value;
+	s->time_ms = update->time_ms;
+	s->updated = series_now();
+
+}
+
+/* Swaps the update logs and applies the frozen one. Call with series_lock held */
+static void series_log_flush(void) {
+
+	uint64_t state = __atomic_load_n(&series_log_state, __ATOMIC_RELAXED);
+	state = __atomic_exchange_n(&series_log_state, (state & SERIES_LOG_ACTIVE) ^ SERIES_LOG_ACTIVE, __ATOMIC_ACQ_REL);
+
+	series_log_t * log = &series_logs[state >> 63];
+	uint64_t count = state & ~SERIES_LOG_ACTIVE;
+	if (count > SERIES_LOG_LEN) {
+		count = SERIES_LOG_LEN;
+	}
+
+	/* Writers that got a slot before the swap may still be copying */
+	while (__atomic_load_n(&log->done, __ATOMIC_ACQUIRE) < count) {
+		sched_yield();
+	}
+
+	for (uint64_t i = 0; i < count; i++) {
+		series_apply(&log->updates[i]);
+	}
+	log->done = 0;
+	__atomic_fetch_add(&series_applied, count, __ATOMIC_RELAXED);
+
+}
+
+void prometheus_series_update(const param_sniffer_sample_t * sample) {
+
+	while (1) {
+		uint64_t state = __atomic_fetch_add(&series_log_state, 1, __ATOMIC_ACQ_REL);
+		uint64_t slot = state & ~SERIES_LOG_ACTIVE;
+		series_log_t * log = &series_logs[state >> 63];
+
+		if (slot < SERIES_LOG_LEN) {
+			series_update_t * update = &log->updates[slot];
+			update->param = sample->param;
+			update->value = sample->value;
+			update->time_ms = sample->time_ms;
+			update->idx = sample->idx;
+			__atomic_fetch_add(&log->done, 1, __ATOMIC_RELEASE);
+			return;
+		}
+
+		/* Log full: apply it here, unless someone else swapped it meanwhile */
+		pthread_mutex_lock(&series_lock);
+		if ((__atomic_load_n(&series_log_state, __ATOMIC_RELAXED) & SERIES_LOG_ACTIVE) == (state & SERIES_LOG_ACTIVE)) {
+			series_log_flush();
+		}
+		pthread_mutex_unlock(&series_lock);
+	}
+
+}
+
+size_t prometheus_series_render(char ** buf, size_t * size, size_t offset) {
+
+	pthread_mutex_lock(&series_lock);
+
+	series_log_flush();
+
+	size_t needed = offset + (size_t) series_used * METRIC_LINE_MAX + 1;
+	if (needed > *size) {
+		char * grown = realloc(*buf, needed);
+		if (grown == NULL) {
+			pthread_mutex_unlock(&series_lock);
+			return offset;
+		}
+		*buf = grown;
+		*size = needed;
+	}
+
+	time_t expired_before = series_expiry ? series_now() - series_expiry : 0;
+	unsigned int expired = 0;
+	size_t len = offset;
+
+	unsigned int slots = series_slots ? 1u << series_bits : 0;
+	for (unsigned int i = 0; i < slots; i++) {
+		prometheus_series_t * s = &series_slots[i];
+		if (s->param == NULL) {
+			continue;
+		}
+		/* The param may have been removed from the list since the update */
+		if (s->updated < expired_before || param_index_find(s->key >> 32, (s->key >> 16) & 0xFFFF) == NULL) {
+			s->updated = 0;
+			expired++;
+			continue;
+		}
+		len += metric_format_value(*buf + len, *size - len, s->param, s->idx, s->value, s->time_ms);
+	}
+
+	if (expired) {
+		__atomic_fetch_add(&series_generation, 1, __ATOMIC_RELAXED);
+		series_rehash(series_bits, expired_before > 0 ? expired_before : 1);
+	}
+
+	pthread_mutex_unlock(&series_lock);
+
+	return len;
+
+}
+
+void prometheus_series_set_expiry(unsigned int seconds) {
+	series_expiry = seconds;
+}
+
+unsigned int prometheus_series_count(void) {
+	return series_used;
+}
+
+unsigned int prometheus_series_generation(void) {
+	/* Updates still in the log count as well, the next render applies them */
+	uint64_t pending = __atomic_load_n(&series_log_state, __ATOMIC_RELAXED) & ~SERIES_LOG_ACTIVE;
+	return __atomic_load_n(&series_generation, __ATOMIC_RELAXED) + __atomic_load_n(&series_applied, __ATOMIC_RELAXED) + pending;
+}
@@ -0,0 +1,29 @@
+/*
+ * prometheus_series.h
+ *
+ * Latest value per series (node, id, array index) for the Prometheus
+ * exporter. A scrape renders one line per series, so its size depends on
+ * the number of series and not on the sample rate.
+ */
+
+#ifndef SRC_PROMETHEUS_SERIES_H_
+#define SRC_PROMETHEUS_SERIES_H_
+
+#include <stddef.h>
+
+#include "param_sniffer.h"
+
+void prometheus_series_update(const param_sniffer_sample_t * sample);
+
+/* Render all series into *buf (grown with realloc as needed), returns length */
+size_t prometheus_series_render(char ** buf, size_t * size, size_t offset);
+
+/* Series not updated for this many seconds are dropped, 0 = never */
+void prometheus_series_set_expiry(unsigned int seconds);
+
+unsigned int prometheus_series_count(void);
+
+/* Changes whenever a series is updated or dropped */
+unsigned int prometheus_series_generation(void);
+
+#endif /* SRC_PROMETHEUS_SERIES_H_ */
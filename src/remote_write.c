@@ -0,0 +1,794 @@
+/*
+ * remote_write.c
+ *
+ * The sniffer sink thread looks up the series of each sample, building
+ * its protobuf label set on first sight, and appends the sample to the
+ * active batch. The push thread swaps batches when one is full or the
+ * flush interval has passed, groups the frozen batch by series, encodes
+ * it and sends it while the sink fills the other batch.
+ *
+ * Wire format (prompb):
+ *
+ *   WriteRequest { repeated TimeSeries timeseries = 1; }
+ *   TimeSeries   { repeated Label labels = 1; repeated Sample samples = 2; }
+ *   Label        { string name = 1; string value = 2; }
+ *   Sample       { double value = 1; int64 timestamp = 2; }
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include <csp/csp.h>
+#include <param/param.h>
+
+#include "remote_write.h"
+#include "param_sniffer.h"
+#include "metric_format.h"
+#include "sniffer_stats.h"
+#include "snappy.h"
+#include "http_server.h"
+
+#define RW_BATCH_DEFAULT    10000
+#define RW_FLUSH_DEFAULT    1000
+#define RW_RETRIES          3
+#define RW_SERIES_MIN_BITS  10
+
+/* Protobuf tags: field number << 3 | wire type */
+#define PB_TAG_LEN(field)       (((field) << 3) | 2)
+#define PB_TAG_VARINT(field)    (((field) << 3) | 0)
+#define PB_TAG_FIXED64(field)   (((field) << 3) | 1)
+
+uint64_t clock_get_nsec(void);
+
+typedef struct {
+    uint64_t key;
+    param_t * param;
+    const char * name;      /* Detects a param freed and reallocated at the same address */
+    uint64_t version;       /* metric_labels_version() the labels were encoded for */
+    size_t labels_len;
+    uint8_t labels[];       /* Encoded Label fields of the TimeSeries */
+} rw_series_t;
+
+typedef struct {
+    rw_series_t * series;
+    double value;
+    int64_t time_ms;
+} rw_sample_t;
+
+typedef struct {
+    char * url;
+    char * username;
+    char * password;
+    int skip_verify;
+    int verbose;
+} rw_args_t;
+
+int rw_running = 0;
+static pthread_t rw_thread;
+
+/* Series table, only used from the sink thread. Entries are never freed,
+ * a batch in flight may still point to a replaced one. */
+static rw_series_t ** rw_series_slots;
+static unsigned int rw_series_bits;
+static unsigned int rw_series_used;
+
+static pthread_mutex_t rw_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rw_cond = PTHREAD_COND_INITIALIZER;
+static rw_sample_t * rw_batch[2];
+static unsigned int rw_active;
+static unsigned int rw_batch_len;
+static unsigned int rw_batch_max = RW_BATCH_DEFAULT;
+static unsigned int rw_flush_ms = RW_FLUSH_DEFAULT;
+
+static inline size_t pb_varint_len(uint64_t value) {
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static inline uint8_t * pb_put_varint(uint8_t * out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = value | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static uint8_t * pb_put_label(uint8_t * out, const char * name, const char * value) {
+
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    size_t len = 1 + pb_varint_len(name_len) + name_len + 1 + pb_varint_len(value_len) + value_len;
+
+    *out++ = PB_TAG_LEN(1);
+    out = pb_put_varint(out, len);
+    *out++ = PB_TAG_LEN(1);
+    out = pb_put_varint(out, name_len);
+    memcpy(out, name, name_len);
+    out += name_len;
+    *out++ = PB_TAG_LEN(2);
+    out = pb_put_varint(out, value_len);
+    memcpy(out, value, value_len);
+    return out + value_len;
+
+}
+
+static rw_series_t * rw_series_create(uint64_t key, param_t * param, unsigned int idx) {
+
+    char node[8], index[8], host[METRIC_LABEL_VALUE_MAX], mask[METRIC_LABEL_VALUE_MAX];
+    snprintf(node, sizeof(node), "%u", param->node);
+    snprintf(index, sizeof(index), "%u", idx);
+
+    /* Label names sorted, as receivers expect. Optional labels as selected with sniffer labels */
+    const char * labels[][2] = {
+        {"__name__", param->name},
+        {"host", metric_label(param, METRIC_LABEL_HOST, host, sizeof(host))},
+        {"idx", index},
+        {"instance", csp_get_conf()->hostname},
+        {"mask", metric_label(param, METRIC_LABEL_MASK, mask, sizeof(mask))},
+        {"node", node},
+        {"unit", metric_label(param, METRIC_LABEL_UNIT, NULL, 0)},
+    };
+    const unsigned int count = sizeof(labels) / sizeof(labels[0]);
+
+    /* Tags and varint lengths take at most 10 bytes per label */
+    size_t max = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (labels[i][1]) {
+            max += 10 + strlen(labels[i][0]) + strlen(labels[i][1]);
+        }
+    }
+
+    rw_series_t * series = malloc(sizeof(rw_series_t) + max);
+    if (series == NULL) {
+        return NULL;
+    }
+
+    uint8_t * p = series->labels;
+    for (unsigned int i = 0; i < count; i++) {
+        if (labels[i][1]) {
+            p = pb_put_label(p, labels[i][0], labels[i][1]);
+        }
+    }
+
+    series->key = key;
+    series->param = param;
+    series->name = param->name;
+    series->version = metric_labels_version();
+    series->labels_len = p - series->labels;
+    return series;
+
+}
+
+static rw_series_t ** rw_series_slot(rw_series_t ** slots, unsigned int bits, uint64_t key) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t i = (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+    while (slots[i] != NULL && slots[i]->key != key) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static rw_series_t * rw_series_get(const param_sniffer_sample_t * sample) {
+
+    param_t * param = sample->param;
+    uint64_t key = ((uint64_t) param->node << 32) | ((uint64_t) param->id << 16) | sample->idx;
+
+    if (rw_series_slots == NULL || (rw_series_used + 1) * 2 > (1u << rw_series_bits)) {
+        unsigned int bits = rw_series_slots ? rw_series_bits + 1 : RW_SERIES_MIN_BITS;
+        rw_series_t ** slots = calloc(1u << bits, sizeof(rw_series_t *));
+        if (slots == NULL) {
+            return NULL;
+        }
+        unsigned int old_size = rw_series_slots ? 1u << rw_series_bits : 0;
+        for (unsigned int i = 0; i < old_size; i++) {
+            if (rw_series_slots[i]) {
+                *rw_series_slot(slots, bits, rw_series_slots[i]->key) = rw_series_slots[i];
+            }
+        }
+        free(rw_series_slots);
+        rw_series_slots = slots;
+        rw_series_bits = bits;
+    }
+
+    rw_series_t ** slot = rw_series_slot(rw_series_slots, rw_series_bits, key);
+    if (*slot && (*slot)->param == param && (*slot)->name == param->name && (*slot)->version == metric_labels_version()) {
+        return *slot;
+    }
+
+    rw_series_t * series = rw_series_create(key, param, sample->idx);
+    if (series == NULL) {
+        return NULL;
+    }
+    if (*slot == NULL) {
+        rw_series_used++;
+    }
+    *slot = series;
+    return series;
+
+}
+
+void rw_add_sample(const param_sniffer_sample_t * sample) {
+
+    rw_series_t * series = rw_series_get(sample);
+    if (series == NULL) {
+        sniffer_stat_inc(SNIFFER_STAT_RW_FULL);
+        return;
+    }
+
+    pthread_mutex_lock(&rw_lock);
+    /* The sink can still drain its ring after remote_write stop */
+    if (!rw_running) {
+        pthread_mutex_unlock(&rw_lock);
+        return;
+    }
+    if (rw_batch_len < rw_batch_max) {
+        rw_sample_t * s = &rw_batch[rw_active][rw_batch_len++];
+        s->series = series;
+        s->value = param_sniffer_value_double(sample);
+        s->time_ms = sample->time_ms;
+        if (rw_batch_len == rw_batch_max) {
+            pthread_cond_signal(&rw_cond);
+        }
+    } else {
+        sniffer_stat_inc(SNIFFER_STAT_RW_FULL);
+    }
+    pthread_mutex_unlock(&rw_lock);
+
+}
+
+static int rw_sample_compare(const void * a, const void * b) {
+    const rw_sample_t * x = a, * y = b;
+    if (x->series != y->series) {
+        return x->series < y->series ? -1 : 1;
+    }
+    return (x->time_ms > y->time_ms) - (x->time_ms < y->time_ms);
+}
+
+/* Encodes a WriteRequest into *buf, returns its length or 0 if out of memory */
+static size_t rw_encode(rw_sample_t * samples, unsigned int count, uint8_t ** buf, size_t * size) {
+
+    /* Samples of a series must be sent together and in time order */
+    qsort(samples, count, sizeof(rw_sample_t), rw_sample_compare);
+
+    size_t len = 0;
+    unsigned int first = 0;
+    while (first < count) {
+        rw_series_t * series = samples[first].series;
+        unsigned int last = first;
+        size_t series_len = series->labels_len;
+        while (last < count && samples[last].series == series) {
+            size_t sample_len = 1 + 8 + 1 + pb_varint_len(samples[last].time_ms);
+            series_len += 1 + pb_varint_len(sample_len) + sample_len;
+            last++;
+        }
+
+        size_t needed = len + 1 + pb_varint_len(series_len) + series_len;
+        if (needed > *size) {
+            size_t grown_size = *size ? *size : 64 * 1024;
+            while (grown_size < needed) {
+                grown_size *= 2;
+            }
+            uint8_t * grown = realloc(*buf, grown_size);
+            if (grown == NULL) {
+                return 0;
+            }
+            *buf = grown;
+            *size = grown_size;
+        }
+
+        uint8_t * p = *buf + len;
+        *p++ = PB_TAG_LEN(1);
+        p = pb_put_varint(p, series_len);
+        memcpy(p, series->labels, series->labels_len);
+        p += series->labels_len;
+        for (unsigned int i = first; i < last; i++) {
+            size_t sample_len = 1 + 8 + 1 + pb_varint_len(samples[i].time_ms);
+            *p++ = PB_TAG_LEN(2);
+            p = pb_put_varint(p, sample_len);
+            *p++ = PB_TAG_FIXED64(1);
+            memcpy(p, &samples[i].value, 8);        /* Little endian hosts only, like the capture format */
+            p += 8;
+            *p++ = PB_TAG_VARINT(2);
+            p = pb_put_varint(p, samples[i].time_ms);
+        }
+        len = p - *buf;
+        first = last;
+    }
+
+    return len;
+
+}
+
+static size_t rw_discard_callback(char * ptr, size_t size, size_t nmemb, void * userdata) {
+    return size * nmemb;
+}
+
+/* Returns 0 once the receiver took the request, -1 if it was given up on */
+static int rw_send(CURL * curl, const void * body, size_t len, int verbose) {
+
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+
+    for (int attempt = 0; attempt <= RW_RETRIES; attempt++) {
+        if (attempt) {
+            /* 0.5, 1, 2 s */
+            usleep(250000 << attempt);
+        }
+
+        CURLcode res = curl_easy_perform(curl);
+        sniffer_stat_inc(SNIFFER_STAT_RW_PUSHES);
+        if (res != CURLE_OK) {
+            if (verbose) {
+                printf("Remote write failed: %s\n", curl_easy_strerror(res));
+            }
+            continue;
+        }
+
+        long code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code / 100 == 2) {
+            return 0;
+        }
+        if (verbose) {
+            printf("Remote write rejected with %ld\n", code);
+        }
+        /* Only server errors and rate limiting are worth a retry */
+        if (code / 100 == 4 && code != 429) {
+            return -1;
+        }
+    }
+
+    return -1;
+
+}
+
+static void * rw_push(void * arg) {
+
+    rw_args_t * args = arg;
+
+    CURL * curl = curl_easy_init();
+    struct curl_slist * headers = NULL;
+    if (curl == NULL) {
+        printf("curl_easy_init() failed\n");
+        rw_running = 0;
+    } else {
+        headers = curl_slist_append(headers, "Content-Encoding: snappy");
+        headers = curl_slist_append(headers, "Content-Type: application/x-protobuf");
+        headers = curl_slist_append(headers, "User-Agent: csh");
+        headers = curl_slist_append(headers, "X-Prometheus-Remote-Write-Version: 0.1.0");
+        curl_easy_setopt(curl, CURLOPT_URL, args->url);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, rw_discard_callback);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+        if (args->skip_verify) {
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        }
+        if (args->username && args->password) {
+            curl_easy_setopt(curl, CURLOPT_USERNAME, args->username);
+            curl_easy_setopt(curl, CURLOPT_PASSWORD, args->password);
+            curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+        }
+        printf("Remote writing to %s\n", args->url);
+    }
+
+    uint8_t * body = NULL;
+    size_t body_size = 0;
+    uint8_t * compressed = NULL;
+    size_t compressed_size = 0;
+
+    int stopping = 0;
+    while (!stopping) {
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += rw_flush_ms / 1000;
+        deadline.tv_nsec += (rw_flush_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        /* Wait for a full batch, the flush deadline or a stop */
+        pthread_mutex_lock(&rw_lock);
+        while (rw_running && rw_batch_len < rw_batch_max) {
+            if (pthread_cond_timedwait(&rw_cond, &rw_lock, &deadline) != 0) {
+                break;
+            }
+        }
+        stopping = !rw_running;
+        rw_sample_t * samples = rw_batch[rw_active];
+        unsigned int count = rw_batch_len;
+        rw_active ^= 1;
+        rw_batch_len = 0;
+        pthread_mutex_unlock(&rw_lock);
+
+        if (count == 0 || curl == NULL) {
+            continue;
+        }
+
+        uint64_t start = clock_get_nsec();
+
+        size_t len = rw_encode(samples, count, &body, &body_size);
+        size_t bound = snappy_max_compressed_length(len);
+        if (bound > compressed_size) {
+            uint8_t * grown = realloc(compressed, bound);
+            if (grown == NULL) {
+                len = 0;
+            } else {
+                compressed = grown;
+                compressed_size = bound;
+            }
+        }
+        if (len == 0) {
+            sniffer_stat_inc(SNIFFER_STAT_RW_PUSH_ERR);
+            continue;
+        }
+        size_t compressed_len = snappy_compress(body, len, compressed);
+
+        if (rw_send(curl, compressed, compressed_len, args->verbose) < 0) {
+            sniffer_stat_inc(SNIFFER_STAT_RW_PUSH_ERR);
+        } else if (args->verbose) {
+            printf("Remote write: %u samples, %zu bytes, %zu compressed\n", count, len, compressed_len);
+        }
+        sniffer_hist_add(SNIFFER_HIST_RW_PUSH, clock_get_nsec() - start);
+    }
+
+    printf("Remote write stopped\n");
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+    curl_slist_free_all(headers);
+    free(body);
+    free(compressed);
+    free(args->url);
+    free(args->username);
+    free(args->password);
+    free(args);
+    return NULL;
+
+}
+
+static int rw_start_cmd(struct slash * slash) {
+
+    if (rw_running) return SLASH_SUCCESS;
+
+    int hk_node = 0;
+    int logfile = 0;
+    char * username = NULL;
+    char * password = NULL;
+    unsigned int batch = rw_batch_max;
+    unsigned int flush_ms = rw_flush_ms;
+    int skip_verify = 0;
+    int verbose = 0;
+
+    optparse_t * parser = optparse_new("remote_write start", "<url>");
+    optparse_add_help(parser);
+    optparse_add_string(parser, 'u', "user", "STRING", &username, "Username for basic auth");
+    optparse_add_string(parser, 'p', "pass", "STRING", &password, "Password for basic auth");
+    optparse_add_unsigned(parser, 'b', "batch", "NUM", 0, &batch, "Samples per request (default = 10000)");
+    optparse_add_unsigned(parser, 'f', "flush", "MS", 0, &flush_ms, "Send a partial batch after MS milliseconds (default = 1000)");
+    optparse_add_int(parser, 'n', "hk_node", "NUM", 0, &hk_node, "Housekeeping node");
+    optparse_add_set(parser, 'l', "logfile", 1, &logfile, "Enable logging to param_sniffer.log");
+    optparse_add_set(parser, 'S', "skip-verify", 1, &skip_verify, "Skip verification of the server's cert and hostname");
+    optparse_add_set(parser, 'v', "verbose", 1, &verbose, "Print every request");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (++argi >= slash->argc) {
+        printf("Missing url, e.g. http://localhost:9090/api/v1/write\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (username && !password) {
+        printf("Provide password with -p\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (batch == 0 || flush_ms == 0) {
+        printf("Batch size and flush interval must be positive\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    /* New batches are swapped in under rw_lock below, together with their size */
+    rw_sample_t * batches[2] = {NULL, NULL};
+    if (batch != rw_batch_max || rw_batch[0] == NULL) {
+        for (int i = 0; i < 2; i++) {
+            batches[i] = malloc(batch * sizeof(rw_sample_t));
+        }
+        if (batches[0] == NULL || batches[1] == NULL) {
+            printf("Cannot allocate remote write batches\n");
+            free(batches[0]);
+            free(batches[1]);
+            optparse_del(parser);
+            return SLASH_ENOMEM;
+        }
+    }
+
+    rw_args_t * args = calloc(1, sizeof(rw_args_t));
+    if (args == NULL) {
+        free(batches[0]);
+        free(batches[1]);
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
+    args->url = strdup(slash->argv[argi]);
+    args->username = username ? strdup(username) : NULL;
+    args->password = password ? strdup(password) : NULL;
+    args->skip_verify = skip_verify;
+    args->verbose = verbose;
+
+    pthread_mutex_lock(&rw_lock);
+    if (batches[0]) {
+        for (int i = 0; i < 2; i++) {
+            rw_sample_t * old = rw_batch[i];
+            rw_batch[i] = batches[i];
+            batches[i] = old;
+        }
+    }
+    rw_batch_max = batch;
+    rw_flush_ms = flush_ms;
+    rw_batch_len = 0;
+    rw_running = 1;
+    pthread_mutex_unlock(&rw_lock);
+
+    /* The old batches, no longer reachable by rw_add_sample() */
+    free(batches[0]);
+    free(batches[1]);
+
+    param_sniffer_init(logfile, hk_node);
+    pthread_create(&rw_thread, NULL, &rw_push, args);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+
+}
+slash_command_sub(remote_write, start, rw_start_cmd, "<url>", "Start Prometheus remote write push thread");
+
+static int rw_stop_cmd(struct slash * slash) {
+
+    if (!rw_running) return SLASH_SUCCESS;
+
+    /* The push thread sends what is left before it exits */
+    pthread_mutex_lock(&rw_lock);
+    rw_running = 0;
+    pthread_cond_signal(&rw_cond);
+    pthread_mutex_unlock(&rw_lock);
+    pthread_join(rw_thread, NULL);
+
+    return SLASH_SUCCESS;
+
+}
+slash_command_sub(remote_write, stop, rw_stop_cmd, "", "Flush and stop remote write");
+
+/* Stand-in receiver, for testing without a Prometheus at hand */
+
+static http_server_t * rw_receiver;
+static int rw_receiver_verbose;
+
+static const uint8_t * pb_get_varint(const uint8_t * p, const uint8_t * end, uint64_t * value) {
+    *value = 0;
+    for (unsigned int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = *p++;
+        *value |= (uint64_t) (b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Walks one message, calling back for each length delimited field. Returns -1 if malformed */
+static int pb_walk(const uint8_t * p, const uint8_t * end, int (*field)(unsigned int number, const uint8_t * data, size_t len, void * ctx), void * ctx) {
+
+    while (p < end) {
+        uint64_t tag, value;
+        if ((p = pb_get_varint(p, end, &tag)) == NULL) {
+            return -1;
+        }
+        switch (tag & 7) {
+            case 0:
+                if ((p = pb_get_varint(p, end, &value)) == NULL) {
+                    return -1;
+                }
+                if (field && field(tag >> 3, (const uint8_t *) &value, 0, ctx) < 0) {
+                    return -1;
+                }
+                break;
+            case 1:
+                if (end - p < 8) {
+                    return -1;
+                }
+                if (field && field(tag >> 3, p, 8, ctx) < 0) {
+                    return -1;
+                }
+                p += 8;
+                break;
+            case 2:
+                if ((p = pb_get_varint(p, end, &value)) == NULL || value > (uint64_t) (end - p)) {
+                    return -1;
+                }
+                if (field && field(tag >> 3, p, value, ctx) < 0) {
+                    return -1;
+                }
+                p += value;
+                break;
+            case 5:
+                if (end - p < 4) {
+                    return -1;
+                }
+                p += 4;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+
+}
+
+typedef struct {
+    unsigned int series;
+    unsigned int samples;
+    char labels[256];
+    size_t labels_len;
+    double value;
+    int64_t time_ms;
+} rw_receiver_ctx_t;
+
+static int rw_receiver_pair(unsigned int number, const uint8_t * data, size_t len, void * arg) {
+
+    rw_receiver_ctx_t * ctx = arg;
+    size_t room = sizeof(ctx->labels) - ctx->labels_len - 1;
+    size_t n = len < room ? len : room;
+    if (number == 1 || number == 2) {
+        memcpy(ctx->labels + ctx->labels_len, data, n);
+        ctx->labels_len += n;
+        if (ctx->labels_len + 1 < sizeof(ctx->labels)) {
+            ctx->labels[ctx->labels_len++] = number == 1 ? '=' : ' ';
+        }
+        ctx->labels[ctx->labels_len] = '\0';
+    }
+    return 0;
+
+}
+
+static int rw_receiver_sample(unsigned int number, const uint8_t * data, size_t len, void * arg) {
+
+    rw_receiver_ctx_t * ctx = arg;
+    if (number == 1 && len == 8) {
+        memcpy(&ctx->value, data, 8);
+    } else if (number == 2) {
+        uint64_t time_ms;
+        memcpy(&time_ms, data, sizeof(time_ms));
+        ctx->time_ms = time_ms;
+    }
+    return 0;
+
+}
+
+static int rw_receiver_series_field(unsigned int number, const uint8_t * data, size_t len, void * arg) {
+
+    rw_receiver_ctx_t * ctx = arg;
+    if (number == 1) {
+        return pb_walk(data, data + len, rw_receiver_pair, ctx);
+    }
+    if (number == 2) {
+        ctx->samples++;
+        if (pb_walk(data, data + len, rw_receiver_sample, ctx) < 0) {
+            return -1;
+        }
+        if (rw_receiver_verbose) {
+            printf("  %s%.17g %"PRId64"\n", ctx->labels, ctx->value, ctx->time_ms);
+        }
+    }
+    return 0;
+
+}
+
+static int rw_receiver_request_field(unsigned int number, const uint8_t * data, size_t len, void * arg) {
+
+    rw_receiver_ctx_t * ctx = arg;
+    if (number != 1) {
+        return 0;
+    }
+    ctx->series++;
+    ctx->labels_len = 0;
+    ctx->labels[0] = '\0';
+    return pb_walk(data, data + len, rw_receiver_series_field, ctx);
+
+}
+
+static void rw_receiver_handler(const http_request_t * request, http_response_t * response, void * arg) {
+
+    if (strcmp(request->method, "POST") != 0) {
+        response->status = 405;
+        return;
+    }
+
+    size_t len;
+    uint8_t * body;
+    if (snappy_uncompressed_length(request->body, request->body_len, &len) < 0 ||
+        (body = malloc(len ? len : 1)) == NULL) {
+        response->status = 400;
+        return;
+    }
+
+    rw_receiver_ctx_t ctx = {0};
+    if (snappy_uncompress(request->body, request->body_len, body) < 0 ||
+        pb_walk(body, body + len, rw_receiver_request_field, &ctx) < 0) {
+        printf("Remote write receiver: malformed request of %zu bytes\n", request->body_len);
+        response->status = 400;
+    } else {
+        printf("Remote write receiver: %u series, %u samples, %zu bytes, %zu compressed\n", ctx.series, ctx.samples, len, request->body_len);
+        response->status = 204;
+    }
+    free(body);
+
+}
+
+static int rw_receiver_cmd(struct slash * slash) {
+
+    unsigned int port = 9201;
+    int stop = 0;
+
+    optparse_t * parser = optparse_new("remote_write receiver", "");
+    optparse_add_help(parser);
+    optparse_add_unsigned(parser, 'p', "port", "NUM", 0, &port, "Listen port (default = 9201)");
+    optparse_add_set(parser, 'v', "verbose", 1, &rw_receiver_verbose, "Print every sample");
+    optparse_add_set(parser, 's', "stop", 1, &stop, "Stop the receiver");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    optparse_del(parser);
+    if (argi < 0) {
+        return SLASH_EINVAL;
+    }
+
+    if (stop) {
+        http_server_stop(rw_receiver);
+        rw_receiver = NULL;
+        return SLASH_SUCCESS;
+    }
+
+    if (rw_receiver) {
+        printf("Receiver already running\n");
+        return SLASH_EINVAL;
+    }
+
+    http_server_conf_t conf = {
+        .name = "Remote write receiver",
+        .addr = "127.0.0.1",
+        .port = port,
+        .handler = rw_receiver_handler,
+        .body_max = 64 * 1024 * 1024,
+    };
+    rw_receiver = http_server_start(&conf);
+    if (rw_receiver == NULL) {
+        return SLASH_ENOMEM;
+    }
+    printf("Push to http://127.0.0.1:%u/api/v1/write\n", port);
+    return SLASH_SUCCESS;
+
+}
+slash_command_sub(remote_write, receiver, rw_receiver_cmd, "", "Run a local stand-in remote write receiver that decodes and counts requests");
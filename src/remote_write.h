@@ -0,0 +1,18 @@
+/*
+ * remote_write.h
+ *
+ * Prometheus remote write sink. Samples are batched, encoded as a
+ * protobuf WriteRequest, compressed with snappy and POSTed to any remote
+ * write receiver (Prometheus, Victoria Metrics, Mimir, Thanos, ...).
+ */
+
+#ifndef SRC_REMOTE_WRITE_H_
+#define SRC_REMOTE_WRITE_H_
+
+#include "param_sniffer.h"
+
+extern int rw_running;
+
+void rw_add_sample(const param_sniffer_sample_t * sample);
+
+#endif /* SRC_REMOTE_WRITE_H_ */
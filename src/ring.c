@@ -0,0 +1,179 @@
+/*
+ * ring.c
+ *
+ * Bounded MPMC queue after Dmitry Vyukov: every slot carries a sequence
+ * number telling whether it is free for the producer at position pos
+ * (seq == pos) or holds data for the consumer at pos (seq == pos + 1).
+ * A semaphore counts published elements so idle consumers can sleep
+ * instead of spinning; sem_post() is only a syscall if someone waits.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+#include "ring.h"
+
+#define RING_CACHELINE 64
+
+typedef struct {
+    atomic_uint seq;
+} ring_slot_t;
+
+struct ring_s {
+    size_t elem_size;
+    size_t stride;
+    unsigned int mask;
+    uint8_t * slots;
+    sem_t items;
+    _Alignas(RING_CACHELINE) atomic_uint head;
+    _Alignas(RING_CACHELINE) atomic_uint tail;
+};
+
+static inline ring_slot_t * ring_slot(ring_t * ring, unsigned int pos) {
+    return (ring_slot_t *) (ring->slots + (pos & ring->mask) * ring->stride);
+}
+
+ring_t * ring_create(size_t elem_size, unsigned int capacity) {
+
+    unsigned int size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring_t * ring = aligned_alloc(RING_CACHELINE, sizeof(ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->elem_size = elem_size;
+    ring->stride = (sizeof(ring_slot_t) + elem_size + 7) & ~(size_t) 7;
+    ring->mask = size - 1;
+    ring->slots = malloc(ring->stride * size);
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < size; i++) {
+        atomic_init(&ring_slot(ring, i)->seq, i);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    sem_init(&ring->items, 0, 0);
+
+    return ring;
+
+}
+
+void ring_destroy(ring_t * ring) {
+    if (ring == NULL) {
+        return;
+    }
+    sem_destroy(&ring->items);
+    free(ring->slots);
+    free(ring);
+}
+
+int ring_push(ring_t * ring, const void * elem) {
+
+    ring_slot_t * slot;
+    unsigned int pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    while (1) {
+        slot = ring_slot(ring, pos);
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int dif = (int) (seq - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot + 1, elem, ring->elem_size);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    sem_post(&ring->items);
+    return 0;
+
+}
+
+static int ring_take(ring_t * ring, void * elem) {
+
+    ring_slot_t * slot;
+    unsigned int pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (1) {
+        slot = ring_slot(ring, pos);
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int dif = (int) (seq - (pos + 1));
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(elem, slot + 1, ring->elem_size);
+    atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+    return 0;
+
+}
+
+/* We own one semaphore token, so an element is published or about to be */
+static void ring_take_token(ring_t * ring, void * elem) {
+    while (ring_take(ring, elem) < 0) {
+        sched_yield();
+    }
+}
+
+int ring_pop(ring_t * ring, void * elem) {
+    if (sem_trywait(&ring->items) < 0) {
+        return -1;
+    }
+    ring_take_token(ring, elem);
+    return 0;
+}
+
+int ring_pop_wait(ring_t * ring, void * elem, unsigned int timeout_ms) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    while (sem_timedwait(&ring->items, &ts) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    ring_take_token(ring, elem);
+    return 0;
+
+}
+
+unsigned int ring_count(ring_t * ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return head - tail;
+}
+
+unsigned int ring_capacity(ring_t * ring) {
+    return ring->mask + 1;
+}
@@ -0,0 +1,29 @@
+/*
+ * ring.h
+ *
+ * Bounded lock-free ring buffer of fixed size elements.
+ * Any number of producers and consumers may use the ring concurrently.
+ * Producers never block; consumers can sleep on ring_pop_wait().
+ */
+
+#ifndef SRC_RING_H_
+#define SRC_RING_H_
+
+#include <stddef.h>
+
+typedef struct ring_s ring_t;
+
+ring_t * ring_create(size_t elem_size, unsigned int capacity);
+void ring_destroy(ring_t * ring);
+
+/* Returns 0 on success, -1 if the ring is full */
+int ring_push(ring_t * ring, const void * elem);
+
+/* Returns 0 on success, -1 if the ring is empty (or timeout expired) */
+int ring_pop(ring_t * ring, void * elem);
+int ring_pop_wait(ring_t * ring, void * elem, unsigned int timeout_ms);
+
+unsigned int ring_count(ring_t * ring);
+unsigned int ring_capacity(ring_t * ring);
+
+#endif /* SRC_RING_H_ */
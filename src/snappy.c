@@ -0,0 +1,248 @@
+/*
+ * snappy.c
+ *
+ * Element layout (see format_description.txt in the snappy sources):
+ *
+ *   tag & 3 == 0   literal, length - 1 in tag >> 2, or in 1..4 extra bytes
+ *   tag & 3 == 1   copy, length 4..11 and offset < 2048, one extra byte
+ *   tag & 3 == 2   copy, length 1..64, 16 bit offset
+ *   tag & 3 == 3   copy, length 1..64, 32 bit offset (never emitted here)
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "snappy.h"
+
+#define SNAPPY_BLOCK        (1 << 16)
+#define SNAPPY_HASH_BITS    14
+
+static inline uint32_t snappy_load32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t snappy_hash(uint32_t v) {
+    return (v * 0x1E35A7BD) >> (32 - SNAPPY_HASH_BITS);
+}
+
+static uint8_t * snappy_put_varint(uint8_t * out, size_t value) {
+    while (value >= 0x80) {
+        *out++ = value | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static uint8_t * snappy_emit_literal(uint8_t * out, const uint8_t * literal, size_t len) {
+
+    size_t n = len - 1;
+    if (n < 60) {
+        *out++ = n << 2;
+    } else {
+        uint8_t * tag = out++;
+        unsigned int bytes = 0;
+        while (n) {
+            *out++ = n & 0xFF;
+            n >>= 8;
+            bytes++;
+        }
+        *tag = (59 + bytes) << 2;
+    }
+    memcpy(out, literal, len);
+    return out + len;
+
+}
+
+static uint8_t * snappy_emit_copy_upto64(uint8_t * out, size_t offset, size_t len) {
+
+    if (len < 12 && offset < 2048) {
+        *out++ = 1 | ((len - 4) << 2) | ((offset >> 8) << 5);
+        *out++ = offset & 0xFF;
+    } else {
+        *out++ = 2 | ((len - 1) << 2);
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+    }
+    return out;
+
+}
+
+static uint8_t * snappy_emit_copy(uint8_t * out, size_t offset, size_t len) {
+
+    /* Keep every piece at 4 bytes or more, so copy-1 stays usable */
+    while (len >= 68) {
+        out = snappy_emit_copy_upto64(out, offset, 64);
+        len -= 64;
+    }
+    if (len > 64) {
+        out = snappy_emit_copy_upto64(out, offset, 60);
+        len -= 60;
+    }
+    return snappy_emit_copy_upto64(out, offset, len);
+
+}
+
+static uint8_t * snappy_compress_block(const uint8_t * in, size_t len, uint8_t * out, uint16_t * table) {
+
+    const uint8_t * ip = in;
+    const uint8_t * end = in + len;
+    const uint8_t * literal = in;
+
+    if (len >= 15) {
+        /* Matching stops where a 4 byte load would pass the end */
+        const uint8_t * limit = end - 4;
+        memset(table, 0, sizeof(uint16_t) << SNAPPY_HASH_BITS);
+        ip++;
+
+        while (ip <= limit) {
+            uint32_t word = snappy_load32(ip);
+            uint32_t h = snappy_hash(word);
+            const uint8_t * candidate = in + table[h];
+            table[h] = ip - in;
+
+            if (candidate >= ip || snappy_load32(candidate) != word) {
+                ip++;
+                continue;
+            }
+
+            if (ip > literal) {
+                out = snappy_emit_literal(out, literal, ip - literal);
+            }
+
+            const uint8_t * match = ip + 4;
+            const uint8_t * source = candidate + 4;
+            while (match < end && *match == *source) {
+                match++;
+                source++;
+            }
+
+            out = snappy_emit_copy(out, ip - candidate, match - ip);
+            ip = match;
+            literal = ip;
+        }
+    }
+
+    if (literal < end) {
+        out = snappy_emit_literal(out, literal, end - literal);
+    }
+    return out;
+
+}
+
+size_t snappy_max_compressed_length(size_t len) {
+    return 32 + len + len / 6;
+}
+
+size_t snappy_compress(const void * in, size_t len, void * out) {
+
+    uint16_t table[1 << SNAPPY_HASH_BITS];
+    const uint8_t * ip = in;
+    uint8_t * op = snappy_put_varint(out, len);
+
+    for (size_t done = 0; done < len; done += SNAPPY_BLOCK) {
+        size_t block = len - done < SNAPPY_BLOCK ? len - done : SNAPPY_BLOCK;
+        op = snappy_compress_block(ip + done, block, op, table);
+    }
+
+    return op - (uint8_t *) out;
+
+}
+
+static const uint8_t * snappy_get_varint(const uint8_t * in, const uint8_t * end, size_t * value) {
+
+    *value = 0;
+    for (unsigned int shift = 0; shift < 35 && in < end; shift += 7) {
+        uint8_t b = *in++;
+        *value |= (size_t) (b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            return in;
+        }
+    }
+    return NULL;
+
+}
+
+int snappy_uncompressed_length(const void * in, size_t len, size_t * result) {
+    return snappy_get_varint(in, (const uint8_t *) in + len, result) ? 0 : -1;
+}
+
+int snappy_uncompress(const void * in, size_t len, void * out) {
+
+    const uint8_t * ip = in;
+    const uint8_t * end = ip + len;
+    size_t out_len;
+
+    ip = snappy_get_varint(ip, end, &out_len);
+    if (ip == NULL) {
+        return -1;
+    }
+
+    uint8_t * op = out;
+    uint8_t * op_end = op + out_len;
+
+    while (ip < end) {
+        uint8_t tag = *ip++;
+        size_t length, offset;
+
+        if ((tag & 3) == 0) {
+            length = tag >> 2;
+            if (length >= 60) {
+                unsigned int bytes = length - 59;
+                if ((size_t) (end - ip) < bytes) {
+                    return -1;
+                }
+                length = 0;
+                for (unsigned int i = 0; i < bytes; i++) {
+                    length |= (size_t) ip[i] << (8 * i);
+                }
+                ip += bytes;
+            }
+            length++;
+            if ((size_t) (end - ip) < length || (size_t) (op_end - op) < length) {
+                return -1;
+            }
+            memcpy(op, ip, length);
+            ip += length;
+            op += length;
+            continue;
+        }
+
+        if ((tag & 3) == 1) {
+            if (ip >= end) {
+                return -1;
+            }
+            length = 4 + ((tag >> 2) & 7);
+            offset = ((size_t) (tag >> 5) << 8) | *ip++;
+        } else if ((tag & 3) == 2) {
+            if (end - ip < 2) {
+                return -1;
+            }
+            length = 1 + (tag >> 2);
+            offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+        } else {
+            if (end - ip < 4) {
+                return -1;
+            }
+            length = 1 + (tag >> 2);
+            offset = snappy_load32(ip);
+            ip += 4;
+        }
+
+        if (offset == 0 || offset > (size_t) (op - (uint8_t *) out) || (size_t) (op_end - op) < length) {
+            return -1;
+        }
+        /* Byte by byte, the source may overlap what is being written */
+        const uint8_t * source = op - offset;
+        for (size_t i = 0; i < length; i++) {
+            op[i] = source[i];
+        }
+        op += length;
+    }
+
+    return op == op_end ? 0 : -1;
+
+}
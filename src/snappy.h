@@ -0,0 +1,26 @@
+/*
+ * snappy.h
+ *
+ * Snappy raw block format, as used by Prometheus remote write. The
+ * compressor is the usual greedy hash matcher over 64 kB blocks; it trades
+ * some ratio for speed, like the reference implementation.
+ */
+
+#ifndef SRC_SNAPPY_H_
+#define SRC_SNAPPY_H_
+
+#include <stddef.h>
+
+/* Output size snappy_compress() can need for len bytes of input */
+size_t snappy_max_compressed_length(size_t len);
+
+/* Returns the compressed length. out must hold snappy_max_compressed_length(len) bytes */
+size_t snappy_compress(const void * in, size_t len, void * out);
+
+/* Reads the uncompressed length from the preamble, returns -1 if malformed */
+int snappy_uncompressed_length(const void * in, size_t len, size_t * result);
+
+/* out must hold the uncompressed length. Returns 0, or -1 if in is corrupt */
+int snappy_uncompress(const void * in, size_t len, void * out);
+
+#endif /* SRC_SNAPPY_H_ */
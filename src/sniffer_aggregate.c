@@ -0,0 +1,392 @@
+/*
+ * sniffer_aggregate.c
+ *
+ * Each series keeps the window being filled and a ring of the last
+ * AGGREGATE_HISTORY completed ones, slotted by window number, so windows
+ * shorter than the push interval wait for the next push. Only the
+ * aggregate sink thread adds samples; the exporters render under the same
+ * lock. A window still being filled once its time has passed is complete
+ * as well, it is rolled over by the next sample of the series.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include "sniffer_aggregate.h"
+#include "sniffer_filter.h"
+#include "metric_format.h"
+
+#define AGGREGATE_MIN_BITS      8
+#define AGGREGATE_WINDOW_MS     10000
+#define AGGREGATE_HISTORY       8       // Completed windows kept per series
+
+typedef struct {
+    uint64_t window;        /* 0 = empty */
+    double min;
+    double max;
+    double sum;
+    uint32_t count;
+    uint32_t buckets[SNIFFER_AGGREGATE_BUCKETS];    /* Samples <= bound, and above the bound before */
+} aggregate_window_t;
+
+typedef struct {
+    uint64_t key;
+    param_t * param;
+    uint16_t idx;
+    aggregate_window_t filling;
+    aggregate_window_t done[AGGREGATE_HISTORY];
+} aggregate_series_t;
+
+int sniffer_aggregate_running = 0;
+
+/* Only changed while stopped, under aggregate_lock as the sink may still be draining */
+static unsigned int aggregate_window_ms = AGGREGATE_WINDOW_MS;
+static int aggregate_node = -1;
+static unsigned int aggregate_id_lo = 0;
+static unsigned int aggregate_id_hi = 0xFFFF;
+static int aggregate_replace;
+static unsigned int aggregate_bucket_count;
+static double aggregate_bounds[SNIFFER_AGGREGATE_BUCKETS];
+static char aggregate_le[SNIFFER_AGGREGATE_BUCKETS][32];     /* le="bound" labels */
+
+static pthread_mutex_t aggregate_lock = PTHREAD_MUTEX_INITIALIZER;
+static aggregate_series_t * aggregate_slots;
+static unsigned int aggregate_bits;
+static unsigned int aggregate_used;
+
+static uint64_t aggregate_now_window(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now_ms = ((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec) / 1000;
+    return now_ms / aggregate_window_ms;
+}
+
+int sniffer_aggregate_match(const param_t * param) {
+
+    if (!sniffer_aggregate_running) {
+        return 0;
+    }
+
+    switch (param->type) {
+        case PARAM_TYPE_STRING:
+        case PARAM_TYPE_DATA:
+            return 0;
+        default:
+            break;
+    }
+
+    if (aggregate_node >= 0 && param->node != aggregate_node) {
+        return 0;
+    }
+    return param->id >= aggregate_id_lo && param->id <= aggregate_id_hi;
+
+}
+
+int sniffer_aggregate_replaces(const param_t * param) {
+    return aggregate_replace && sniffer_aggregate_match(param);
+}
+
+uint64_t sniffer_aggregate_completed(void) {
+    return sniffer_aggregate_running ? aggregate_now_window() - 1 : 0;
+}
+
+static aggregate_series_t * aggregate_slot(aggregate_series_t * slots, unsigned int bits, uint64_t key) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t i = (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+    while (slots[i].param != NULL && slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static int aggregate_grow(void) {
+
+    if (aggregate_slots != NULL && (aggregate_used + 1) * 2 <= (1u << aggregate_bits)) {
+        return 0;
+    }
+
+    unsigned int bits = aggregate_slots ? aggregate_bits + 1 : AGGREGATE_MIN_BITS;
+    aggregate_series_t * slots = calloc(1u << bits, sizeof(aggregate_series_t));
+    if (slots == NULL) {
+        return -1;
+    }
+
+    unsigned int old_size = aggregate_slots ? 1u << aggregate_bits : 0;
+    for (unsigned int i = 0; i < old_size; i++) {
+        if (aggregate_slots[i].param) {
+            *aggregate_slot(slots, bits, aggregate_slots[i].key) = aggregate_slots[i];
+        }
+    }
+
+    free(aggregate_slots);
+    aggregate_slots = slots;
+    aggregate_bits = bits;
+    return 0;
+
+}
+
+void sniffer_aggregate_add(const param_sniffer_sample_t * sample) {
+
+    param_t * param = sample->param;
+    uint64_t key = ((uint64_t) param->node << 32) | ((uint64_t) param->id << 16) | sample->idx;
+    uint64_t window = aggregate_now_window();
+    double value = param_sniffer_value_double(sample);
+
+    pthread_mutex_lock(&aggregate_lock);
+
+    if (aggregate_grow() < 0) {
+        pthread_mutex_unlock(&aggregate_lock);
+        return;
+    }
+
+    aggregate_series_t * s = aggregate_slot(aggregate_slots, aggregate_bits, key);
+    if (s->param == NULL) {
+        s->key = key;
+        s->idx = sample->idx;
+        aggregate_used++;
+    }
+    s->param = param;
+
+    aggregate_window_t * w = &s->filling;
+    if (w->window != window) {
+        if (w->count) {
+            s->done[w->window % AGGREGATE_HISTORY] = *w;
+        }
+        memset(w, 0, sizeof(*w));
+        w->window = window;
+        w->min = value;
+        w->max = value;
+    }
+
+    if (value < w->min)
+        w->min = value;
+    if (value > w->max)
+        w->max = value;
+    w->sum += value;
+    w->count++;
+
+    for (unsigned int i = 0; i < aggregate_bucket_count; i++) {
+        if (value <= aggregate_bounds[i]) {
+            w->buckets[i]++;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&aggregate_lock);
+
+}
+
+/* Room for one more line in *buf, returns -1 if out of memory */
+static int aggregate_reserve(char ** buf, size_t * size, size_t len) {
+
+    size_t needed = len + METRIC_LINE_MAX + sizeof(aggregate_le[0]);
+    if (needed <= *size) {
+        return 0;
+    }
+
+    size_t grown_size = *size ? *size * 2 : 64 * 1024;
+    while (grown_size < needed) {
+        grown_size *= 2;
+    }
+    char * grown = realloc(*buf, grown_size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *size = grown_size;
+    return 0;
+
+}
+
+static size_t aggregate_render_window(char ** buf, size_t * size, size_t len, aggregate_series_t * s, aggregate_window_t * w) {
+
+    static const char * suffixes[] = {"_min", "_max", "_avg"};
+    double values[] = {w->min, w->max, w->sum / w->count};
+    uint64_t time_ms = (w->window + 1) * aggregate_window_ms;
+
+    for (unsigned int i = 0; i < 3; i++) {
+        if (aggregate_reserve(buf, size, len) < 0) {
+            return len;
+        }
+        param_sniffer_value_t value = {.d = values[i]};
+        len += metric_format_derived(*buf + len, *size - len, s->param, s->idx, suffixes[i], NULL, PARAM_TYPE_DOUBLE, value, time_ms);
+    }
+
+    if (aggregate_reserve(buf, size, len) < 0) {
+        return len;
+    }
+    param_sniffer_value_t count = {.u = w->count};
+    len += metric_format_derived(*buf + len, *size - len, s->param, s->idx, "_count", NULL, PARAM_TYPE_UINT64, count, time_ms);
+
+    if (aggregate_bucket_count == 0) {
+        return len;
+    }
+
+    /* Cumulative, as Prometheus histograms are */
+    param_sniffer_value_t cumulative = {.u = 0};
+    for (unsigned int i = 0; i <= aggregate_bucket_count; i++) {
+        if (aggregate_reserve(buf, size, len) < 0) {
+            return len;
+        }
+        cumulative.u = i < aggregate_bucket_count ? cumulative.u + w->buckets[i] : w->count;
+        const char * le = i < aggregate_bucket_count ? aggregate_le[i] : "le=\"+Inf\"";
+        len += metric_format_derived(*buf + len, *size - len, s->param, s->idx, "_bucket", le, PARAM_TYPE_UINT64, cumulative, time_ms);
+    }
+
+    return len;
+
+}
+
+size_t sniffer_aggregate_render(char ** buf, size_t * size, size_t offset, uint64_t after) {
+
+    if (!sniffer_aggregate_running) {
+        return offset;
+    }
+
+    uint64_t completed = sniffer_aggregate_completed();
+    size_t len = offset;
+
+    pthread_mutex_lock(&aggregate_lock);
+
+    unsigned int slots = aggregate_slots ? 1u << aggregate_bits : 0;
+    for (unsigned int i = 0; i < slots; i++) {
+        aggregate_series_t * s = &aggregate_slots[i];
+        if (s->param == NULL) {
+            continue;
+        }
+        /* Oldest first, so a pusher sends them in order */
+        aggregate_window_t * windows[AGGREGATE_HISTORY + 1];
+        unsigned int count = 0;
+        for (unsigned int j = 0; j <= AGGREGATE_HISTORY; j++) {
+            aggregate_window_t * w = j < AGGREGATE_HISTORY ? &s->done[j] : &s->filling;
+            if (w->count == 0 || w->window <= after || w->window > completed) {
+                continue;
+            }
+            unsigned int k = count++;
+            for (; k > 0 && windows[k - 1]->window > w->window; k--) {
+                windows[k] = windows[k - 1];
+            }
+            windows[k] = w;
+        }
+        for (unsigned int j = 0; j < count; j++) {
+            len = aggregate_render_window(buf, size, len, s, windows[j]);
+        }
+    }
+
+    pthread_mutex_unlock(&aggregate_lock);
+
+    return len;
+
+}
+
+/* Parses into bounds and le, returns the number of buckets or -1 if invalid */
+static int aggregate_parse_buckets(char * str, double * bounds, char (*le)[sizeof(aggregate_le[0])]) {
+
+    unsigned int count = 0;
+
+    for (char * save, * tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char * end;
+        double bound = strtod(tok, &end);
+        if (end == tok || *end != '\0' || !isfinite(bound)) {
+            printf("Invalid bucket bound %s\n", tok);
+            return -1;
+        }
+        if (count && bound <= bounds[count - 1]) {
+            printf("Bucket bounds must be increasing\n");
+            return -1;
+        }
+        if (count == SNIFFER_AGGREGATE_BUCKETS) {
+            printf("At most %u buckets\n", SNIFFER_AGGREGATE_BUCKETS);
+            return -1;
+        }
+        bounds[count] = bound;
+        snprintf(le[count], sizeof(le[0]), "le=\"%.17g\"", bound);
+        count++;
+    }
+
+    return count;
+
+}
+
+static int sniffer_aggregate_start_cmd(struct slash * slash) {
+
+    if (sniffer_aggregate_running) {
+        printf("Aggregation already running, stop it first\n");
+        return SLASH_EINVAL;
+    }
+
+    unsigned int window_ms = AGGREGATE_WINDOW_MS;
+    int node = -1;
+    char * ids = NULL;
+    char * buckets = NULL;
+    int replace = 0;
+
+    optparse_t * parser = optparse_new("sniffer aggregate start", "");
+    optparse_add_help(parser);
+    optparse_add_unsigned(parser, 'w', "window", "MS", 0, &window_ms, "Window length (default = 10000)");
+    optparse_add_int(parser, 'n', "node", "NUM", 0, &node, "Only params of node (default = any)");
+    optparse_add_string(parser, 'i', "ids", "FIRST[-LAST]", &ids, "Only param id or id range (default = all)");
+    optparse_add_string(parser, 'b', "buckets", "B1,B2,...", &buckets, "Histogram bucket upper bounds (default = none)");
+    optparse_add_set(parser, 'r', "replace", 1, &replace, "Do not export raw samples of aggregated params to Prometheus and VM");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (window_ms == 0) {
+        printf("Window must be at least 1 ms\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    unsigned int id_lo = 0, id_hi = 0xFFFF;
+    if (ids && sniffer_filter_parse_ids(ids, &id_lo, &id_hi) < 0) {
+        printf("Invalid id range %s\n", ids);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    double bounds[SNIFFER_AGGREGATE_BUCKETS];
+    char le[SNIFFER_AGGREGATE_BUCKETS][sizeof(aggregate_le[0])];
+    char * bucket_list = buckets ? strdup(buckets) : NULL;
+    int bucket_count = bucket_list ? aggregate_parse_buckets(bucket_list, bounds, le) : 0;
+    free(bucket_list);
+    optparse_del(parser);
+    if (bucket_count < 0) {
+        return SLASH_EINVAL;
+    }
+
+    pthread_mutex_lock(&aggregate_lock);
+    aggregate_bucket_count = bucket_count;
+    memcpy(aggregate_bounds, bounds, bucket_count * sizeof(bounds[0]));
+    memcpy(aggregate_le, le, bucket_count * sizeof(le[0]));
+    free(aggregate_slots);
+    aggregate_slots = NULL;
+    aggregate_used = 0;
+    aggregate_window_ms = window_ms;
+    aggregate_node = node;
+    aggregate_id_lo = id_lo;
+    aggregate_id_hi = id_hi;
+    aggregate_replace = replace;
+    sniffer_aggregate_running = 1;
+    pthread_mutex_unlock(&aggregate_lock);
+
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, aggregate, start, sniffer_aggregate_start_cmd, "", "Export windowed min, max, avg, count and histograms of params");
+
+static int sniffer_aggregate_stop_cmd(struct slash * slash) {
+    sniffer_aggregate_running = 0;
+    return SLASH_SUCCESS;
+}
+slash_command_subsub(sniffer, aggregate, stop, sniffer_aggregate_stop_cmd, "", "Stop windowed aggregation");
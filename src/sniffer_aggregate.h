@@ -0,0 +1,46 @@
+/*
+ * sniffer_aggregate.h
+ *
+ * Windowed summaries of high rate params. Samples of the selected params
+ * are folded into per series min, max, sum, count and optional histogram
+ * buckets as they arrive. When a window of wall clock time ends, its
+ * summary is exported as name_min, name_max, name_avg, name_count and
+ * name_bucket{le="..."} series, stamped with the end of the window.
+ *
+ * The Prometheus exporter shows the last completed window on every
+ * scrape, Victoria Metrics gets each completed window pushed once. The
+ * last 8 completed windows of a series are kept, so a window may be down
+ * to an eighth of the push interval. With -r the raw samples of aggregated
+ * params are no longer exported there.
+ */
+
+#ifndef SRC_SNIFFER_AGGREGATE_H_
+#define SRC_SNIFFER_AGGREGATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <param/param.h>
+
+#include "param_sniffer.h"
+
+#define SNIFFER_AGGREGATE_BUCKETS   16
+
+extern int sniffer_aggregate_running;
+
+/* Returns 1 if samples of param are aggregated */
+int sniffer_aggregate_match(const param_t * param);
+
+/* Returns 1 if the exporters should leave out raw samples of param */
+int sniffer_aggregate_replaces(const param_t * param);
+
+/* Called on the aggregate sink thread */
+void sniffer_aggregate_add(const param_sniffer_sample_t * sample);
+
+/* Number of the last completed window, 0 if none */
+uint64_t sniffer_aggregate_completed(void);
+
+/* Render the summaries of windows after window `after` that are completed,
+ * into *buf (grown with realloc as needed). Returns length */
+size_t sniffer_aggregate_render(char ** buf, size_t * size, size_t offset, uint64_t after);
+
+#endif /* SRC_SNIFFER_AGGREGATE_H_ */
@@ -0,0 +1,255 @@
+/*
+ * sniffer_bench.c
+ *
+ * Microbenchmarks for the parameter sniffer decode path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include <param/param.h>
+#include <param/param_list.h>
+#include <param/param_queue.h>
+#include <param/param_server.h>
+#include <mpack/mpack.h>
+
+#include "param_index.h"
+#include "metric_format.h"
+
+uint64_t clock_get_nsec(void);
+
+typedef param_t * (*bench_find_t)(int node, int id);
+
+static unsigned int bench_decode(param_queue_t * queue, int src, bench_find_t find) {
+
+    unsigned int found = 0;
+
+    queue->last_node = src;
+    mpack_reader_t reader;
+    mpack_reader_init_data(&reader, queue->buffer, queue->used);
+    while (reader.data < reader.end) {
+        int id, node, offset = -1;
+        long unsigned int timestamp = 0;
+        param_deserialize_id(&reader, &id, &node, &timestamp, &offset, queue);
+        if (node == 0) {
+            node = src;
+        }
+        param_t * param = find(node, id);
+        if (param == NULL) {
+            break;
+        }
+        mpack_discard(&reader);
+        if (mpack_reader_error(&reader) != mpack_ok) {
+            break;
+        }
+        found++;
+    }
+
+    return found;
+
+}
+
+static double bench_run(const char * name, param_queue_t * queue, int node, unsigned int rounds, bench_find_t find) {
+
+    unsigned int found = 0;
+    uint64_t start = clock_get_nsec();
+    for (unsigned int r = 0; r < rounds; r++) {
+        found += bench_decode(queue, node, find);
+    }
+    uint64_t elapsed = clock_get_nsec() - start;
+
+    double ns_per_param = found ? (double) elapsed / found : 0;
+    printf("  %-20s %10u params decoded, %8.1f ns/param\n", name, found, ns_per_param);
+    return ns_per_param;
+
+}
+
+static int sniffer_bench_lookup_cmd(struct slash * slash) {
+
+    unsigned int count = 10000;
+    unsigned int node = 16000;
+    unsigned int rounds = 10;
+
+    optparse_t * parser = optparse_new("sniffer bench lookup", "");
+    optparse_add_help(parser);
+    optparse_add_unsigned(parser, 'c', "count", "NUM", 0, &count, "Number of listed params (default = 10000)");
+    optparse_add_unsigned(parser, 'n', "node", "NUM", 0, &node, "Node to create bench params on (default = 16000)");
+    optparse_add_unsigned(parser, 'r', "rounds", "NUM", 0, &rounds, "Decode rounds (default = 10)");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (count == 0 || count > 0xFFFF) {
+        printf("Count must be between 1 and 65535\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    param_t ** params = malloc(count * sizeof(param_t *));
+    int buffer_size = count * 16;
+    char * buffer = malloc(buffer_size);
+    if (params == NULL || buffer == NULL) {
+        free(params);
+        free(buffer);
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
+
+    printf("Creating %u params on node %u\n", count, node);
+    for (unsigned int i = 0; i < count; i++) {
+        char name[36];
+        snprintf(name, sizeof(name), "bench_%u", i);
+        params[i] = param_list_create_remote(i, node, PARAM_TYPE_UINT32, PM_TELEM, 0, name, NULL, NULL, -1);
+        param_list_add(params[i]);
+    }
+
+    /* Serialize in random order, so list position does not favour the linear search */
+    for (unsigned int i = count - 1; i > 0; i--) {
+        unsigned int j = rand() % (i + 1);
+        param_t * tmp = params[i];
+        params[i] = params[j];
+        params[j] = tmp;
+    }
+
+    param_queue_t queue;
+    param_queue_init(&queue, buffer, buffer_size, 0, PARAM_QUEUE_TYPE_SET, 2);
+    for (unsigned int i = 0; i < count; i++) {
+        uint32_t value = i;
+        param_queue_add(&queue, params[i], 0, &value);
+    }
+
+    /* What the refresh thread does once a second */
+    uint64_t start = clock_get_nsec();
+    param_index_refresh();
+    printf("Index rebuild of %u params: %.3f ms\n", param_index_count(), (clock_get_nsec() - start) / 1e6);
+
+    printf("Decoding %u bytes, %u rounds\n", queue.used, rounds);
+    double linear = bench_run("param_list_find_id", &queue, node, rounds, param_list_find_id);
+    double hashed = bench_run("param_index_find", &queue, node, rounds, param_index_find);
+    if (hashed > 0) {
+        printf("  Speedup %.1fx (%u params indexed)\n", linear / hashed, param_index_count());
+    }
+
+    param_list_remove(node, 0);
+    free(params);
+    free(buffer);
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, bench, lookup, sniffer_bench_lookup_cmd, "", "Benchmark param lookup in the sniffer decode loop");
+
+/* The formatting done per sample before metric_format: sprintf, then strlen + strcpy into the sink buffer */
+static size_t bench_format_sprintf(char * out, size_t len, const param_sniffer_sample_t * sample) {
+
+    char tmp[1000];
+    param_t * param = sample->param;
+
+    if (param->type == PARAM_TYPE_FLOAT) {
+        sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %e %"PRIu64"\n", param->name, param->node, sample->idx, sample->value.d, sample->time_ms);
+    } else {
+        sprintf(tmp, "%s{node=\"%u\", idx=\"%u\"} %u %"PRIu64"\n", param->name, param->node, sample->idx, (unsigned int) sample->value.u, sample->time_ms);
+    }
+
+    size_t line_len = strlen(tmp);
+    if (line_len >= len) {
+        return 0;
+    }
+    strcpy(out, tmp);
+    return strlen(tmp);
+
+}
+
+typedef size_t (*bench_format_t)(char * out, size_t len, const param_sniffer_sample_t * sample);
+
+static double bench_format_run(char * buf, size_t buf_size, unsigned int lines, param_t * param, bench_format_t format) {
+
+    size_t used = 0;
+    param_sniffer_sample_t sample = {
+        .param = param,
+        .time_ms = 1700000000000,
+    };
+
+    uint64_t start = clock_get_nsec();
+    for (unsigned int i = 0; i < lines; i++) {
+        sample.idx = i & 7;
+        sample.time_ms++;
+        if (param->type == PARAM_TYPE_FLOAT) {
+            sample.value.d = i * 0.37;
+        } else {
+            sample.value.u = i * 7919;
+        }
+        size_t len = format(buf + used, buf_size - used, &sample);
+        used += len;
+        if (len == 0 || buf_size - used < METRIC_LINE_MAX) {
+            used = 0;
+        }
+    }
+    uint64_t elapsed = clock_get_nsec() - start;
+
+    return elapsed ? lines * 1E9 / elapsed : 0;
+
+}
+
+static int sniffer_bench_format_cmd(struct slash * slash) {
+
+    unsigned int lines = 1000000;
+
+    optparse_t * parser = optparse_new("sniffer bench format", "");
+    optparse_add_help(parser);
+    optparse_add_unsigned(parser, 'c', "count", "NUM", 0, &lines, "Number of lines per run (default = 1000000)");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    size_t buf_size = 10 * 1024 * 1024;
+    char * buf = malloc(buf_size);
+    if (buf == NULL) {
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
+
+    param_t param_u32 = {
+        .name = "bench_uint32_param",
+        .node = 4321,
+        .id = 1,
+        .type = PARAM_TYPE_UINT32,
+    };
+    param_t param_float = {
+        .name = "bench_float_param",
+        .node = 4321,
+        .id = 2,
+        .type = PARAM_TYPE_FLOAT,
+    };
+
+    /* metric_format interns series by param address, so hand it copies that are never freed */
+    param_t * params[] = {param_index_pin(&param_u32), param_index_pin(&param_float)};
+    if (params[0] == NULL || params[1] == NULL) {
+        free(buf);
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
+
+    for (unsigned int i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+        double old = bench_format_run(buf, buf_size, lines, params[i], bench_format_sprintf);
+        double new = bench_format_run(buf, buf_size, lines, params[i], metric_format_sample);
+        printf("  %-20s sprintf %10.0f lines/s, metric_format %10.0f lines/s, %.1fx\n",
+            params[i]->name, old, new, old > 0 ? new / old : 0);
+    }
+
+    free(buf);
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, bench, format, sniffer_bench_format_cmd, "", "Benchmark sample line formatting");
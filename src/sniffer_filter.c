@@ -0,0 +1,337 @@
+/*
+ * sniffer_filter.c
+ *
+ * The rule list is only touched by slash commands. Each change compiles a
+ * new filter and publishes it with an atomic pointer store, so the sniffer
+ * threads read it without locking.
+ *
+ * The replaced filter is freed after a grace period, RCU style. A reader
+ * counts itself in on its own cache line under the parity of the current
+ * epoch before loading the filter. The publisher flips the epoch and waits
+ * for the old parity to drain, twice, after which no reader can still hold
+ * the old filter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include "sniffer_filter.h"
+
+#define FILTER_RULES_MAX    64
+#define FILTER_NODES        16384   // 14 bit CSP address
+#define FILTER_PORTS        64
+#define FILTER_IDS          65536
+#define FILTER_READERS_MAX  64      // Threads with their own counters, more share the last
+
+#define BIT_SET(bits, i)    ((bits)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(bits, i)   ((bits)[(i) >> 3] & (1 << ((i) & 7)))
+
+typedef struct {
+    int node;                   // -1 = any
+    int port;                   // -1 = any
+    unsigned int id_lo;
+    unsigned int id_hi;
+    int all_ids;
+} sniffer_filter_rule_t;
+
+/* Rule sets are masks with bit r for rule r */
+typedef struct {
+    uint64_t port_any[FILTER_PORTS];            // Rules for any node, per port
+    uint64_t * node_ports[FILTER_NODES];        // Rules per port for each named node, NULL = none
+    uint64_t all_ids;                           // Rules passing every id
+    uint8_t * ids[FILTER_RULES_MAX];            // Ids passing per rule, NULL for all_ids rules
+} sniffer_filter_t;
+
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static sniffer_filter_rule_t filter_rules[FILTER_RULES_MAX];
+static unsigned int filter_rule_count;
+
+/* Readers inside a filter lookup, by epoch parity */
+typedef struct {
+    unsigned int active[2];
+} __attribute__((aligned(64))) filter_reader_t;
+
+static sniffer_filter_t * filter_active;
+static unsigned int filter_epoch;
+static filter_reader_t filter_readers[FILTER_READERS_MAX];
+static unsigned int filter_reader_count;
+static __thread filter_reader_t * filter_reader;
+
+static sniffer_filter_t * filter_enter(unsigned int * parity) {
+
+    if (filter_reader == NULL) {
+        unsigned int slot = __atomic_fetch_add(&filter_reader_count, 1, __ATOMIC_RELAXED);
+        filter_reader = &filter_readers[slot < FILTER_READERS_MAX ? slot : FILTER_READERS_MAX - 1];
+    }
+
+    /* Counted in before the load, so the publisher waits for this lookup */
+    *parity = __atomic_load_n(&filter_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&filter_reader->active[*parity], 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&filter_active, __ATOMIC_SEQ_CST);
+
+}
+
+static void filter_exit(unsigned int parity) {
+    __atomic_fetch_sub(&filter_reader->active[parity], 1, __ATOMIC_RELEASE);
+}
+
+/* Returns once no reader can still hold a filter replaced before the call */
+static void filter_synchronize(void) {
+
+    for (int phase = 0; phase < 2; phase++) {
+        unsigned int parity = __atomic_fetch_add(&filter_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (unsigned int i = 0; i < FILTER_READERS_MAX; i++) {
+            while (__atomic_load_n(&filter_readers[i].active[parity], __ATOMIC_SEQ_CST)) {
+                usleep(100);
+            }
+        }
+    }
+
+}
+
+uint64_t sniffer_filter_packet(unsigned int node, unsigned int port) {
+
+    unsigned int parity;
+    sniffer_filter_t * filter = filter_enter(&parity);
+    uint64_t rules = UINT64_MAX;
+    if (filter) {
+        port &= FILTER_PORTS - 1;
+        uint64_t * ports = filter->node_ports[node & (FILTER_NODES - 1)];
+        rules = filter->port_any[port] | (ports ? ports[port] : 0);
+    }
+    filter_exit(parity);
+    return rules;
+
+}
+
+int sniffer_filter_param(uint64_t rules, unsigned int id) {
+
+    unsigned int parity;
+    sniffer_filter_t * filter = filter_enter(&parity);
+    int pass = 1;
+    if (filter && !(rules & filter->all_ids)) {
+        id &= FILTER_IDS - 1;
+        pass = 0;
+        for (; rules && !pass; rules &= rules - 1) {
+            uint8_t * ids = filter->ids[__builtin_ctzll(rules)];
+            pass = ids != NULL && BIT_TEST(ids, id);
+        }
+    }
+    filter_exit(parity);
+    return pass;
+
+}
+
+static void filter_free(sniffer_filter_t * filter) {
+
+    if (filter == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < FILTER_NODES; i++) {
+        free(filter->node_ports[i]);
+    }
+    for (unsigned int r = 0; r < FILTER_RULES_MAX; r++) {
+        free(filter->ids[r]);
+    }
+    free(filter);
+
+}
+
+static sniffer_filter_t * filter_compile(void) {
+
+    sniffer_filter_t * filter = calloc(1, sizeof(sniffer_filter_t));
+    if (filter == NULL) {
+        return NULL;
+    }
+
+    for (unsigned int r = 0; r < filter_rule_count; r++) {
+        sniffer_filter_rule_t * rule = &filter_rules[r];
+        uint64_t bit = 1ull << r;
+
+        uint64_t * ports = filter->port_any;
+        if (rule->node >= 0) {
+            if (filter->node_ports[rule->node] == NULL) {
+                filter->node_ports[rule->node] = calloc(FILTER_PORTS, sizeof(uint64_t));
+                if (filter->node_ports[rule->node] == NULL) {
+                    filter_free(filter);
+                    return NULL;
+                }
+            }
+            ports = filter->node_ports[rule->node];
+        }
+        for (int port = 0; port < FILTER_PORTS; port++) {
+            if (rule->port < 0 || rule->port == port) {
+                ports[port] |= bit;
+            }
+        }
+
+        if (rule->all_ids) {
+            filter->all_ids |= bit;
+            continue;
+        }
+
+        filter->ids[r] = calloc(1, FILTER_IDS / 8);
+        if (filter->ids[r] == NULL) {
+            filter_free(filter);
+            return NULL;
+        }
+        for (unsigned int id = rule->id_lo; id <= rule->id_hi; id++) {
+            BIT_SET(filter->ids[r], id);
+        }
+    }
+
+    return filter;
+
+}
+
+/* Call with filter_lock held */
+static int filter_publish(void) {
+
+    sniffer_filter_t * filter = NULL;
+    if (filter_rule_count > 0) {
+        filter = filter_compile();
+        if (filter == NULL) {
+            return -1;
+        }
+    }
+
+    sniffer_filter_t * old = __atomic_exchange_n(&filter_active, filter, __ATOMIC_SEQ_CST);
+    filter_synchronize();
+    filter_free(old);
+    return 0;
+
+}
+
+int sniffer_filter_parse_ids(const char * str, unsigned int * lo, unsigned int * hi) {
+
+    char * end;
+    unsigned long first = strtoul(str, &end, 0);
+    unsigned long last = first;
+    if (end == str) {
+        return -1;
+    }
+    if (*end == '-') {
+        const char * next = end + 1;
+        last = strtoul(next, &end, 0);
+        if (end == next) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || first > last || last >= FILTER_IDS) {
+        return -1;
+    }
+
+    *lo = first;
+    *hi = last;
+    return 0;
+
+}
+
+static int sniffer_filter_add_cmd(struct slash * slash) {
+
+    int node = -1;
+    int port = -1;
+    char * ids = NULL;
+
+    optparse_t * parser = optparse_new("sniffer filter add", "");
+    optparse_add_help(parser);
+    optparse_add_int(parser, 'n', "node", "NUM", 0, &node, "Source node (default = any)");
+    optparse_add_int(parser, 'p', "port", "NUM", 0, &port, "Source port (default = any)");
+    optparse_add_string(parser, 'i', "ids", "FIRST[-LAST]", &ids, "Param id or id range (default = all)");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (node >= FILTER_NODES || port >= FILTER_PORTS) {
+        printf("Node must be below %u and port below %u\n", FILTER_NODES, FILTER_PORTS);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    sniffer_filter_rule_t rule = {
+        .node = node < 0 ? -1 : node,
+        .port = port < 0 ? -1 : port,
+        .all_ids = 1,
+    };
+
+    if (ids) {
+        if (sniffer_filter_parse_ids(ids, &rule.id_lo, &rule.id_hi) < 0) {
+            printf("Invalid id range %s\n", ids);
+            optparse_del(parser);
+            return SLASH_EINVAL;
+        }
+        rule.all_ids = 0;
+    }
+
+    pthread_mutex_lock(&filter_lock);
+
+    if (filter_rule_count >= FILTER_RULES_MAX) {
+        pthread_mutex_unlock(&filter_lock);
+        printf("Filter is full, %u rules\n", FILTER_RULES_MAX);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    filter_rules[filter_rule_count++] = rule;
+    if (filter_publish() < 0) {
+        filter_rule_count--;
+        pthread_mutex_unlock(&filter_lock);
+        optparse_del(parser);
+        return SLASH_ENOMEM;
+    }
+
+    pthread_mutex_unlock(&filter_lock);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, filter, add, sniffer_filter_add_cmd, "", "Only sniff matching node, port and param ids");
+
+static int sniffer_filter_list_cmd(struct slash * slash) {
+
+    pthread_mutex_lock(&filter_lock);
+
+    if (filter_rule_count == 0) {
+        printf("No filter, all packets pass\n");
+    }
+
+    for (unsigned int i = 0; i < filter_rule_count; i++) {
+        sniffer_filter_rule_t * rule = &filter_rules[i];
+        char node[8] = "any", port[8] = "any", ids[16] = "all";
+        if (rule->node >= 0)
+            snprintf(node, sizeof(node), "%d", rule->node);
+        if (rule->port >= 0)
+            snprintf(port, sizeof(port), "%d", rule->port);
+        if (!rule->all_ids)
+            snprintf(ids, sizeof(ids), "%u-%u", rule->id_lo, rule->id_hi);
+        printf("  %2u: node %-5s port %-3s ids %s\n", i, node, port, ids);
+    }
+
+    pthread_mutex_unlock(&filter_lock);
+
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, filter, list, sniffer_filter_list_cmd, "", "List sniffer filter rules");
+
+static int sniffer_filter_clear_cmd(struct slash * slash) {
+
+    pthread_mutex_lock(&filter_lock);
+    filter_rule_count = 0;
+    filter_publish();
+    pthread_mutex_unlock(&filter_lock);
+
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, filter, clear, sniffer_filter_clear_cmd, "", "Remove all sniffer filter rules");
@@ -0,0 +1,30 @@
+/*
+ * sniffer_filter.h
+ *
+ * Early reject filter for the parameter sniffer. Rules are source node,
+ * port and param id range triplets added with "sniffer filter add". They
+ * are compiled into the set of rules each node and port matches, and an
+ * id bitmap per rule. The reader drops a packet that matches no rule on
+ * its header alone, before CRC or mpack work, and the decoders skip params
+ * none of the packet's rules want without looking them up or formatting
+ * them.
+ *
+ * With no rules every packet and param passes.
+ */
+
+#ifndef SRC_SNIFFER_FILTER_H_
+#define SRC_SNIFFER_FILTER_H_
+
+#include <stdint.h>
+
+/* Returns the rules a packet from node on port matches, as a mask with bit
+ * r for rule r. 0 if it cannot contain wanted params, all bits without rules */
+uint64_t sniffer_filter_packet(unsigned int node, unsigned int port);
+
+/* Returns 1 if param id is wanted by one of the rules of a packet */
+int sniffer_filter_param(uint64_t rules, unsigned int id);
+
+/* Parses "FIRST[-LAST]", returns 0 or -1 if invalid */
+int sniffer_filter_parse_ids(const char * str, unsigned int * lo, unsigned int * hi);
+
+#endif /* SRC_SNIFFER_FILTER_H_ */
@@ -0,0 +1,248 @@
+/*
+ * sniffer_replay.c
+ *
+ * "sniffer record" appends every promiscuous packet to a capture file.
+ * "sniffer replay" reads a capture back through param_sniffer_dispatch(),
+ * the same path live packets take, as fast as the decoders allow or at a
+ * multiple of the recorded rate. Useful as a repeatable throughput
+ * benchmark (with sinks muted), and to backfill metrics from old captures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <csp/csp.h>
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include "sniffer_replay.h"
+#include "param_sniffer.h"
+#include "csp_capture.h"
+#include "sniffer_stats.h"
+
+/* Internal libcsp functions, as in zmqproxy.c */
+int csp_id_strip(csp_packet_t * packet);
+int csp_id_setup_rx(csp_packet_t * packet);
+void csp_id_prepend(csp_packet_t * packet);
+
+uint64_t clock_get_nsec(void);
+
+int sniffer_recording = 0;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_writer_t * record_capture;
+
+void sniffer_record(csp_packet_t * packet) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    /* Rebuild the wire header in front of the data */
+    csp_id_prepend(packet);
+
+    pthread_mutex_lock(&record_lock);
+    if (record_capture) {
+        csp_capture_add(record_capture, (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec, packet->frame_begin, packet->frame_length);
+    }
+    pthread_mutex_unlock(&record_lock);
+
+}
+
+static int sniffer_record_start_cmd(struct slash * slash) {
+
+    int hk_node = 0;
+
+    optparse_t * parser = optparse_new("sniffer record start", "<file>");
+    optparse_add_help(parser);
+    optparse_add_int(parser, 'n', "hk_node", "NUM", 0, &hk_node, "Housekeeping node");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (++argi >= slash->argc) {
+        printf("Missing capture filename\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (sniffer_recording) {
+        printf("Already recording\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (param_sniffer_init(0, hk_node) < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    log_writer_t * capture = csp_capture_create(slash->argv[argi], csp_get_conf()->version);
+    if (capture == NULL) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    pthread_mutex_lock(&record_lock);
+    record_capture = capture;
+    pthread_mutex_unlock(&record_lock);
+    sniffer_recording = 1;
+
+    printf("Recording sniffed packets to %s\n", slash->argv[argi]);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+}
+slash_command_subsub(sniffer, record, start, sniffer_record_start_cmd, "<file>", "Record sniffed CSP packets to a capture file");
+
+static int sniffer_record_stop_cmd(struct slash * slash) {
+
+    sniffer_recording = 0;
+
+    pthread_mutex_lock(&record_lock);
+    log_writer_t * capture = record_capture;
+    record_capture = NULL;
+    pthread_mutex_unlock(&record_lock);
+
+    log_writer_close(capture);
+    return SLASH_SUCCESS;
+}
+slash_command_subsub(sniffer, record, stop, sniffer_record_stop_cmd, "", "Flush and close the capture file");
+
+/* Sleeps until the packet recorded at time_ns is due, relative to the first one */
+static void sniffer_replay_pace(uint64_t time_ns, double multiple, uint64_t * first_ns, uint64_t * start_ns) {
+
+    if (*first_ns == 0) {
+        *first_ns = time_ns;
+        *start_ns = clock_get_nsec();
+        return;
+    }
+
+    if (time_ns < *first_ns) {
+        return;
+    }
+
+    uint64_t due = *start_ns + (uint64_t) ((time_ns - *first_ns) / multiple);
+    uint64_t now = clock_get_nsec();
+    if (due > now + 1000) {
+        usleep((due - now) / 1000);
+    }
+
+}
+
+static int sniffer_replay_cmd(struct slash * slash) {
+
+    param_sniffer_source_t source = {.wait = 1};
+    char * speed = NULL;
+
+    optparse_t * parser = optparse_new("sniffer replay", "<file>");
+    optparse_add_help(parser);
+    optparse_add_int(parser, 'n', "hk_node", "NUM", 0, &source.hk_node, "Housekeeping node of the capture (default = the sniffer's)");
+    optparse_add_string(parser, 'x', "speed", "MULT", &speed, "Replay at this multiple of the recorded rate (default = as fast as possible)");
+    optparse_add_set(parser, 'q', "quiet", 1, &source.mute, "Decode only, do not feed any sink");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (++argi >= slash->argc) {
+        printf("Missing capture filename\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    double multiple = 0;
+    if (speed) {
+        multiple = atof(speed);
+        if (multiple <= 0) {
+            printf("Speed must be a positive multiple\n");
+            optparse_del(parser);
+            return SLASH_EINVAL;
+        }
+    }
+
+    unsigned int csp_version;
+    FILE * file = csp_capture_open(slash->argv[argi], &csp_version);
+    if (file == NULL) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (csp_version != (unsigned int) csp_get_conf()->version) {
+        printf("Capture holds CSP version %u frames, csh is running version %u\n", csp_version, csp_get_conf()->version);
+        fclose(file);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    /* -n and -q only apply to the replayed packets, not to live traffic */
+    if (param_sniffer_init(0, 0) < 0) {
+        fclose(file);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    uint32_t samples = sniffer_stats[SNIFFER_STAT_SAMPLES];
+    uint64_t start = clock_get_nsec();
+    uint64_t first_ns = 0, pace_start = 0;
+    unsigned int packets = 0, invalid = 0;
+
+    csp_capture_record_t record;
+    uint8_t frame[CSP_CAPTURE_FRAME_MAX];
+    int res;
+    while ((res = csp_capture_next(file, &record, frame, sizeof(frame))) > 0) {
+
+        if (multiple > 0) {
+            sniffer_replay_pace(record.time_ns, multiple, &first_ns, &pace_start);
+        }
+
+        csp_packet_t * packet;
+        while ((packet = csp_buffer_get(record.length)) == NULL) {
+            /* Buffers are held by the decoder queues, wait for them to drain */
+            usleep(100);
+        }
+
+        int header_size = csp_id_setup_rx(packet);
+        if (record.length < (unsigned int) header_size || record.length - header_size > sizeof(packet->data)) {
+            csp_buffer_free(packet);
+            invalid++;
+            continue;
+        }
+        memcpy(packet->frame_begin, frame, record.length);
+        packet->frame_length = record.length;
+        if (csp_id_strip(packet) < 0) {
+            csp_buffer_free(packet);
+            invalid++;
+            continue;
+        }
+
+        /* Params without their own timestamp get the capture time, not the replay time */
+        packet->timestamp_rx = record.time_ns / 1000000000;
+
+        param_sniffer_dispatch(packet, &source);
+        packets++;
+    }
+
+    if (res < 0) {
+        printf("Corrupt record after %u packets, stopping\n", packets + invalid);
+    }
+    fclose(file);
+
+    param_sniffer_drain();
+
+    double elapsed = (clock_get_nsec() - start) / 1E9;
+    samples = sniffer_stats[SNIFFER_STAT_SAMPLES] - samples;
+    printf("Replayed %u packets (%u invalid), %u samples in %.3f s: %.0f packets/s, %.0f samples/s\n",
+        packets, invalid, samples, elapsed, packets / elapsed, samples / elapsed);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+}
+slash_command_sub(sniffer, replay, sniffer_replay_cmd, "<file>", "Replay a capture through the sniffer decoders");
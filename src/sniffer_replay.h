@@ -0,0 +1,18 @@
+/*
+ * sniffer_replay.h
+ *
+ * Recording of sniffed CSP traffic to a capture file (csp_capture.h), and
+ * replay of captures through the sniffer decode path.
+ */
+
+#ifndef SRC_SNIFFER_REPLAY_H_
+#define SRC_SNIFFER_REPLAY_H_
+
+#include <csp/csp.h>
+
+extern int sniffer_recording;
+
+/* Called by the sniffer reader for every packet while recording */
+void sniffer_record(csp_packet_t * packet);
+
+#endif /* SRC_SNIFFER_REPLAY_H_ */
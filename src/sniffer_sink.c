@@ -0,0 +1,331 @@
+/*
+ * sniffer_sink.c
+ *
+ * Sinks are never removed, so the decoders walk the sink array without
+ * locking: a new sink is fully set up before the count is raised.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <slash/slash.h>
+#include <slash/optparse.h>
+
+#include "sniffer_sink.h"
+#include "sniffer_stats.h"
+#include "ring.h"
+
+/* Worst case size of sniffer_sink_render() output per sink */
+#define SNIFFER_SINK_RENDER_MAX 3072
+
+uint64_t clock_get_nsec(void);
+
+typedef struct {
+    sniffer_sink_conf_t conf;
+    char name[32];
+    ring_t * ring;
+    pthread_t thread;
+    int policy;
+    int hist_id;                    // Built-in sink histogram in sniffer_stats.c, -1 = none
+
+    /* Counters */
+    uint32_t queued;
+    uint32_t samples;
+    uint32_t dropped;
+    uint32_t blocked;
+    uint32_t hist[SNIFFER_HIST_BUCKETS];
+    uint64_t busy_us;
+
+    /* Samples pushed, and samples handled or dropped from the queue, for sniffer_sink_drain() */
+    uint64_t pushed;
+    uint64_t done;
+} sniffer_sink_t;
+
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static sniffer_sink_t * sinks[SNIFFER_SINKS_MAX];
+static unsigned int sink_count;
+
+static const char * policy_names[] = {
+    [SNIFFER_SINK_BLOCK] = "block",
+    [SNIFFER_SINK_DROP_OLDEST] = "drop-oldest",
+    [SNIFFER_SINK_DROP_NEWEST] = "drop-newest",
+};
+
+static void * sniffer_sink_thread(void * arg) {
+
+    sniffer_sink_t * sink = arg;
+    param_sniffer_sample_t sample;
+
+    while (1) {
+        if (ring_pop_wait(sink->ring, &sample, 1000) < 0) {
+            continue;
+        }
+
+        uint64_t start = clock_get_nsec();
+        sink->conf.add(&sample, sink->conf.ctx);
+        uint64_t ns = clock_get_nsec() - start;
+
+        __atomic_fetch_add(&sink->samples, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink->hist[sniffer_hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink->busy_us, ns / 1000, __ATOMIC_RELAXED);
+        if (sink->hist_id >= 0) {
+            sniffer_hist_add(sink->hist_id, ns);
+        }
+        __atomic_fetch_add(&sink->done, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+
+}
+
+/* The sink histograms that were local params before the registry */
+static int sniffer_sink_hist(const char * name) {
+
+    static const struct {
+        const char * name;
+        sniffer_hist_e hist;
+    } builtin[] = {
+        {"archive", SNIFFER_HIST_ARCHIVE},
+        {"vm", SNIFFER_HIST_VM},
+        {"prometheus", SNIFFER_HIST_PROMETHEUS},
+        {"logfile", SNIFFER_HIST_LOGFILE},
+        {"vts", SNIFFER_HIST_VTS},
+    };
+
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++) {
+        if (strcmp(builtin[i].name, name) == 0) {
+            return builtin[i].hist;
+        }
+    }
+    return -1;
+
+}
+
+static sniffer_sink_t * sniffer_sink_find(const char * name) {
+
+    unsigned int count = __atomic_load_n(&sink_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < count; i++) {
+        if (strcmp(sinks[i]->name, name) == 0) {
+            return sinks[i];
+        }
+    }
+    return NULL;
+
+}
+
+int sniffer_sink_register(const sniffer_sink_conf_t * conf) {
+
+    if (conf->name == NULL || conf->add == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&sink_lock);
+
+    if (sniffer_sink_find(conf->name) || sink_count >= SNIFFER_SINKS_MAX) {
+        pthread_mutex_unlock(&sink_lock);
+        printf("Cannot register sniffer sink %s\n", conf->name);
+        return -1;
+    }
+
+    sniffer_sink_t * sink = calloc(1, sizeof(sniffer_sink_t));
+    if (sink == NULL) {
+        pthread_mutex_unlock(&sink_lock);
+        return -1;
+    }
+
+    sink->conf = *conf;
+    strncpy(sink->name, conf->name, sizeof(sink->name) - 1);
+    sink->conf.name = sink->name;
+    sink->policy = conf->policy;
+    sink->hist_id = sniffer_sink_hist(sink->name);
+
+    sink->ring = ring_create(sizeof(param_sniffer_sample_t), conf->queue_len ? conf->queue_len : SNIFFER_SINK_QUEUE);
+    if (sink->ring == NULL || pthread_create(&sink->thread, NULL, sniffer_sink_thread, sink) != 0) {
+        ring_destroy(sink->ring);
+        free(sink);
+        pthread_mutex_unlock(&sink_lock);
+        return -1;
+    }
+
+    sinks[sink_count] = sink;
+    __atomic_store_n(&sink_count, sink_count + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&sink_lock);
+    return 0;
+
+}
+
+int sniffer_sink_set_policy(const char * name, sniffer_sink_policy_e policy) {
+
+    sniffer_sink_t * sink = sniffer_sink_find(name);
+    if (sink == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&sink->policy, policy, __ATOMIC_RELAXED);
+    return 0;
+
+}
+
+void sniffer_sink_emit(const param_sniffer_sample_t * sample) {
+
+    unsigned int count = __atomic_load_n(&sink_count, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = 0; i < count; i++) {
+        sniffer_sink_t * sink = sinks[i];
+
+        if (sink->conf.accept && !sink->conf.accept(sample, sink->conf.ctx)) {
+            continue;
+        }
+
+        if (ring_push(sink->ring, sample) < 0) {
+            param_sniffer_sample_t oldest;
+            switch (__atomic_load_n(&sink->policy, __ATOMIC_RELAXED)) {
+                case SNIFFER_SINK_BLOCK:
+                    __atomic_fetch_add(&sink->blocked, 1, __ATOMIC_RELAXED);
+                    sniffer_stat_inc(SNIFFER_STAT_SAMPLE_FULL);
+                    do {
+                        usleep(100);
+                    } while (ring_push(sink->ring, sample) < 0);
+                    break;
+                case SNIFFER_SINK_DROP_OLDEST:
+                    do {
+                        if (ring_pop(sink->ring, &oldest) == 0) {
+                            __atomic_fetch_add(&sink->dropped, 1, __ATOMIC_RELAXED);
+                            __atomic_fetch_add(&sink->done, 1, __ATOMIC_RELEASE);
+                        }
+                    } while (ring_push(sink->ring, sample) < 0);
+                    break;
+                case SNIFFER_SINK_DROP_NEWEST:
+                default:
+                    __atomic_fetch_add(&sink->dropped, 1, __ATOMIC_RELAXED);
+                    continue;
+            }
+        }
+
+        __atomic_fetch_add(&sink->queued, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sink->pushed, 1, __ATOMIC_RELAXED);
+    }
+
+}
+
+void sniffer_sink_drain(void) {
+
+    unsigned int count = __atomic_load_n(&sink_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t pushed = __atomic_load_n(&sinks[i]->pushed, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&sinks[i]->done, __ATOMIC_ACQUIRE) < pushed) {
+            usleep(1000);
+        }
+    }
+
+}
+
+size_t sniffer_sink_render(char ** buf, size_t * size, size_t offset) {
+
+    unsigned int count = __atomic_load_n(&sink_count, __ATOMIC_ACQUIRE);
+
+    size_t needed = offset + 1024 + count * SNIFFER_SINK_RENDER_MAX;
+    if (needed > *size) {
+        char * grown = realloc(*buf, needed);
+        if (grown == NULL) {
+            return offset;
+        }
+        *buf = grown;
+        *size = needed;
+    }
+
+    char * out = *buf + offset;
+    char * end = *buf + *size;
+
+    static const struct {
+        const char * name;
+        const char * help;
+        size_t offset;
+    } counters[] = {
+        {"sniffer_sink_queued", "Samples queued to the sink", offsetof(sniffer_sink_t, queued)},
+        {"sniffer_sink_samples", "Samples processed by the sink", offsetof(sniffer_sink_t, samples)},
+        {"sniffer_sink_dropped", "Samples dropped on a full sink queue", offsetof(sniffer_sink_t, dropped)},
+        {"sniffer_sink_blocked", "Times a decoder waited on a full sink queue", offsetof(sniffer_sink_t, blocked)},
+    };
+
+    for (unsigned int c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        out += snprintf(out, end - out, "# HELP csh_%s %s\n# TYPE csh_%s counter\n", counters[c].name, counters[c].help, counters[c].name);
+        for (unsigned int i = 0; i < count; i++) {
+            uint32_t * value = (uint32_t *) ((char *) sinks[i] + counters[c].offset);
+            out += snprintf(out, end - out, "csh_%s{sink=\"%s\"} %u\n", counters[c].name, sinks[i]->name, __atomic_load_n(value, __ATOMIC_RELAXED));
+        }
+    }
+
+    out += snprintf(out, end - out, "# TYPE csh_sniffer_sink_seconds histogram\n");
+    for (unsigned int i = 0; i < count; i++) {
+        char labels[48];
+        snprintf(labels, sizeof(labels), "sink=\"%s\"", sinks[i]->name);
+        out = sniffer_hist_render(out, end, "sniffer_sink", labels, sinks[i]->hist, __atomic_load_n(&sinks[i]->busy_us, __ATOMIC_RELAXED));
+    }
+
+    return out - *buf;
+
+}
+
+static int sniffer_sink_list_cmd(struct slash * slash) {
+
+    unsigned int count = __atomic_load_n(&sink_count, __ATOMIC_ACQUIRE);
+
+    printf("  %-12s %-12s %14s %10s %10s %10s %10s %9s\n", "sink", "policy", "queue", "queued", "samples", "dropped", "blocked", "us/sample");
+    for (unsigned int i = 0; i < count; i++) {
+        sniffer_sink_t * sink = sinks[i];
+        uint32_t samples = __atomic_load_n(&sink->samples, __ATOMIC_RELAXED);
+        char queue[24];
+        snprintf(queue, sizeof(queue), "%u/%u", ring_count(sink->ring), ring_capacity(sink->ring));
+        printf("  %-12s %-12s %14s %10u %10u %10u %10u %9.1f\n", sink->name, policy_names[sink->policy], queue,
+            sink->queued, samples, sink->dropped, sink->blocked,
+            samples ? (double) sink->busy_us / samples : 0.0);
+    }
+
+    return SLASH_SUCCESS;
+
+}
+slash_command_subsub(sniffer, sink, list, sniffer_sink_list_cmd, "", "List sniffer sinks and their counters");
+
+static int sniffer_sink_policy_cmd(struct slash * slash) {
+
+    optparse_t * parser = optparse_new("sniffer sink policy", "<sink> <block|drop-oldest|drop-newest>");
+    optparse_add_help(parser);
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **) slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (argi + 2 >= slash->argc) {
+        printf("Missing sink name or policy\n");
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    const char * name = slash->argv[argi + 1];
+    const char * policy = slash->argv[argi + 2];
+
+    for (unsigned int p = 0; p < sizeof(policy_names) / sizeof(policy_names[0]); p++) {
+        if (strcmp(policy, policy_names[p]) == 0) {
+            if (sniffer_sink_set_policy(name, p) < 0) {
+                printf("No sink named %s\n", name);
+                optparse_del(parser);
+                return SLASH_EINVAL;
+            }
+            optparse_del(parser);
+            return SLASH_SUCCESS;
+        }
+    }
+
+    printf("Unknown policy %s\n", policy);
+    optparse_del(parser);
+    return SLASH_EINVAL;
+
+}
+slash_command_subsub(sniffer, sink, policy, sniffer_sink_policy_cmd, "<sink> <policy>", "Set overflow policy of a sniffer sink");
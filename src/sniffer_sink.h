@@ -0,0 +1,54 @@
+/*
+ * sniffer_sink.h
+ *
+ * Registry of sniffer sinks. Every sink gets its own bounded queue and
+ * thread, so a slow backend only fills its own queue. What happens when
+ * that queue is full is decided per sink by its overflow policy.
+ *
+ * Built-in sinks (archive, Victoria Metrics, remote write, Prometheus,
+ * logfile, aggregation and VTS) are registered by param_sniffer.c. APMs
+ * can register their own from libmain() with sniffer_sink_register().
+ */
+
+#ifndef SRC_SNIFFER_SINK_H_
+#define SRC_SNIFFER_SINK_H_
+
+#include <stddef.h>
+
+#include "param_sniffer.h"
+
+#define SNIFFER_SINKS_MAX       16
+#define SNIFFER_SINK_QUEUE      16384
+
+typedef enum {
+    SNIFFER_SINK_BLOCK,         // Wait for room, stalls the decoders
+    SNIFFER_SINK_DROP_OLDEST,   // Discard the oldest queued sample
+    SNIFFER_SINK_DROP_NEWEST,   // Discard the sample being queued
+} sniffer_sink_policy_e;
+
+typedef struct {
+    const char * name;
+    /* Called on the sink's own thread, one sample at a time */
+    void (*add)(const param_sniffer_sample_t * sample, void * ctx);
+    /* Optional, called on the decoder thread before queueing. Return 0 to skip the sample */
+    int (*accept)(const param_sniffer_sample_t * sample, void * ctx);
+    void * ctx;
+    unsigned int queue_len;             // 0 = SNIFFER_SINK_QUEUE
+    sniffer_sink_policy_e policy;
+} sniffer_sink_conf_t;
+
+/* Returns 0 on success, -1 if the name is taken, the registry is full or out of memory */
+int sniffer_sink_register(const sniffer_sink_conf_t * conf);
+
+int sniffer_sink_set_policy(const char * name, sniffer_sink_policy_e policy);
+
+/* Queues sample to every sink accepting it */
+void sniffer_sink_emit(const param_sniffer_sample_t * sample);
+
+/* Waits until every sample queued so far has been handled or dropped */
+void sniffer_sink_drain(void);
+
+/* Render per sink counters and histograms in Prometheus text format, see sniffer_stats_render() */
+size_t sniffer_sink_render(char ** buf, size_t * size, size_t offset);
+
+#endif /* SRC_SNIFFER_SINK_H_ */
@@ -0,0 +1,180 @@
+/*
+ * sniffer_stats.c
+ *
+ * Sniffer self-instrumentation, exported as local params and as
+ * Prometheus metrics.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <param/param.h>
+#include <param_config.h>
+
+#include "sniffer_stats.h"
+
+/* Worst case size of sniffer_stats_render() output */
+#define SNIFFER_STATS_RENDER_MAX (32 * 1024)
+
+uint32_t sniffer_stats[SNIFFER_STAT_COUNT];
+
+static uint32_t sniffer_hist[SNIFFER_HIST_COUNT][SNIFFER_HIST_BUCKETS];
+static uint64_t sniffer_hist_sum[SNIFFER_HIST_COUNT];
+
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_RX,          sniffer_rx,          PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_RX], "Packets read from the promiscuous queue");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_ACCEPTED,    sniffer_accepted,    PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_ACCEPTED], "Packets passed to a decoder");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_DROPPED,     sniffer_dropped,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_DROPPED], "Packets dropped because a decoder was behind");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_CRC_ERR,     sniffer_crc_err,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_CRC_ERR], "Packets failing CRC32 verification");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_UNKNOWN,     sniffer_unknown,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_UNKNOWN], "Params not found in the param list");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_MPACK_ERR,   sniffer_mpack_err,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_MPACK_ERR], "Packets with mpack decode errors");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_SAMPLES,     sniffer_samples,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_SAMPLES], "Samples decoded");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_SAMPLE_FULL, sniffer_sample_full, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_SAMPLE_FULL], "Times a decoder waited for a blocking sink");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_HK_PACKETS,  sniffer_hk_packets,  PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_HK_PACKETS], "Housekeeping packets decoded");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_HK_NO_EPOCH, sniffer_hk_no_epoch, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_HK_NO_EPOCH], "Housekeeping packets aborted for missing epoch or timestamp");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_PROM_SCRAPES, sniffer_prom_scrapes, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_PROM_SCRAPES], "Prometheus scrapes served");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_PROM_SERIES, sniffer_prom_series, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_PROM_SERIES], "Series in the last Prometheus scrape");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_PROM_FULL,   sniffer_prom_full,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_PROM_FULL], "Lines lost in prometheus_add, buffer full");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_PUSHES,   sniffer_vm_pushes,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_PUSHES], "Victoria Metrics pushes");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_PUSH_ERR, sniffer_vm_push_err, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_PUSH_ERR], "Failed Victoria Metrics pushes");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_FULL,     sniffer_vm_full,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_FULL], "Lines lost in Victoria Metrics buffer, buffer full");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_FILTERED,    sniffer_filtered,    PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_FILTERED], "Packets rejected by the sniffer filter");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_RW_PUSHES,   sniffer_rw_pushes,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_RW_PUSHES], "Remote write requests sent");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_RW_PUSH_ERR, sniffer_rw_push_err, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_RW_PUSH_ERR], "Remote write batches dropped after failed retries");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_RW_FULL,     sniffer_rw_full,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_RW_FULL], "Samples lost in remote write batch, batch full");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_SPOOLED,    sniffer_vm_spooled,    PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_SPOOLED], "Victoria Metrics batches written to the disk spool");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_REPLAYED,   sniffer_vm_replayed,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_REPLAYED], "Victoria Metrics batches replayed from the disk spool");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_SPOOL_DROP, sniffer_vm_spool_drop, PARAM_TYPE_UINT32, 0, 0, PM_DEBUG | PM_ERRCNT, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_SPOOL_DROP], "Victoria Metrics batches dropped from the spool, disk budget reached");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_SPOOL_KB,   sniffer_vm_spool_kb,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "kB", &sniffer_stats[SNIFFER_STAT_VM_SPOOL_KB], "Size of the Victoria Metrics disk spool");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_LINES,      sniffer_vm_lines,      PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_LINES], "Lines delivered to Victoria Metrics");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_INFLIGHT,   sniffer_vm_inflight,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "", &sniffer_stats[SNIFFER_STAT_VM_INFLIGHT], "Victoria Metrics pushes in flight");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_BATCH_KB,   sniffer_vm_batch_kb,   PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "kB", &sniffer_stats[SNIFFER_STAT_VM_BATCH_KB], "Victoria Metrics batch size, adapted to the server");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_RAW_KB,     sniffer_vm_raw_kb,     PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "kB", &sniffer_stats[SNIFFER_STAT_VM_RAW_KB], "Victoria Metrics batches before compression");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_VM_SENT_KB,    sniffer_vm_sent_kb,    PARAM_TYPE_UINT32, 0, 0, PM_DEBUG, NULL, "kB", &sniffer_stats[SNIFFER_STAT_VM_SENT_KB], "Victoria Metrics request bodies as sent");
+
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_DECODE,     sniffer_lat_decode,     PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_DECODE], "Param packet decode time, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_HK,         sniffer_lat_hk,         PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_HK], "Housekeeping packet decode time, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_ARCHIVE,    sniffer_lat_archive,    PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_ARCHIVE], "Archive sink time per sample, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_VM,         sniffer_lat_vm,         PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_VM], "Victoria Metrics sink time per sample, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_PROMETHEUS, sniffer_lat_prometheus, PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_PROMETHEUS], "Prometheus sink time per sample, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_LOGFILE,    sniffer_lat_logfile,    PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_LOGFILE], "Logfile sink time per sample, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_VTS,        sniffer_lat_vts,        PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_VTS], "VTS sink time per sample, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_SCRAPE,     sniffer_lat_scrape,     PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_SCRAPE], "Prometheus scrape time, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_VM_PUSH,    sniffer_lat_vm_push,    PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_VM_PUSH], "Victoria Metrics push time, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_RW_PUSH,    sniffer_lat_rw_push,    PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_RW_PUSH], "Remote write request time, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_VM_COMPRESS, sniffer_lat_vm_compress, PARAM_TYPE_UINT32, SNIFFER_HIST_BUCKETS, sizeof(uint32_t), PM_DEBUG, NULL, "", sniffer_hist[SNIFFER_HIST_VM_COMPRESS], "Victoria Metrics batch compression time, bucket i < 2^i us");
+PARAM_DEFINE_STATIC_RAM(PARAMID_SNIFFER_LAT_SUM,        sniffer_lat_sum,        PARAM_TYPE_UINT64, SNIFFER_HIST_COUNT, sizeof(uint64_t), PM_DEBUG, NULL, "us", sniffer_hist_sum, "Total time per histogram, in sniffer_lat_* order");
+
+static param_t * const stats_params[SNIFFER_STAT_COUNT] = {
+    [SNIFFER_STAT_RX] = &sniffer_rx,
+    [SNIFFER_STAT_ACCEPTED] = &sniffer_accepted,
+    [SNIFFER_STAT_DROPPED] = &sniffer_dropped,
+    [SNIFFER_STAT_CRC_ERR] = &sniffer_crc_err,
+    [SNIFFER_STAT_UNKNOWN] = &sniffer_unknown,
+    [SNIFFER_STAT_MPACK_ERR] = &sniffer_mpack_err,
+    [SNIFFER_STAT_SAMPLES] = &sniffer_samples,
+    [SNIFFER_STAT_SAMPLE_FULL] = &sniffer_sample_full,
+    [SNIFFER_STAT_HK_PACKETS] = &sniffer_hk_packets,
+    [SNIFFER_STAT_HK_NO_EPOCH] = &sniffer_hk_no_epoch,
+    [SNIFFER_STAT_PROM_SCRAPES] = &sniffer_prom_scrapes,
+    [SNIFFER_STAT_PROM_SERIES] = &sniffer_prom_series,
+    [SNIFFER_STAT_PROM_FULL] = &sniffer_prom_full,
+    [SNIFFER_STAT_VM_PUSHES] = &sniffer_vm_pushes,
+    [SNIFFER_STAT_VM_PUSH_ERR] = &sniffer_vm_push_err,
+    [SNIFFER_STAT_VM_FULL] = &sniffer_vm_full,
+    [SNIFFER_STAT_FILTERED] = &sniffer_filtered,
+    [SNIFFER_STAT_RW_PUSHES] = &sniffer_rw_pushes,
+    [SNIFFER_STAT_RW_PUSH_ERR] = &sniffer_rw_push_err,
+    [SNIFFER_STAT_RW_FULL] = &sniffer_rw_full,
+    [SNIFFER_STAT_VM_SPOOLED] = &sniffer_vm_spooled,
+    [SNIFFER_STAT_VM_REPLAYED] = &sniffer_vm_replayed,
+    [SNIFFER_STAT_VM_SPOOL_DROP] = &sniffer_vm_spool_drop,
+    [SNIFFER_STAT_VM_SPOOL_KB] = &sniffer_vm_spool_kb,
+    [SNIFFER_STAT_VM_LINES] = &sniffer_vm_lines,
+    [SNIFFER_STAT_VM_INFLIGHT] = &sniffer_vm_inflight,
+    [SNIFFER_STAT_VM_BATCH_KB] = &sniffer_vm_batch_kb,
+    [SNIFFER_STAT_VM_RAW_KB] = &sniffer_vm_raw_kb,
+    [SNIFFER_STAT_VM_SENT_KB] = &sniffer_vm_sent_kb,
+};
+
+static param_t * const hist_params[SNIFFER_HIST_COUNT] = {
+    [SNIFFER_HIST_DECODE] = &sniffer_lat_decode,
+    [SNIFFER_HIST_HK] = &sniffer_lat_hk,
+    [SNIFFER_HIST_ARCHIVE] = &sniffer_lat_archive,
+    [SNIFFER_HIST_VM] = &sniffer_lat_vm,
+    [SNIFFER_HIST_PROMETHEUS] = &sniffer_lat_prometheus,
+    [SNIFFER_HIST_LOGFILE] = &sniffer_lat_logfile,
+    [SNIFFER_HIST_VTS] = &sniffer_lat_vts,
+    [SNIFFER_HIST_SCRAPE] = &sniffer_lat_scrape,
+    [SNIFFER_HIST_VM_PUSH] = &sniffer_lat_vm_push,
+    [SNIFFER_HIST_RW_PUSH] = &sniffer_lat_rw_push,
+    [SNIFFER_HIST_VM_COMPRESS] = &sniffer_lat_vm_compress,
+};
+
+void sniffer_hist_add(sniffer_hist_e hist, uint64_t ns) {
+
+    __atomic_fetch_add(&sniffer_hist[hist][sniffer_hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sniffer_hist_sum[hist], ns / 1000, __ATOMIC_RELAXED);
+
+}
+
+char * sniffer_hist_render(char * out, char * end, const char * name, const char * labels, const uint32_t * buckets, uint64_t sum_us) {
+
+    const char * sep = labels ? "," : "";
+    labels = labels ? labels : "";
+
+    /* Prometheus buckets are cumulative */
+    uint64_t count = 0;
+    for (int b = 0; b < SNIFFER_HIST_BUCKETS; b++) {
+        count += __atomic_load_n(&buckets[b], __ATOMIC_RELAXED);
+        if (b < SNIFFER_HIST_BUCKETS - 1) {
+            out += snprintf(out, end - out, "csh_%s_seconds_bucket{%s%sle=\"%g\"} %"PRIu64"\n", name, labels, sep, (double) (1u << b) * 1e-6, count);
+        } else {
+            out += snprintf(out, end - out, "csh_%s_seconds_bucket{%s%sle=\"+Inf\"} %"PRIu64"\n", name, labels, sep, count);
+        }
+    }
+
+    if (*labels) {
+        out += snprintf(out, end - out, "csh_%s_seconds_sum{%s} %g\ncsh_%s_seconds_count{%s} %"PRIu64"\n", name, labels, sum_us * 1e-6, name, labels, count);
+    } else {
+        out += snprintf(out, end - out, "csh_%s_seconds_sum %g\ncsh_%s_seconds_count %"PRIu64"\n", name, sum_us * 1e-6, name, count);
+    }
+
+    return out;
+
+}
+
+size_t sniffer_stats_render(char ** buf, size_t * size, size_t offset) {
+
+    size_t needed = offset + SNIFFER_STATS_RENDER_MAX;
+    if (needed > *size) {
+        char * grown = realloc(*buf, needed);
+        if (grown == NULL) {
+            return offset;
+        }
+        *buf = grown;
+        *size = needed;
+    }
+
+    char * out = *buf + offset;
+    char * end = *buf + *size;
+
+    for (int i = 0; i < SNIFFER_STAT_COUNT; i++) {
+        param_t * param = stats_params[i];
+        const char * type = (i == SNIFFER_STAT_PROM_SERIES || i == SNIFFER_STAT_VM_SPOOL_KB ||
+                             i == SNIFFER_STAT_VM_INFLIGHT || i == SNIFFER_STAT_VM_BATCH_KB) ? "gauge" : "counter";
+        out += snprintf(out, end - out, "# HELP csh_%s %s\n# TYPE csh_%s %s\ncsh_%s %u\n",
+            param->name, param->docstr, param->name, type, param->name,
+            __atomic_load_n(&sniffer_stats[i], __ATOMIC_RELAXED));
+    }
+
+    for (int i = 0; i < SNIFFER_HIST_COUNT; i++) {
+        const char * name = hist_params[i]->name;
+        out += snprintf(out, end - out, "# TYPE csh_%s_seconds histogram\n", name);
+        out = sniffer_hist_render(out, end, name, NULL, sniffer_hist[i], __atomic_load_n(&sniffer_hist_sum[i], __ATOMIC_RELAXED));
+    }
+
+    return out - *buf;
+
+}
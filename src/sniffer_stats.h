@@ -0,0 +1,98 @@
+/*
+ * sniffer_stats.h
+ *
+ * Counters and latency histograms for the sniffer pipeline and its sinks.
+ * Every counter and histogram is a local param (see sniffer_stats.c), and
+ * sniffer_stats_render() adds them to the Prometheus scrape.
+ *
+ * Histogram bucket i counts durations below 2^i us; the last bucket is
+ * everything above. Per sink counters live in sniffer_sink.c, which also
+ * feeds the sink histograms here for the built-in sinks.
+ */
+
+#ifndef SRC_SNIFFER_STATS_H_
+#define SRC_SNIFFER_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNIFFER_HIST_BUCKETS 20
+
+typedef enum {
+    SNIFFER_STAT_RX,            // Packets read from the promiscuous queue
+    SNIFFER_STAT_ACCEPTED,      // Packets passed on to a decoder
+    SNIFFER_STAT_DROPPED,       // Packets dropped because a decoder was behind
+    SNIFFER_STAT_CRC_ERR,
+    SNIFFER_STAT_UNKNOWN,       // Params not found in the list
+    SNIFFER_STAT_MPACK_ERR,
+    SNIFFER_STAT_SAMPLES,       // Samples decoded
+    SNIFFER_STAT_SAMPLE_FULL,   // Times a decoder waited for a blocking sink
+    SNIFFER_STAT_HK_PACKETS,
+    SNIFFER_STAT_HK_NO_EPOCH,   // Housekeeping packets aborted for missing epoch/timestamp
+    SNIFFER_STAT_PROM_SCRAPES,
+    SNIFFER_STAT_PROM_SERIES,   // Gauge, series in the last scrape
+    SNIFFER_STAT_PROM_FULL,     // Lines lost in prometheus_add()
+    SNIFFER_STAT_VM_PUSHES,
+    SNIFFER_STAT_VM_PUSH_ERR,
+    SNIFFER_STAT_VM_FULL,       // Lines lost because the VM buffer was full
+    SNIFFER_STAT_FILTERED,      // Packets rejected on their header by the sniffer filter
+    SNIFFER_STAT_RW_PUSHES,     // Remote write requests sent
+    SNIFFER_STAT_RW_PUSH_ERR,   // Remote write batches given up on
+    SNIFFER_STAT_RW_FULL,       // Samples lost because the remote write batch was full
+    SNIFFER_STAT_VM_SPOOLED,    // VM batches written to the disk spool
+    SNIFFER_STAT_VM_REPLAYED,   // VM batches sent from the disk spool
+    SNIFFER_STAT_VM_SPOOL_DROP, // VM batches dropped from the spool for its disk budget
+    SNIFFER_STAT_VM_SPOOL_KB,   // Gauge, size of the VM spool on disk
+    SNIFFER_STAT_VM_LINES,      // Lines delivered to VM
+    SNIFFER_STAT_VM_INFLIGHT,   // Gauge, VM pushes in flight
+    SNIFFER_STAT_VM_BATCH_KB,   // Gauge, current VM batch size
+    SNIFFER_STAT_VM_RAW_KB,     // VM batches before compression
+    SNIFFER_STAT_VM_SENT_KB,    // VM request bodies as sent
+    SNIFFER_STAT_COUNT
+} sniffer_stat_e;
+
+typedef enum {
+    SNIFFER_HIST_DECODE,        // Per param server packet
+    SNIFFER_HIST_HK,            // Per housekeeping packet
+    SNIFFER_HIST_ARCHIVE,       // Per sample, for each built-in sink
+    SNIFFER_HIST_VM,
+    SNIFFER_HIST_PROMETHEUS,
+    SNIFFER_HIST_LOGFILE,
+    SNIFFER_HIST_VTS,
+    SNIFFER_HIST_SCRAPE,        // Per Prometheus scrape
+    SNIFFER_HIST_VM_PUSH,       // Per VM push
+    SNIFFER_HIST_RW_PUSH,       // Per remote write request, retries included
+    SNIFFER_HIST_VM_COMPRESS,   // Per VM batch compressed
+    SNIFFER_HIST_COUNT
+} sniffer_hist_e;
+
+extern uint32_t sniffer_stats[SNIFFER_STAT_COUNT];
+
+static inline void sniffer_stat_inc(sniffer_stat_e stat) {
+    __atomic_fetch_add(&sniffer_stats[stat], 1, __ATOMIC_RELAXED);
+}
+
+static inline void sniffer_stat_add(sniffer_stat_e stat, uint32_t value) {
+    __atomic_fetch_add(&sniffer_stats[stat], value, __ATOMIC_RELAXED);
+}
+
+static inline void sniffer_stat_set(sniffer_stat_e stat, uint32_t value) {
+    __atomic_store_n(&sniffer_stats[stat], value, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int sniffer_hist_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    return bucket < SNIFFER_HIST_BUCKETS ? bucket : SNIFFER_HIST_BUCKETS - 1;
+}
+
+/* Record a duration, in ns from clock_get_nsec() */
+void sniffer_hist_add(sniffer_hist_e hist, uint64_t ns);
+
+/* Render the bucket, sum and count lines of one histogram, labels may be NULL */
+char * sniffer_hist_render(char * out, char * end, const char * name, const char * labels, const uint32_t * buckets, uint64_t sum_us);
+
+/* Render all stats in Prometheus text format into *buf (grown with realloc as needed), returns length */
+size_t sniffer_stats_render(char ** buf, size_t * size, size_t offset);
+
+#endif /* SRC_SNIFFER_STATS_H_ */
@@ -0,0 +1,380 @@
+/*
+ * spool.c
+ *
+ * Segment files are named by a 16 digit hex sequence number, so sorting
+ * the names sorts them by age. Each batch is stored as:
+ *
+ *   spool_record_t, data
+ *
+ * The last segment is the one being appended to. The reader keeps an
+ * offset into the oldest segment; a record that is cut short or fails its
+ * CRC (a crash while writing) ends its segment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <csp/csp_crc32.h>
+
+#include "spool.h"
+
+#define SPOOL_MAGIC         0x4c4f5053  /* "SPOL" */
+#define SPOOL_BUDGET        (1024 * 1024 * 1024)
+#define SPOOL_SEGMENT_SIZE  (16 * 1024 * 1024)
+#define SPOOL_SUFFIX        ".spool"
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint32_t length;
+    uint32_t crc;           /* csp_crc32_memory() of the data */
+} spool_record_t;
+
+typedef struct {
+    uint64_t seq;
+    size_t size;
+    unsigned int records;
+} spool_segment_t;
+
+struct spool_s {
+    spool_conf_t conf;
+    char * dir;
+
+    pthread_mutex_t lock;
+    spool_segment_t * segments;     /* Oldest first */
+    unsigned int count;
+    unsigned int capacity;
+    size_t bytes;
+    unsigned int dropped;
+
+    int write_fd;                   /* Open on the last segment, -1 = start a new one */
+
+    int read_fd;                    /* Open on the first segment, -1 = not yet */
+    size_t read_offset;
+    size_t read_pending;            /* Size of the record last peeked, 0 = none */
+};
+
+static void spool_path(spool_t * spool, uint64_t seq, char * path, size_t size) {
+    snprintf(path, size, "%s/%016" PRIx64 SPOOL_SUFFIX, spool->dir, seq);
+}
+
+/* Length of the valid records at the start of fd, counting them */
+static size_t spool_scan(int fd, unsigned int * records) {
+
+    size_t offset = 0;
+    spool_record_t record;
+    *records = 0;
+
+    while (pread(fd, &record, sizeof(record), offset) == sizeof(record) && record.magic == SPOOL_MAGIC) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || offset + sizeof(record) + record.length > (size_t) st.st_size) {
+            break;
+        }
+        offset += sizeof(record) + record.length;
+        (*records)++;
+    }
+    return offset;
+
+}
+
+static int spool_segment_compare(const void * a, const void * b) {
+    const spool_segment_t * x = a, * y = b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int spool_push_segment(spool_t * spool, uint64_t seq, size_t size, unsigned int records) {
+
+    if (spool->count == spool->capacity) {
+        unsigned int capacity = spool->capacity ? spool->capacity * 2 : 64;
+        spool_segment_t * grown = realloc(spool->segments, capacity * sizeof(spool_segment_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        spool->segments = grown;
+        spool->capacity = capacity;
+    }
+
+    spool->segments[spool->count++] = (spool_segment_t) {.seq = seq, .size = size, .records = records};
+    spool->bytes += size;
+    return 0;
+
+}
+
+/* Deletes the oldest segment. Call with lock held */
+static void spool_remove_oldest(spool_t * spool) {
+
+    char path[512];
+    spool_path(spool, spool->segments[0].seq, path, sizeof(path));
+    unlink(path);
+
+    if (spool->read_fd >= 0) {
+        close(spool->read_fd);
+        spool->read_fd = -1;
+    }
+    spool->read_offset = 0;
+    spool->read_pending = 0;
+
+    if (spool->count == 1 && spool->write_fd >= 0) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+    }
+
+    spool->bytes -= spool->segments[0].size;
+    spool->count--;
+    memmove(&spool->segments[0], &spool->segments[1], spool->count * sizeof(spool_segment_t));
+
+}
+
+spool_t * spool_open(const spool_conf_t * conf) {
+
+    if (mkdir(conf->dir, 0755) < 0 && errno != EEXIST) {
+        printf("Cannot create spool %s: %s\n", conf->dir, strerror(errno));
+        return NULL;
+    }
+
+    DIR * dir = opendir(conf->dir);
+    if (dir == NULL) {
+        printf("Cannot open spool %s: %s\n", conf->dir, strerror(errno));
+        return NULL;
+    }
+
+    spool_t * spool = calloc(1, sizeof(spool_t));
+    if (spool == NULL) {
+        closedir(dir);
+        return NULL;
+    }
+    spool->conf = *conf;
+    spool->dir = strdup(conf->dir);
+    spool->conf.dir = spool->dir;
+    if (spool->conf.budget == 0)
+        spool->conf.budget = SPOOL_BUDGET;
+    if (spool->conf.segment_size == 0)
+        spool->conf.segment_size = SPOOL_SEGMENT_SIZE;
+    if (spool->conf.segment_size > spool->conf.budget / 4)
+        spool->conf.segment_size = spool->conf.budget / 4;
+    spool->write_fd = -1;
+    spool->read_fd = -1;
+    pthread_mutex_init(&spool->lock, NULL);
+
+    /* Segments left by an earlier run are replayed first. They are never
+     * appended to, their last record may be cut short */
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint64_t seq;
+        int end = 0;
+        if (sscanf(entry->d_name, "%16" SCNx64 SPOOL_SUFFIX "%n", &seq, &end) != 1 || entry->d_name[end] != '\0') {
+            continue;
+        }
+        char path[512];
+        spool_path(spool, seq, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        unsigned int records;
+        size_t size = spool_scan(fd, &records);
+        close(fd);
+        if (records == 0) {
+            unlink(path);
+        } else {
+            spool_push_segment(spool, seq, size, records);
+        }
+    }
+    closedir(dir);
+
+    if (spool->count) {
+        qsort(spool->segments, spool->count, sizeof(spool_segment_t), spool_segment_compare);
+        printf("Spool %s holds %zu bytes from an earlier run\n", spool->dir, spool->bytes);
+    }
+    return spool;
+
+}
+
+void spool_close(spool_t * spool) {
+
+    if (spool == NULL) {
+        return;
+    }
+    if (spool->write_fd >= 0)
+        close(spool->write_fd);
+    if (spool->read_fd >= 0)
+        close(spool->read_fd);
+    pthread_mutex_destroy(&spool->lock);
+    free(spool->segments);
+    free(spool->dir);
+    free(spool);
+
+}
+
+int spool_append(spool_t * spool, const void * data, size_t len) {
+
+    size_t total = sizeof(spool_record_t) + len;
+    if (total > spool->conf.budget) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&spool->lock);
+
+    /* Make room by dropping the oldest segments */
+    while (spool->count && spool->bytes + total > spool->conf.budget) {
+        spool->dropped += spool->segments[0].records;
+        spool_remove_oldest(spool);
+    }
+
+    spool_segment_t * last = spool->count ? &spool->segments[spool->count - 1] : NULL;
+    if (spool->write_fd >= 0 && last->size + total > spool->conf.segment_size) {
+        close(spool->write_fd);
+        spool->write_fd = -1;
+    }
+
+    if (spool->write_fd < 0) {
+        uint64_t seq = last ? last->seq + 1 : 1;
+        char path[512];
+        spool_path(spool, seq, path, sizeof(path));
+        spool->write_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (spool->write_fd < 0 || spool_push_segment(spool, seq, 0, 0) < 0) {
+            printf("Cannot create spool segment %s: %s\n", path, strerror(errno));
+            if (spool->write_fd >= 0) {
+                close(spool->write_fd);
+                spool->write_fd = -1;
+            }
+            pthread_mutex_unlock(&spool->lock);
+            return -1;
+        }
+        last = &spool->segments[spool->count - 1];
+    }
+
+    spool_record_t record = {
+        .magic = SPOOL_MAGIC,
+        .length = len,
+        .crc = csp_crc32_memory(data, len),
+    };
+    struct iovec iov[2] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = (void *) data, .iov_len = len},
+    };
+
+    ssize_t written = writev(spool->write_fd, iov, 2);
+    if (written != (ssize_t) total) {
+        /* Leave the partial record to end the segment, start a new one next time */
+        if (written > 0) {
+            last->size += written;
+            spool->bytes += written;
+        }
+        close(spool->write_fd);
+        spool->write_fd = -1;
+        pthread_mutex_unlock(&spool->lock);
+        return -1;
+    }
+
+    last->size += total;
+    last->records++;
+    spool->bytes += total;
+
+    pthread_mutex_unlock(&spool->lock);
+    return 0;
+
+}
+
+long spool_peek(spool_t * spool, char ** buf, size_t * size) {
+
+    pthread_mutex_lock(&spool->lock);
+
+    while (spool->count) {
+        spool_segment_t * first = &spool->segments[0];
+
+        if (spool->read_fd < 0) {
+            char path[512];
+            spool_path(spool, first->seq, path, sizeof(path));
+            spool->read_fd = open(path, O_RDONLY | O_CLOEXEC);
+            spool->read_offset = 0;
+            if (spool->read_fd < 0) {
+                printf("Cannot open spool segment %s: %s\n", path, strerror(errno));
+                spool_remove_oldest(spool);
+                continue;
+            }
+        }
+
+        spool_record_t record;
+        if (spool->read_offset + sizeof(record) <= first->size &&
+            pread(spool->read_fd, &record, sizeof(record), spool->read_offset) == sizeof(record) &&
+            record.magic == SPOOL_MAGIC &&
+            spool->read_offset + sizeof(record) + record.length <= first->size) {
+
+            if (record.length > *size) {
+                char * grown = realloc(*buf, record.length);
+                if (grown == NULL) {
+                    pthread_mutex_unlock(&spool->lock);
+                    return -1;
+                }
+                *buf = grown;
+                *size = record.length;
+            }
+
+            if (pread(spool->read_fd, *buf, record.length, spool->read_offset + sizeof(record)) == (ssize_t) record.length &&
+                csp_crc32_memory(*buf, record.length) == record.crc) {
+                spool->read_pending = sizeof(record) + record.length;
+                pthread_mutex_unlock(&spool->lock);
+                return record.length;
+            }
+        }
+
+        /* Caught up with the writer */
+        if (spool->count == 1 && spool->write_fd >= 0 && spool->read_offset >= first->size) {
+            break;
+        }
+
+        /* End of a segment, or a damaged record ending it */
+        spool_remove_oldest(spool);
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+    return 0;
+
+}
+
+void spool_pop(spool_t * spool) {
+
+    pthread_mutex_lock(&spool->lock);
+
+    if (spool->read_pending && spool->count) {
+        spool->read_offset += spool->read_pending;
+        spool->read_pending = 0;
+        spool->segments[0].records--;
+        if (spool->read_offset >= spool->segments[0].size) {
+            spool_remove_oldest(spool);
+        }
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+
+}
+
+size_t spool_bytes(spool_t * spool) {
+    pthread_mutex_lock(&spool->lock);
+    size_t bytes = spool->bytes;
+    pthread_mutex_unlock(&spool->lock);
+    return bytes;
+}
+
+unsigned int spool_batches(spool_t * spool) {
+    pthread_mutex_lock(&spool->lock);
+    unsigned int batches = 0;
+    for (unsigned int i = 0; i < spool->count; i++) {
+        batches += spool->segments[i].records;
+    }
+    pthread_mutex_unlock(&spool->lock);
+    return batches;
+}
+
+unsigned int spool_dropped(spool_t * spool) {
+    return __atomic_load_n(&spool->dropped, __ATOMIC_RELAXED);
+}
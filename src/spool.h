@@ -0,0 +1,49 @@
+/*
+ * spool.h
+ *
+ * Segmented on-disk FIFO of batches, for pushers that must ride out long
+ * outages of their server. Batches are appended to numbered segment files
+ * in a directory and read back oldest first. A segment is deleted once
+ * every batch in it has been read and popped.
+ *
+ * The spool is bounded by a disk budget: when a batch does not fit, whole
+ * segments are dropped from the oldest end. It survives restarts; a
+ * segment that was partly replayed before is replayed again from its
+ * start, which the time series databases we push to deduplicate.
+ *
+ * All functions are thread safe.
+ */
+
+#ifndef SRC_SPOOL_H_
+#define SRC_SPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const char * dir;           // Created if missing
+    size_t budget;              // Max bytes on disk, 0 = 1 GB
+    size_t segment_size;        // Start a new segment above this size, 0 = 16 MB
+} spool_conf_t;
+
+typedef struct spool_s spool_t;
+
+/* Opens the spool, picking up segments left by a previous run. NULL on error */
+spool_t * spool_open(const spool_conf_t * conf);
+void spool_close(spool_t * spool);
+
+/* Returns 0, or -1 if the batch could not be stored */
+int spool_append(spool_t * spool, const void * data, size_t len);
+
+/* Reads the oldest batch into *buf (grown with realloc as needed). Returns
+ * its length, 0 if the spool is empty or -1 on error. The same batch is
+ * returned until spool_pop() is called */
+long spool_peek(spool_t * spool, char ** buf, size_t * size);
+void spool_pop(spool_t * spool);
+
+/* Bytes on disk, batches waiting to be read, and batches dropped for the budget since opening */
+size_t spool_bytes(spool_t * spool);
+unsigned int spool_batches(spool_t * spool);
+unsigned int spool_dropped(spool_t * spool);
+
+#endif /* SRC_SPOOL_H_ */
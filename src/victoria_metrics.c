@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
 #include <string.h>
 #include <curl/curl.h>
 
@@ -20,6 +21,14 @@
 #include <param/param_queue.h>
 #include <param/param_string.h>
 #include "param_sniffer.h"
+#include "metric_format.h"
+#include "param_index.h"
+#include "sniffer_stats.h"
+#include "sniffer_aggregate.h"
+#include "spool.h"
+#include "compress.h"
+
+uint64_t clock_get_nsec(void);
 
 static pthread_t vm_push_thread;
 int vm_running = 0;
@@ -27,10 +36,77 @@ int vm_running = 0;
 #define SERVER_PORT      8428
 #define SERVER_PORT_AUTH 8427
 #define BUFFER_SIZE      10 * 1024 * 1024
+#define FLUSH_MS         1000
+#define FLUSH_SIZE       1024 * 1024
+
+/* Two buffers: the sink appends to the active one while the push thread
+ * sends the other. buffer_mutex is only held to append or to swap, never
+ * across a request, so a slow link does not stall the sink. */
+static char buffer_store[3][BUFFER_SIZE];
+static char * buffers[2] = {buffer_store[0], buffer_store[1]};
+static size_t buffer_len[2];
+static unsigned int buffer_active;
+static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_cond = PTHREAD_COND_INITIALIZER;
+
+/* A push is made when the active buffer holds flush_size bytes, or flush_ms after the last one */
+static unsigned int flush_ms = FLUSH_MS;
+static size_t flush_size = FLUSH_SIZE;
+
+/* Optional disk spool for batches that could not be sent or did not fit.
+ * While the server is down, sends are retried with exponential backoff */
+#define SPOOL_BUDGET_MB  1024
+#define BACKOFF_MIN_MS   1000
+#define BACKOFF_MAX_MS   60000
+static spool_t * vm_spool;
+static unsigned int backoff_ms;
+static uint64_t retry_at;
+
+/* Spare buffer, swapped in for a full active buffer that is then spooled
+ * outside buffer_mutex. NULL while that spool write is going on */
+static char * buffer_spill = buffer_store[2];
+
+/* Up to slot_count batches are in flight at once, each on its own easy
+ * handle driven by one multi handle. Unless fixed with -b, the batch size
+ * follows the server: it grows while pushes return well within
+ * RTT_TARGET_MS, and shrinks when they are slow or the server pushes back */
+#define SLOTS_DEFAULT    4
+#define SLOTS_MAX        16
+#define RTT_TARGET_MS    500
+#define BATCH_MIN        (64 * 1024)
+#define BATCH_MAX        (BUFFER_SIZE / 2)
+#define POLL_MS          100
+#define RATE_MS          5000
 
-char buffer[BUFFER_SIZE];
-size_t buffer_size = 0;
-pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct {
+    CURL * curl;
+    char * data;                // Copy of the batch, so the buffer can be swapped back in
+    size_t size;
+    size_t len;                 // 0 if no copy is kept, when the body is compressed and not to be spooled
+    char * body;                // Compressed batch
+    size_t body_size;
+    unsigned int lines;
+    uint64_t start;
+    int busy;
+    int replay;                 // Popped from the spool once delivered
+} vm_slot_t;
+
+static vm_slot_t slots[SLOTS_MAX];
+static unsigned int slot_count = SLOTS_DEFAULT;
+static unsigned int inflight;
+static int replay_inflight;
+static int batch_adaptive = 1;
+static CURLM * vm_multi;
+static unsigned int vm_rate;    // Lines per second delivered over the last RATE_MS
+
+/* Batches are compressed on the push thread, into the body of their slot.
+ * The totals tell the CPU time spent against the bandwidth saved */
+static compress_type_e vm_encoding = COMPRESS_GZIP;
+static int vm_level = 1;
+static compress_t * vm_compress;
+static uint64_t raw_bytes;
+static uint64_t sent_bytes;
+static uint64_t compress_ns;
 
 typedef struct {
     int use_ssl;
@@ -42,10 +118,258 @@ typedef struct {
     char * server_ip;
 } vm_args;
 
+static void vm_args_free(vm_args * args) {
+    free(args->username);
+    free(args->password);
+    free(args->server_ip);
+    free(args);
+}
+
 size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     return size * nmemb;
 }
 
+static void vm_spool_batch(const char * data, size_t len) {
+    if (spool_append(vm_spool, data, len) == 0) {
+        sniffer_stat_inc(SNIFFER_STAT_VM_SPOOLED);
+    } else {
+        sniffer_stat_inc(SNIFFER_STAT_VM_FULL);
+    }
+}
+
+/* Appends len bytes to the active buffer, waking the push thread once it is due */
+static void vm_append(const char * data, size_t len) {
+
+    char * spill = NULL;
+    size_t spill_len = 0;
+
+    pthread_mutex_lock(&buffer_mutex);
+    size_t * used = &buffer_len[buffer_active];
+    if (*used + len >= BUFFER_SIZE && vm_spool && *used > 0 && buffer_spill) {
+        /* The push thread is behind, keep the full buffer on disk */
+        spill = buffers[buffer_active];
+        spill_len = *used;
+        buffers[buffer_active] = buffer_spill;
+        buffer_spill = NULL;
+        *used = 0;
+    }
+    if (*used + len < BUFFER_SIZE) {
+        memcpy(buffers[buffer_active] + *used, data, len);
+        *used += len;
+        if (*used >= flush_size) {
+            pthread_cond_signal(&buffer_cond);
+            /* The push thread may be polling the pushes in flight instead */
+            if (vm_multi && *used - len < flush_size) {
+                curl_multi_wakeup(vm_multi);
+            }
+        }
+    } else {
+        sniffer_stat_inc(SNIFFER_STAT_VM_FULL);
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+
+    /* The spool stays open until the spare buffer is back */
+    if (spill) {
+        vm_spool_batch(spill, spill_len);
+        pthread_mutex_lock(&buffer_mutex);
+        buffer_spill = spill;
+        pthread_cond_signal(&buffer_cond);
+        pthread_mutex_unlock(&buffer_mutex);
+    }
+
+}
+
+static void vm_backoff(void) {
+    backoff_ms = backoff_ms ? backoff_ms * 2 : BACKOFF_MIN_MS;
+    if (backoff_ms > BACKOFF_MAX_MS)
+        backoff_ms = BACKOFF_MAX_MS;
+    retry_at = clock_get_nsec() + backoff_ms * 1000000ull;
+}
+
+static vm_slot_t * vm_slot_free(void) {
+    for (unsigned int i = 0; i < slot_count; i++) {
+        if (slots[i].curl && !slots[i].busy) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* Resizes the batch after a push, from its round trip time and response code */
+static void vm_adapt(long code, uint64_t rtt_ns) {
+
+    if (!batch_adaptive) {
+        return;
+    }
+
+    size_t size = flush_size;
+    if (code == 429 || code / 100 == 5) {
+        size /= 2;
+    } else if (rtt_ns > RTT_TARGET_MS * 1000000ull) {
+        size -= size / 4;
+    } else if (code / 100 == 2 && rtt_ns < RTT_TARGET_MS * 1000000ull / 2) {
+        size += size / 4;
+    }
+    if (size < BATCH_MIN)
+        size = BATCH_MIN;
+    if (size > BATCH_MAX)
+        size = BATCH_MAX;
+
+    pthread_mutex_lock(&buffer_mutex);
+    flush_size = size;
+    pthread_mutex_unlock(&buffer_mutex);
+    sniffer_stat_set(SNIFFER_STAT_VM_BATCH_KB, size / 1024);
+
+}
+
+/* Starts a push of data on a free slot, compressed or as a copy. Returns -1 if there is no slot or memory */
+static int vm_submit(const char * data, size_t len, int replay) {
+
+    vm_slot_t * slot = vm_slot_free();
+    if (slot == NULL) {
+        return -1;
+    }
+
+    const char * body = slot->data;
+    long body_len = len;
+    if (vm_compress) {
+        uint64_t start = clock_get_nsec();
+        body_len = compress_run(vm_compress, data, len, &slot->body, &slot->body_size);
+        uint64_t ns = clock_get_nsec() - start;
+        if (body_len < 0) {
+            return -1;
+        }
+        sniffer_hist_add(SNIFFER_HIST_VM_COMPRESS, ns);
+        compress_ns += ns;
+        body = slot->body;
+    }
+
+    /* Live batches that fail go to the spool uncompressed, like the ones spilled by vm_append() */
+    slot->len = 0;
+    if (vm_compress == NULL || (vm_spool && !replay)) {
+        if (len > slot->size) {
+            char * grown = realloc(slot->data, len);
+            if (grown == NULL) {
+                return -1;
+            }
+            slot->data = grown;
+            slot->size = len;
+        }
+        memcpy(slot->data, data, len);
+        slot->len = len;
+        if (vm_compress == NULL) {
+            body = slot->data;
+        }
+    }
+
+    slot->lines = 0;
+    for (const char * p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++) {
+        slot->lines++;
+    }
+    raw_bytes += len;
+    sent_bytes += body_len;
+    sniffer_stat_set(SNIFFER_STAT_VM_RAW_KB, raw_bytes / 1024);
+    sniffer_stat_set(SNIFFER_STAT_VM_SENT_KB, sent_bytes / 1024);
+
+    curl_easy_setopt(slot->curl, CURLOPT_POSTFIELDSIZE, body_len);
+    curl_easy_setopt(slot->curl, CURLOPT_POSTFIELDS, body);
+    slot->start = clock_get_nsec();
+    if (curl_multi_add_handle(vm_multi, slot->curl) != CURLM_OK) {
+        return -1;
+    }
+    slot->busy = 1;
+    slot->replay = replay;
+    replay_inflight |= replay;
+    inflight++;
+    return 0;
+
+}
+
+static void vm_complete(vm_slot_t * slot, CURLcode res) {
+
+    uint64_t rtt = clock_get_nsec() - slot->start;
+    sniffer_hist_add(SNIFFER_HIST_VM_PUSH, rtt);
+    sniffer_stat_inc(SNIFFER_STAT_VM_PUSHES);
+
+    long code = 0;
+    curl_easy_getinfo(slot->curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_multi_remove_handle(vm_multi, slot->curl);
+    slot->busy = 0;
+    inflight--;
+    if (slot->replay) {
+        replay_inflight = 0;
+    }
+
+    if (res != CURLE_OK) {
+        printf("Failed push: %s\n", curl_easy_strerror(res));
+    } else {
+        if (code / 100 != 2) {
+            printf("Failed push with response code: %ld\n", code);
+        }
+        vm_adapt(code, rtt);
+    }
+
+    int delivered = res == CURLE_OK && code / 100 == 2;
+    /* A batch the server refuses would block the spool forever */
+    int refused = res == CURLE_OK && code / 100 == 4 && code != 429;
+
+    if (delivered) {
+        sniffer_stat_add(SNIFFER_STAT_VM_LINES, slot->lines);
+        backoff_ms = 0;
+    } else {
+        sniffer_stat_inc(SNIFFER_STAT_VM_PUSH_ERR);
+    }
+
+    if (delivered || refused) {
+        if (slot->replay) {
+            spool_pop(vm_spool);
+            if (delivered)
+                sniffer_stat_inc(SNIFFER_STAT_VM_REPLAYED);
+        }
+        return;
+    }
+
+    /* A replayed batch is still at the head of the spool. Slots failing
+     * together only count as one step of backoff */
+    if (vm_spool) {
+        if (slot->len)
+            vm_spool_batch(slot->data, slot->len);
+        if (clock_get_nsec() >= retry_at)
+            vm_backoff();
+    }
+
+}
+
+/* Drives the pushes in flight for up to timeout_ms, completing those that are done */
+static void vm_poll(int timeout_ms) {
+
+    int running = 0;
+    curl_multi_perform(vm_multi, &running);
+    if (running) {
+        curl_multi_poll(vm_multi, NULL, 0, timeout_ms, NULL);
+        curl_multi_perform(vm_multi, &running);
+    }
+
+    CURLMsg * msg;
+    int queued;
+    while ((msg = curl_multi_info_read(vm_multi, &queued)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        vm_slot_t * slot = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &slot);
+        vm_complete(slot, msg->data.result);
+    }
+    sniffer_stat_set(SNIFFER_STAT_VM_INFLIGHT, inflight);
+
+}
+
+/* Spooled batches are replayed one at a time, to keep their order */
+static int vm_replay_ready(void) {
+    return vm_spool && vm_running && !replay_inflight && clock_get_nsec() >= retry_at &&
+           vm_slot_free() && spool_batches(vm_spool) > 0;
+}
+
 void * vm_push(void * arg) {
 
     vm_args * args = arg;
@@ -87,22 +411,39 @@ void * vm_push(void * arg) {
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "query=test42");
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 12);
         res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            printf("Failed test of connection: %s\n", curl_easy_strerror(res));
-            vm_running = 0;
-        }
-        long response_code;
+        long response_code = 0;
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-        if (response_code != 200 && res == CURLE_OK) {
-            printf("Failed test with response code: %ld\n", response_code);
-            vm_running = 0;
+        if (res != CURLE_OK || response_code != 200) {
+            if (res != CURLE_OK) {
+                printf("Failed test of connection: %s\n", curl_easy_strerror(res));
+            } else {
+                printf("Failed test with response code: %ld\n", response_code);
+            }
+            /* With a spool, data is kept until the server shows up */
+            if (vm_spool) {
+                printf("Spooling to disk until the server is reachable\n");
+                vm_backoff();
+            } else {
+                vm_running = 0;
+            }
         }
 
         // Resume building of header for push
         snprintf(url, sizeof(url), "%s://%s:%d/api/v1/import/prometheus?extra_label=instance=%s", protocol, args->server_ip, args->port, hostname);
         curl_easy_setopt(curl, CURLOPT_URL, url);
         headers = curl_slist_append(headers, "Content-Type: text/plain");
+        vm_compress = compress_create(vm_encoding, vm_level);
+        if (vm_compress) {
+            char encoding[64];
+            snprintf(encoding, sizeof(encoding), "Content-Encoding: %s", compress_name(vm_encoding));
+            headers = curl_slist_append(headers, encoding);
+        } else if (vm_encoding != COMPRESS_NONE) {
+            printf("Cannot compress with %s, pushing uncompressed\n", compress_name(vm_encoding));
+        }
+        /* Do not wait for 100-continue before every batch */
+        headers = curl_slist_append(headers, "Expect:");
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
 
         if (args->verbose) {
             printf("Full URL: %s\n", url);
@@ -113,35 +454,156 @@ void * vm_push(void * arg) {
         printf("curl_easy_init() failed\n");
     }
 
-    if (vm_running) {
+    /* Every slot pushes on its own copy of the configured handle */
+    if (curl) {
+        CURLM * multi = curl_multi_init();
+        pthread_mutex_lock(&buffer_mutex);
+        vm_multi = multi;
+        pthread_mutex_unlock(&buffer_mutex);
+        for (unsigned int i = 0; vm_multi && i < slot_count; i++) {
+            slots[i].curl = curl_easy_duphandle(curl);
+            if (slots[i].curl) {
+                curl_easy_setopt(slots[i].curl, CURLOPT_PRIVATE, &slots[i]);
+            }
+        }
+        if (vm_multi == NULL || vm_slot_free() == NULL) {
+            printf("curl_multi_init() failed\n");
+            vm_running = 0;
+        }
+    }
+    sniffer_stat_set(SNIFFER_STAT_VM_BATCH_KB, flush_size / 1024);
+
+    if (vm_running && backoff_ms == 0) {
         printf("Connection established to %s://%s:%d\n", protocol, args->server_ip, args->port);
     }
 
-    while (vm_running) {
-        // Lock the buffer mutex
+    /* Each completed aggregation window is pushed once */
+    uint64_t aggregated = sniffer_aggregate_completed();
+    char * aggregate_buf = NULL;
+    size_t aggregate_size = 0;
+
+    char * replay_buf = NULL;
+    size_t replay_size = 0;
+
+    uint64_t flushed = clock_get_nsec();
+    uint64_t rate_at = flushed;
+    uint32_t rate_lines = sniffer_stats[SNIFFER_STAT_VM_LINES];
+
+    int stopping = 0;
+    int pending = 0;
+    while (!stopping || inflight || pending) {
+        uint64_t completed = sniffer_aggregate_completed();
+        if (completed > aggregated) {
+            size_t len = sniffer_aggregate_render(&aggregate_buf, &aggregate_size, 0, aggregated);
+            aggregated = completed;
+            vm_append(aggregate_buf, len);
+        }
+
+        /* Wait for enough data, the deadline, a replay or a stop, driving
+         * the pushes in flight meanwhile */
+        uint64_t due = flushed + flush_ms * 1000000ull;
         pthread_mutex_lock(&buffer_mutex);
-        if (buffer_size == 0) {
-            pthread_mutex_unlock(&buffer_mutex);
-            sleep(1);
-            continue;
+        while (vm_running && buffer_len[buffer_active] < flush_size && !vm_replay_ready()) {
+            uint64_t now = clock_get_nsec();
+            if (now >= due) {
+                break;
+            }
+            if (inflight) {
+                pthread_mutex_unlock(&buffer_mutex);
+                vm_poll((due - now) / 1000000 + 1);
+                pthread_mutex_lock(&buffer_mutex);
+                continue;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (due - now) / 1000000000;
+            deadline.tv_nsec += (due - now) % 1000000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if (pthread_cond_timedwait(&buffer_cond, &buffer_mutex, &deadline) != 0) {
+                break;
+            }
+        }
+        stopping = !vm_running;
+        uint64_t now = clock_get_nsec();
+        unsigned int frozen = buffer_active;
+        size_t len = buffer_len[frozen];
+        int is_due = len >= flush_size || now >= due || stopping;
+        int backing_off = vm_spool && now < retry_at;
+        /* With every slot busy the active buffer keeps filling, in the end spilling to the spool */
+        int swap = len && is_due && (curl == NULL || backing_off || vm_slot_free());
+        if (swap) {
+            buffer_active ^= 1;
+        }
+        pthread_mutex_unlock(&buffer_mutex);
+        pending = len && !swap;
+
+        if (swap) {
+            if (curl && backing_off) {
+                vm_spool_batch(buffers[frozen], len);
+            } else if (curl && vm_submit(buffers[frozen], len, 0) < 0) {
+                if (vm_spool) {
+                    vm_spool_batch(buffers[frozen], len);
+                } else {
+                    sniffer_stat_inc(SNIFFER_STAT_VM_FULL);
+                }
+            }
+            /* Not the active buffer, so nobody appends to it meanwhile */
+            buffer_len[frozen] = 0;
+            flushed = now;
+        } else if (len == 0 && is_due) {
+            flushed = now;
         }
 
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, buffer_size);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buffer);
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            printf("Failed push: %s", curl_easy_strerror(res));
+        /* Catch up on the spool while the server is up */
+        if (vm_replay_ready()) {
+            long replay_len = spool_peek(vm_spool, &replay_buf, &replay_size);
+            if (replay_len > 0) {
+                vm_submit(replay_buf, replay_len, 1);
+            }
         }
 
-        buffer_size = 0;
-        // Unlock the buffer mutex
-        pthread_mutex_unlock(&buffer_mutex);
+        if (vm_multi) {
+            /* Block only when waiting on a slot, or for the last pushes to finish */
+            vm_poll((pending || stopping) ? POLL_MS : 0);
+        }
 
-        sleep(1);
+        if (now - rate_at >= RATE_MS * 1000000ull) {
+            uint32_t lines = sniffer_stats[SNIFFER_STAT_VM_LINES];
+            vm_rate = (uint64_t) (lines - rate_lines) * 1000000000ull / (now - rate_at);
+            rate_lines = lines;
+            rate_at = now;
+        }
+        if (vm_spool) {
+            sniffer_stat_set(SNIFFER_STAT_VM_SPOOL_KB, spool_bytes(vm_spool) / 1024);
+            sniffer_stat_set(SNIFFER_STAT_VM_SPOOL_DROP, spool_dropped(vm_spool));
+        }
     }
 
     printf("vm push stopped\n");
     // Clean up
+    for (unsigned int i = 0; i < SLOTS_MAX; i++) {
+        if (slots[i].curl) {
+            curl_easy_cleanup(slots[i].curl);
+        }
+        free(slots[i].data);
+        free(slots[i].body);
+        slots[i] = (vm_slot_t) {0};
+    }
+    inflight = 0;
+    replay_inflight = 0;
+    vm_rate = 0;
+    sniffer_stat_set(SNIFFER_STAT_VM_INFLIGHT, 0);
+    pthread_mutex_lock(&buffer_mutex);
+    if (vm_multi) {
+        curl_multi_cleanup(vm_multi);
+        vm_multi = NULL;
+    }
+    compress_destroy(vm_compress);
+    vm_compress = NULL;
+    pthread_mutex_unlock(&buffer_mutex);
     if (curl) {
         curl_easy_cleanup(curl);
     }
@@ -149,37 +611,62 @@ void * vm_push(void * arg) {
         curl_slist_free_all(headers);
     }
     curl_global_cleanup();
-    if (args->username) {
-        free(args->username);
-        args->username = NULL;
-    }
-    if (args->password) {
-        free(args->password);
-        args->password = NULL;
-    }
-    if (args->server_ip) {
-        free(args->server_ip);
-        args->server_ip = NULL;
+    free(aggregate_buf);
+    free(replay_buf);
+    pthread_mutex_lock(&buffer_mutex);
+    while (buffer_spill == NULL) {
+        pthread_cond_wait(&buffer_cond, &buffer_mutex);
     }
-    free(args);
+    spool_close(vm_spool);
+    vm_spool = NULL;
+    pthread_mutex_unlock(&buffer_mutex);
+    vm_args_free(args);
     return NULL;
 }
 
 void vm_add(char * metric_line) {
+    vm_append(metric_line, strlen(metric_line));
+}
 
-    // Lock the buffer mutex
-    pthread_mutex_lock(&buffer_mutex);
-
-    // Check if there's enough space in the buffer
-    size_t line_len = strlen(metric_line);
-    if (buffer_size + line_len < BUFFER_SIZE) {
-        // Add the new metric line to the buffer
-        strcpy(buffer + buffer_size, metric_line);
-        buffer_size += line_len;
+void vm_add_sample(const param_sniffer_sample_t * sample) {
+    char line[METRIC_LINE_MAX];
+    size_t len = metric_format_sample(line, sizeof(line), sample);
+    if (len == 0) {
+        sniffer_stat_inc(SNIFFER_STAT_VM_FULL);
+        return;
     }
+    vm_append(line, len);
+}
 
-    // Unlock the buffer mutex
-    pthread_mutex_unlock(&buffer_mutex);
+static int vm_param_value(param_t * param, unsigned int i, param_sniffer_value_t * value) {
+    switch (param->type) {
+        case PARAM_TYPE_UINT8:
+        case PARAM_TYPE_XINT8:
+            value->u = param_get_uint8_array(param, i); return 0;
+        case PARAM_TYPE_UINT16:
+        case PARAM_TYPE_XINT16:
+            value->u = param_get_uint16_array(param, i); return 0;
+        case PARAM_TYPE_UINT32:
+        case PARAM_TYPE_XINT32:
+            value->u = param_get_uint32_array(param, i); return 0;
+        case PARAM_TYPE_UINT64:
+        case PARAM_TYPE_XINT64:
+            value->u = param_get_uint64_array(param, i); return 0;
+        case PARAM_TYPE_INT8:
+            value->i = param_get_int8_array(param, i); return 0;
+        case PARAM_TYPE_INT16:
+            value->i = param_get_int16_array(param, i); return 0;
+        case PARAM_TYPE_INT32:
+            value->i = param_get_int32_array(param, i); return 0;
+        case PARAM_TYPE_INT64:
+            value->i = param_get_int64_array(param, i); return 0;
+        case PARAM_TYPE_FLOAT:
+            value->d = param_get_float_array(param, i); return 0;
+        case PARAM_TYPE_DOUBLE:
+            value->d = param_get_double_array(param, i); return 0;
+        default:
+            return -1;
+    }
 }
 
 void vm_add_param(param_t * param) {
@@ -187,20 +674,31 @@ void vm_add_param(param_t * param) {
     if(param->type == PARAM_TYPE_STRING || param->type == PARAM_TYPE_DATA){
         return;
     }
-    static char outstr[1000] = {};
-    static char valstr[100] = {};
     int arr_cnt = param->array_size;
     if (arr_cnt < 0)
         arr_cnt = 1;
 
+    /* metric_format caches the labels by param, keep that cache off the list entry */
+    param_t * pinned = param_index_pin(param);
+    if (pinned == NULL)
+        return;
+
     struct timeval tv;
 	gettimeofday(&tv, NULL);
 	uint64_t time_ms = ((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec) / 1000;
 
     for (int j = 0; j < arr_cnt; j++) {
-        param_value_str(param, j, valstr, 100);
-        snprintf(outstr, 1000, "%s{node=\"%u\", idx=\"%u\"} %s %"PRIu64"\n", param->name, param->node, j, valstr, time_ms);
-        vm_add(outstr);
+        param_sniffer_value_t value;
+        if (vm_param_value(param, j, &value) < 0) {
+            break;
+        }
+        char line[METRIC_LINE_MAX];
+        size_t len = metric_format_value(line, sizeof(line), pinned, j, value, time_ms);
+        if (len == 0) {
+            sniffer_stat_inc(SNIFFER_STAT_VM_FULL);
+            continue;
+        }
+        vm_append(line, len);
     }
 }
 
@@ -213,6 +711,9 @@ static int vm_start_cmd(struct slash * slash) {
     char * tmp_username = NULL;
     char * tmp_password = NULL;
     vm_args * args = calloc(1, sizeof(vm_args));
+    if (args == NULL) {
+        return SLASH_ENOMEM;
+    }
 
     optparse_t * parser = optparse_new("vm start", "<server>");
     optparse_add_help(parser);
@@ -224,17 +725,30 @@ static int vm_start_cmd(struct slash * slash) {
     optparse_add_set(parser, 'l', "logfile", 1, &logfile, "Enable logging to param_sniffer.log");
     optparse_add_set(parser, 'S', "skip-verify", 1, &(args->skip_verify), "Skip verification of the server's cert and hostname");
     optparse_add_set(parser, 'v', "verbose", 1, &(args->verbose), "Verbose connect");
+    optparse_add_unsigned(parser, 'f', "flush", "MS", 0, &flush_ms, "Push at least every MS milliseconds (default = 1000)");
+    unsigned int flush_kb = 0;
+    optparse_add_unsigned(parser, 'b', "batch", "KB", 0, &flush_kb, "Push as soon as KB kilobytes are queued (default = adapt to the server)");
+    char * encoding = NULL;
+    optparse_add_string(parser, 'z', "compress", "gzip|zstd|none", &encoding, "Request body encoding (default = gzip if built with zlib, else none)");
+    optparse_add_int(parser, 'L', "level", "NUM", 0, &vm_level, "Compression level, 0 = library default (default = 1)");
+    optparse_add_unsigned(parser, 'c', "concurrency", "NUM", 0, &slot_count, "Pushes in flight at once (default = 4, max = 16)");
+    char * spool_dir = NULL;
+    unsigned int spool_mb = SPOOL_BUDGET_MB;
+    optparse_add_string(parser, 'D', "spool", "DIR", &spool_dir, "Keep batches in DIR while the server is unreachable");
+    optparse_add_unsigned(parser, 'B', "spool-budget", "MB", 0, &spool_mb, "Disk space for the spool (default = 1024)");
 
     int argi = optparse_parse(parser, slash->argc - 1, (const char **)slash->argv + 1);
 
     if (argi < 0) {
         optparse_del(parser);
+        vm_args_free(args);
         return SLASH_EINVAL;
     }
 
     if (++argi >= slash->argc) {
         printf("Missing server ip/domain\n");
         optparse_del(parser);
+        vm_args_free(args);
         return SLASH_EINVAL;
     }
 
@@ -242,6 +756,7 @@ static int vm_start_cmd(struct slash * slash) {
         if (!tmp_password) {
             printf("Provide password with -p\n");
             optparse_del(parser);
+            vm_args_free(args);
             return SLASH_EINVAL;
         }
         args->username = strdup(tmp_username);
@@ -254,10 +769,64 @@ static int vm_start_cmd(struct slash * slash) {
     }
     args->server_ip = strdup(slash->argv[argi]);
 
+    if (encoding == NULL || strcmp(encoding, "gzip") == 0) {
+        vm_encoding = COMPRESS_GZIP;
+    } else if (strcmp(encoding, "zstd") == 0) {
+        vm_encoding = COMPRESS_ZSTD;
+    } else if (strcmp(encoding, "none") == 0) {
+        vm_encoding = COMPRESS_NONE;
+    } else {
+        printf("Unknown encoding %s\n", encoding);
+        optparse_del(parser);
+        vm_args_free(args);
+        return SLASH_EINVAL;
+    }
+    if (!compress_available(vm_encoding)) {
+        if (encoding == NULL) {
+            /* Only an explicit -z is an error, the default follows the build */
+            vm_encoding = COMPRESS_NONE;
+        } else {
+            printf("This build has no %s support\n", compress_name(vm_encoding));
+            optparse_del(parser);
+            vm_args_free(args);
+            return SLASH_EINVAL;
+        }
+    }
+
+    if (flush_ms == 0) {
+        flush_ms = FLUSH_MS;
+    }
+    flush_size = flush_kb ? (size_t) flush_kb * 1024 : FLUSH_SIZE;
+    batch_adaptive = flush_kb == 0;
+    if (slot_count == 0) {
+        slot_count = SLOTS_DEFAULT;
+    }
+    if (slot_count > SLOTS_MAX) {
+        slot_count = SLOTS_MAX;
+    }
+
+    if (spool_dir) {
+        spool_conf_t conf = {
+            .dir = spool_dir,
+            .budget = (size_t) (spool_mb ? spool_mb : SPOOL_BUDGET_MB) * 1024 * 1024,
+        };
+        vm_spool = spool_open(&conf);
+        if (vm_spool == NULL) {
+            optparse_del(parser);
+            vm_args_free(args);
+            return SLASH_EINVAL;
+        }
+    }
+    backoff_ms = 0;
+    retry_at = 0;
+    if (flush_size > BUFFER_SIZE / 2) {
+        flush_size = BUFFER_SIZE / 2;
+    }
+
     // if param_sniffer_init has already been called you can not change/set hk_node or logfile args
     param_sniffer_init(logfile, hk_node);
-    pthread_create(&vm_push_thread, NULL, &vm_push, args);
     vm_running = 1;
+    pthread_create(&vm_push_thread, NULL, &vm_push, args);
     optparse_del(parser);
 
     return SLASH_SUCCESS;
@@ -268,8 +837,44 @@ static int vm_stop_cmd(struct slash * slash) {
 
     if (!vm_running) return SLASH_SUCCESS;
 
+    /* The push thread sends what is queued before it exits */
+    pthread_mutex_lock(&buffer_mutex);
     vm_running = 0;
+    pthread_cond_signal(&buffer_cond);
+    if (vm_multi) {
+        curl_multi_wakeup(vm_multi);
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+    pthread_join(vm_push_thread, NULL);
 
     return SLASH_SUCCESS;
 }
 slash_command_sub(vm, stop, vm_stop_cmd, "", "Stop Victoria Metrics push thread");
+
+static int vm_status_cmd(struct slash * slash) {
+
+    if (!vm_running) {
+        printf("Victoria Metrics push is not running\n");
+        return SLASH_SUCCESS;
+    }
+
+    pthread_mutex_lock(&buffer_mutex);
+    printf("Lines/s:     %u\n", vm_rate);
+    printf("In flight:   %u of %u\n", inflight, slot_count);
+    printf("Queued:      %zu kB\n", buffer_len[buffer_active] / 1024);
+    printf("Batch:       %zu kB%s\n", flush_size / 1024, batch_adaptive ? " (adaptive)" : "");
+    if (vm_compress && sent_bytes) {
+        printf("Encoding:    %s, %.1fx smaller, %.1f ms CPU per MB\n", compress_name(vm_encoding),
+               (double) raw_bytes / sent_bytes, compress_ns / 1e6 / (raw_bytes / 1048576.0));
+    }
+    if (vm_spool) {
+        printf("Spool:       %zu kB, %u batches\n", spool_bytes(vm_spool) / 1024, spool_batches(vm_spool));
+    }
+    if (backoff_ms) {
+        printf("Backoff:     %u ms\n", backoff_ms);
+    }
+    pthread_mutex_unlock(&buffer_mutex);
+
+    return SLASH_SUCCESS;
+}
+slash_command_sub(vm, status, vm_status_cmd, "", "Show Victoria Metrics push rate and queue depth");
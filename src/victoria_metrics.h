@@ -8,5 +8,8 @@
 
 #include <param/param.h>
 
+#include "param_sniffer.h"
+
 void vm_add(char * metric_line);
+void vm_add_sample(const param_sniffer_sample_t * sample);
 void vm_add_param(param_t * param);
@@ -1,7 +1,36 @@
+/*
+ * vts.c
+ *
+ * Streams params to a VTS viewer as DATA frames, driven by a mapping
+ * table. The sink thread only stores the newest values of each mapped
+ * entity and marks it dirty. A writer thread formats every dirty entity
+ * into one batch and sends it on a non-blocking socket, so a stalled
+ * viewer never holds up the sniffer: while the writer waits for the
+ * socket, further samples overwrite the pending values.
+ *
+ * Mapping files have one entity per line, '#' starts a comment:
+ *
+ *   # node  param           entity          elements  scale
+ *   6       305             orbit_sim_quat  3,0,1,2   1
+ *   6       orbit_pos       orbit_prop_pos  0,1,2     0.001
+ *
+ * param is an id or a name known to the param list. elements are the
+ * array indexes to send, in order. Values are multiplied by scale.
+ */
+
 #include <param/param.h>
 #include <param/param_client.h>
+#include <param/param_list.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -11,68 +40,346 @@
 #include <slash/slash.h>
 #include <slash/optparse.h>
 #include "param_sniffer.h"
+#include "vts.h"
 
-static int adcs_node = 0;
-static char *default_ip = "127.0.0.1";
+#define VTS_MAP_MAX         64
+#define VTS_VALUES_MAX      16
+#define VTS_ENTITY_MAX      64
+#define VTS_BATCH_SIZE      (32 * 1024)
+#define VTS_POLL_MS         100
 
 #define Q_HAT_ID 305
 #define ORBIT_POS 357
 
-int sockfd;
-struct sockaddr_in server_addr;
+typedef struct {
+    uint16_t node;
+    uint16_t id;
+    char entity[VTS_ENTITY_MAX];
+    uint8_t elements[VTS_VALUES_MAX];
+    unsigned int count;
+    double scale;
+
+    /* Newest values, guarded by vts_lock */
+    double values[VTS_VALUES_MAX];
+    uint32_t seen;              // Bit per array index received
+    uint64_t time_ms;
+    int dirty;
+    unsigned int sent;
+    unsigned int coalesced;     // Updates overwritten before they were sent
+} vts_map_t;
+
+static int adcs_node = 0;
+static char *default_ip = "127.0.0.1";
+
+static int sockfd = -1;
+static struct sockaddr_in server_addr;
 
 int vts_running = 0;
 
-static double to_jd(uint64_t ts_s) {
-	return 2440587.5 + ((ts_s) / 86400.0);
+static pthread_mutex_t vts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vts_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t vts_thread;
+static int vts_thread_started;
+static vts_map_t vts_map[VTS_MAP_MAX];
+static unsigned int vts_map_count;
+static unsigned int vts_dirty;
+static const char vts_init_cmd[] = "INIT adcs REGULATING\n";
+
+static double to_jd(uint64_t time_ms) {
+    return 2440587.5 + (time_ms / 86400000.0);
 }
 
-int check_vts(uint16_t node, uint16_t id){
-    if(!vts_running)
-        return 0;
-    if(node != adcs_node)
+/* Call with vts_lock held */
+static vts_map_t * vts_find(uint16_t node, uint16_t id) {
+    for (unsigned int i = 0; i < vts_map_count; i++) {
+        if (vts_map[i].node == node && vts_map[i].id == id) {
+            return &vts_map[i];
+        }
+    }
+    return NULL;
+}
+
+int check_vts(uint16_t node, uint16_t id) {
+    if (!vts_running)
         return 0;
-    if(id == Q_HAT_ID || id == ORBIT_POS)
-        return true;
+    pthread_mutex_lock(&vts_lock);
+    int found = vts_find(node, id) != NULL;
+    pthread_mutex_unlock(&vts_lock);
+    return found;
+}
+
+void vts_add_sample(const param_sniffer_sample_t * sample) {
+
+    pthread_mutex_lock(&vts_lock);
+
+    vts_map_t * map = vts_find(sample->param->node, sample->param->id);
+    if (map == NULL || sample->idx >= VTS_VALUES_MAX) {
+        pthread_mutex_unlock(&vts_lock);
+        return;
+    }
+    map->values[sample->idx] = param_sniffer_value_double(sample);
+    map->seen |= 1u << sample->idx;
+
+    /* A frame is due once the run ends and every element has a value */
+    int complete = 1;
+    for (unsigned int i = 0; i < map->count; i++) {
+        if (!(map->seen & (1u << map->elements[i]))) {
+            complete = 0;
+        }
+    }
+    if (complete && sample->idx == sample->offset + sample->count - 1) {
+        map->time_ms = sample->time_ms;
+        if (map->dirty) {
+            map->coalesced++;
+        } else {
+            map->dirty = 1;
+            vts_dirty++;
+            pthread_cond_signal(&vts_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&vts_lock);
+
+}
+
+/* Formats a TIME line at the newest sample and a DATA line per dirty
+ * entity into out. Entities that do not fit stay dirty for the next batch.
+ * Call with vts_lock held */
+static size_t vts_format(char * out, size_t size) {
+
+    uint64_t time_ms = 0;
+    for (unsigned int i = 0; i < vts_map_count; i++) {
+        if (vts_map[i].dirty && vts_map[i].time_ms > time_ms) {
+            time_ms = vts_map[i].time_ms;
+        }
+    }
+
+    size_t len = snprintf(out, size, "TIME %.9f 1\n", to_jd(time_ms) - 2433282.5);
+
+    for (unsigned int i = 0; i < vts_map_count; i++) {
+        vts_map_t * map = &vts_map[i];
+        if (!map->dirty) {
+            continue;
+        }
+
+        size_t start = len;
+        len += snprintf(out + len, size - len, "DATA %.9f %s \"", to_jd(map->time_ms) - 2433282.5, map->entity);
+        for (unsigned int j = 0; j < map->count && len < size; j++) {
+            len += snprintf(out + len, size - len, j ? " %f" : "%f", map->values[map->elements[j]] * map->scale);
+        }
+        if (len < size) {
+            len += snprintf(out + len, size - len, "\"\n");
+        }
+        if (len >= size) {
+            len = start;
+            break;
+        }
+
+        map->dirty = 0;
+        map->sent++;
+        vts_dirty--;
+    }
+
+    return len;
+
+}
+
+/* Sends all of buf, waiting for the socket while streaming is on. Returns -1 on error or stop */
+static int vts_send(const char * buf, size_t len) {
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t sent = send(sockfd, buf + done, len - done, MSG_NOSIGNAL);
+        if (sent > 0) {
+            done += sent;
+            continue;
+        }
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        struct pollfd pfd = {.fd = sockfd, .events = POLLOUT};
+        if (poll(&pfd, 1, VTS_POLL_MS) < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (!__atomic_load_n(&vts_running, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+    }
     return 0;
+
+}
+
+static void * vts_writer(void * arg) {
+
+    char * batch = malloc(VTS_BATCH_SIZE);
+    int failed = batch == NULL || vts_send(vts_init_cmd, sizeof(vts_init_cmd) - 1) < 0;
+
+    pthread_mutex_lock(&vts_lock);
+    while (vts_running && !failed) {
+        if (vts_dirty == 0) {
+            pthread_cond_wait(&vts_cond, &vts_lock);
+            continue;
+        }
+        size_t len = vts_format(batch, VTS_BATCH_SIZE);
+        pthread_mutex_unlock(&vts_lock);
+        failed = vts_send(batch, len) < 0;
+        pthread_mutex_lock(&vts_lock);
+    }
+    if (failed && vts_running) {
+        printf("VTS connection lost\n");
+    }
+    vts_running = 0;
+    pthread_mutex_unlock(&vts_lock);
+
+    free(batch);
+    close(sockfd);
+    sockfd = -1;
+    return NULL;
+
 }
 
-void vts_add(double arr[4], uint16_t id, int count, uint64_t time_ms){
-    char buf[1000];
-    uint64_t timestamp = time_ms / 1000;
-    double jd_cnes = to_jd(timestamp) - 2433282.5;
-    sprintf(buf, "TIME %f 1\n", jd_cnes);
-    //printf("%s", buf);
-    if(send(sockfd, buf, strlen(buf), MSG_NOSIGNAL) == -1){
-        printf("VTS send failed!\n");
+static void vts_stop(void) {
+
+    pthread_mutex_lock(&vts_lock);
+    vts_running = 0;
+    pthread_cond_signal(&vts_cond);
+    pthread_mutex_unlock(&vts_lock);
+
+    if (vts_thread_started) {
+        pthread_join(vts_thread, NULL);
+        vts_thread_started = 0;
     }
 
-    if(id == Q_HAT_ID && count == 4){
-        sprintf(buf, "DATA %f orbit_sim_quat \"%f %f %f %f\"\n", jd_cnes, arr[3], arr[0], arr[1], arr[2]);
-        //printf("%s", buf);
-        if(send(sockfd, buf, strlen(buf), MSG_NOSIGNAL) == -1){
-            printf("VTS send failed!\n");
+}
+
+/* Parses "3,0,1,2" into elements. Returns the count, or -1 */
+static int vts_parse_elements(const char * str, uint8_t * elements) {
+
+    int count = 0;
+    while (*str) {
+        char * end;
+        unsigned long idx = strtoul(str, &end, 10);
+        if (end == str || idx >= VTS_VALUES_MAX || count == VTS_VALUES_MAX) {
+            return -1;
+        }
+        elements[count++] = idx;
+        str = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
         }
     }
+    return count;
+
+}
+
+/* Replaces the mapping table with the one in path. Returns 0 or -1 */
+static int vts_load(const char * path) {
+
+    FILE * file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    static vts_map_t loaded[VTS_MAP_MAX];
+    unsigned int count = 0;
+    char line[256];
+    unsigned int lineno = 0;
+    int err = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        char * comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
 
-    if(id == ORBIT_POS && count == 3){
-        sprintf(buf, "DATA %f orbit_prop_pos \"%f %f %f\"\n", jd_cnes, arr[0]/1000, arr[1]/1000, arr[2]/1000); // convert to km
-        //printf("%s", buf);
-        if(send(sockfd, buf, strlen(buf), MSG_NOSIGNAL) == -1){
-            printf("VTS send failed!\n");
+        unsigned int node;
+        char param[64], entity[VTS_ENTITY_MAX], elements[64];
+        double scale = 1;
+        int fields = sscanf(line, "%u %63s %63s %63s %lf", &node, param, entity, elements, &scale);
+        if (fields <= 0) {
+            continue;
         }
+        if (fields < 4 || count == VTS_MAP_MAX) {
+            printf("%s:%u: expected <node> <param> <entity> <elements> [scale]\n", path, lineno);
+            err = -1;
+            break;
+        }
+
+        vts_map_t * map = &loaded[count];
+        memset(map, 0, sizeof(*map));
+        map->node = node;
+        map->scale = scale;
+        strcpy(map->entity, entity);
+
+        if (isdigit((unsigned char) param[0])) {
+            map->id = atoi(param);
+        } else {
+            param_t * found = param_list_find_name(node, param);
+            if (found == NULL) {
+                printf("%s:%u: unknown param %s on node %u\n", path, lineno, param, node);
+                err = -1;
+                break;
+            }
+            map->id = found->id;
+        }
+
+        int n = vts_parse_elements(elements, map->elements);
+        if (n <= 0) {
+            printf("%s:%u: bad element list %s\n", path, lineno, elements);
+            err = -1;
+            break;
+        }
+        map->count = n;
+        count++;
+    }
+    fclose(file);
+
+    if (err < 0) {
+        return -1;
     }
+
+    pthread_mutex_lock(&vts_lock);
+    memcpy(vts_map, loaded, count * sizeof(vts_map_t));
+    vts_map_count = count;
+    vts_dirty = 0;
+    pthread_mutex_unlock(&vts_lock);
+    printf("Loaded %u VTS entities from %s\n", count, path);
+    return 0;
+
+}
+
+/* The attitude and orbit of the ADCS node, as streamed before tables */
+static void vts_load_default(void) {
+
+    static const vts_map_t builtin[] = {
+        {.id = Q_HAT_ID, .entity = "orbit_sim_quat", .elements = {3, 0, 1, 2}, .count = 4, .scale = 1},
+        {.id = ORBIT_POS, .entity = "orbit_prop_pos", .elements = {0, 1, 2}, .count = 3, .scale = 0.001}, // convert to km
+    };
+
+    pthread_mutex_lock(&vts_lock);
+    vts_map_count = sizeof(builtin) / sizeof(builtin[0]);
+    for (unsigned int i = 0; i < vts_map_count; i++) {
+        vts_map[i] = builtin[i];
+        vts_map[i].node = adcs_node;
+    }
+    vts_dirty = 0;
+    pthread_mutex_unlock(&vts_lock);
+
 }
 
 static int vts_init(struct slash * slash) {
     char * server_ip = NULL;
+    char * map_file = NULL;
     int port_num = 8888;
 
     optparse_t * parser = optparse_new("vts init", "");
     optparse_add_help(parser);
     optparse_add_string(parser, 's', "server-ip", "STRING", &server_ip, "Overwrite default ip 127.0.0.1");
     optparse_add_int(parser, 'p', "server-port", "NUM", 0, &port_num, "Overwrite default port 8888");
-    optparse_add_int(parser, 'n', "adcs-node", "NUM", 0, &adcs_node, "Set adcs node");
+    optparse_add_int(parser, 'n', "adcs-node", "NUM", 0, &adcs_node, "Set adcs node, for the default mapping");
+    optparse_add_string(parser, 'm', "map", "FILE", &map_file, "Load the param to entity mapping from FILE");
 
     int argi = optparse_parse(parser, slash->argc - 1, (const char **)slash->argv + 1);
 
@@ -81,16 +388,27 @@ static int vts_init(struct slash * slash) {
         return SLASH_EINVAL;
     }
 
+    vts_stop();
+
+    if (map_file) {
+        if (vts_load(map_file) < 0) {
+            optparse_del(parser);
+            return SLASH_EINVAL;
+        }
+    } else {
+        vts_load_default();
+    }
+
     if(!server_ip){
         server_ip = default_ip;
     }
 
-	sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sockfd < 0) {
-		printf("Failed to get socket for VTS\n");
+    sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sockfd < 0) {
+        printf("Failed to get socket for VTS\n");
         optparse_del(parser);
-		return SLASH_EINVAL;
-	}
+        return SLASH_EINVAL;
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -98,32 +416,76 @@ static int vts_init(struct slash * slash) {
 
     if(inet_pton(AF_INET, server_ip, &server_addr.sin_addr)<=0) {
         printf("Invalid address/ Address not supported\n");
-		close(sockfd);
+        close(sockfd);
         optparse_del(parser);
-		return SLASH_EINVAL;
+        return SLASH_EINVAL;
     }
 
     if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         printf("Connection failed\n");
-		close(sockfd);
+        close(sockfd);
         optparse_del(parser);
-		return SLASH_EINVAL;
+        return SLASH_EINVAL;
     }
 
-	const char * init_cmd = "INIT adcs REGULATING\n";
-	if (send(sockfd, init_cmd, strlen(init_cmd), MSG_NOSIGNAL) == -1) {
-		printf("Failed to send init\n");
-		close(sockfd);
-        optparse_del(parser);
-		return SLASH_EINVAL;
-    }
+    /* From here on only the writer touches the socket */
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 
     param_sniffer_init(0, 0);
-    printf("Streaming data to VTS at %s:%d\n", server_ip,port_num);
     vts_running = 1;
+    if (pthread_create(&vts_thread, NULL, vts_writer, NULL) != 0) {
+        printf("Failed to start VTS writer\n");
+        vts_running = 0;
+        close(sockfd);
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+    vts_thread_started = 1;
+    printf("Streaming data to VTS at %s:%d\n", server_ip,port_num);
 
     optparse_del(parser);
     return SLASH_SUCCESS;
 }
 slash_command_sub(vts, init, vts_init, "", "Push data to VTS");
 
+static int vts_stop_cmd(struct slash * slash) {
+    vts_stop();
+    return SLASH_SUCCESS;
+}
+slash_command_sub(vts, stop, vts_stop_cmd, "", "Stop pushing data to VTS");
+
+static int vts_map_cmd(struct slash * slash) {
+
+    char * map_file = NULL;
+
+    optparse_t * parser = optparse_new("vts map", "");
+    optparse_add_help(parser);
+    optparse_add_string(parser, 'f', "file", "FILE", &map_file, "Replace the mapping with the one in FILE");
+
+    int argi = optparse_parse(parser, slash->argc - 1, (const char **)slash->argv + 1);
+    if (argi < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    if (map_file && vts_load(map_file) < 0) {
+        optparse_del(parser);
+        return SLASH_EINVAL;
+    }
+
+    pthread_mutex_lock(&vts_lock);
+    for (unsigned int i = 0; i < vts_map_count; i++) {
+        vts_map_t * map = &vts_map[i];
+        printf("%3u %4u %-24s ", map->node, map->id, map->entity);
+        for (unsigned int j = 0; j < map->count; j++) {
+            printf(j ? ",%u" : "%u", map->elements[j]);
+        }
+        printf(" x%g, %u sent, %u coalesced\n", map->scale, map->sent, map->coalesced);
+    }
+    pthread_mutex_unlock(&vts_lock);
+
+    optparse_del(parser);
+    return SLASH_SUCCESS;
+
+}
+slash_command_sub(vts, map, vts_map_cmd, "", "Show or load the param to VTS entity mapping");
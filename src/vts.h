@@ -1,8 +1,12 @@
-
 #pragma once
 
 #include <param/param.h>
 #include <stdint.h>
 
+#include "param_sniffer.h"
+
+/* Returns 1 if param is mapped to a VTS entity and streaming is on */
 int check_vts(uint16_t node, uint16_t id);
-void vts_add(double arr[4], uint16_t id, int count, uint64_t time_ms);
+
+/* Called on the vts sink thread. Only stores the value, the writer thread sends it */
+void vts_add_sample(const param_sniffer_sample_t * sample);
@@ -20,6 +20,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <zmq.h>
 #include <assert.h>
 #include <pthread.h>
@@ -29,11 +33,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <signal.h>
+
+#include "csp_capture.h"
+#include "zmqproxy_traffic.h"
 
 #define CURVE_KEYLEN 41
+#define CAPTURE_BATCH 256
+#define CAPTURE_POLL_MS 100
 
-int csp_id_strip(csp_packet_t * packet);
-int csp_id_setup_rx(csp_packet_t * packet);
 extern csp_conf_t csp_conf;
 
 int debug = 0;
@@ -43,12 +52,39 @@ void *ctx = NULL;
 void *frontend = NULL;
 void *backend = NULL;
 char * logfile_name = NULL;
-FILE * logfile;
+log_writer_t * capture;
+pthread_t capture_thread;
+/* Set on SIGINT or SIGTERM, the capture task exits within CAPTURE_POLL_MS */
+int capture_stop = 0;
+sigset_t capture_signals;
+/* Port of the traffic statistics endpoint, 0 = off */
+int traffic_port = 0;
 /* Auth flag set if -a arg set */
 int auth = 0;
 /* Buffer to hold the secret key. 41 is the length of a z85-encoded CURVE key plus 1 for the null terminator. */
 char sec_key[CURVE_KEYLEN] = {0};
 
+/* With -n, the proxy runs as several shards, each an XSUB/XPUB pair on its
+ * own thread. Shard i binds the configured endpoints with their ports
+ * raised by i, so existing clients stay on shard 0 while new ones can be
+ * spread over the others. Every shard hands what its publishers send to
+ * the other shards over inproc, so each subscriber still sees all traffic.
+ * Subscriptions are not forwarded upstream in this mode: the shards take
+ * everything from their publishers and the XPUBs filter per subscriber. */
+#define SHARD_BATCH     256
+#define SHARD_HWM       100000
+
+typedef struct {
+    void * xsub;
+    void * xpub;
+    void * bus_pub;             // To the other shards
+    void * bus_sub;             // From the other shards
+} shard_t;
+
+int shard_count = 1;
+int io_threads = 1;
+shard_t * shards = NULL;
+
 /* Read one event off the monitor socket; return value and address
 by reference, if not null, and event number by value. Returns -1
 in case of error. */
@@ -172,9 +208,19 @@ static void * task_monitor_frontend(void *arg) {
     }
 }
 
+/* Stops the capture task, then flushes and closes the capture before exiting */
+static void * task_signals(void *arg) {
+    int sig;
+    sigwait(arg, &sig);
+    __atomic_store_n(&capture_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(capture_thread, NULL);
+    log_writer_close(capture);
+    exit(0);
+}
+
 static void * task_capture(void *arg) {
 
-	printf("Capture/logging task listening on %s\n", sub_str);
+	printf("Capture/logging task listening on %s\n", pub_str);
     /* Subscriber (RX) */
     void *subscriber = zmq_socket(ctx, ZMQ_SUB);
     if(auth){
@@ -186,60 +232,200 @@ static void * task_capture(void *arg) {
     }
     assert(zmq_connect(subscriber, pub_str) == 0);
     assert(zmq_setsockopt(subscriber, ZMQ_SUBSCRIBE, "", 0) == 0);
+    int poll_ms = CAPTURE_POLL_MS;
+    zmq_setsockopt(subscriber, ZMQ_RCVTIMEO, &poll_ms, sizeof(poll_ms));
 
-    /* Allocated 'raw' CSP packet */
-    csp_packet_t * packet = malloc(CSP_ZMQ_MTU + 16);
-    assert(packet != NULL);
+    /* One message for every receive: zmq_msg_recv() releases the previous
+     * frame, and the frame is only ever read where ZMQ put it */
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
 
-    if (logfile_name) {
-    	logfile = fopen(logfile_name, "a+");
-    	if (logfile == NULL) {
-    		printf("Unable to open logfile %s\n", logfile_name);
-    		exit(-1);
-    	}
-    }
+    /* Headers are only parsed for printing and the statistics */
+    int print = debug && !capture;
 
-    while (1) {
-    	zmq_msg_t msg;
-        zmq_msg_init_size(&msg, CSP_ZMQ_MTU + 16);
+    while (!__atomic_load_n(&capture_stop, __ATOMIC_ACQUIRE)) {
 
-        /* Receive data */
+        /* Wait for one message, then drain what is queued behind it */
         if (zmq_msg_recv(&msg, subscriber, 0) < 0) {
-            zmq_msg_close(&msg);
-            printf("ZMQ: %s\n", zmq_strerror(zmq_errno()));
+            if (zmq_errno() != EAGAIN)
+                printf("ZMQ: %s\n", zmq_strerror(zmq_errno()));
             continue;
         }
 
-        int datalen = zmq_msg_size(&msg);
-        if (datalen < 5) {
-            printf("ZMQ: Too short datalen: %u\n", datalen);
-            while(zmq_msg_recv(&msg, subscriber, ZMQ_NOBLOCK) > 0)
-                zmq_msg_close(&msg);
-            continue;
-        }
+        /* Messages drained together were queued at about the same time */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t time_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+        int batch = 0;
+        do {
+            const uint8_t * frame = zmq_msg_data(&msg);
+            int datalen = zmq_msg_size(&msg);
 
-        /* Copy to packet */
-        csp_id_setup_rx(packet);
-        memcpy(packet->frame_begin, zmq_msg_data(&msg), datalen);
-        packet->frame_length = datalen;
+            /* Recording only needs the frame as received, the writer thread does the I/O */
+            if (capture) {
+                csp_capture_add(capture, time_ns, frame, datalen);
+            }
+            if (!print && !traffic_port) {
+                continue;
+            }
 
-        /* Parse header */
-        csp_id_strip(packet);
+            csp_capture_header_t id;
+            size_t header = csp_capture_header(csp_conf.version, frame, datalen, &id);
+            if (header == 0) {
+                if (traffic_port)
+                    traffic_short();
+                if (print)
+                    printf("ZMQ: Too short datalen: %u\n", datalen);
+                continue;
+            }
+
+            if (traffic_port) {
+                traffic_count(id.src, id.dst, id.dport, datalen);
+            }
+            if (!print) {
+                continue;
+            }
+
+            /* Print header data */
+            printf("Packet: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %d\n",
+                   id.src, id.dst, id.dport, id.sport, id.pri, id.flags, (int) (datalen - header));
+
+        } while (++batch < CAPTURE_BATCH && zmq_msg_recv(&msg, subscriber, ZMQ_DONTWAIT) >= 0);
+    }
+
+    zmq_msg_close(&msg);
+    zmq_close(subscriber);
+    return NULL;
+}
+
+/* Writes endpoint with its port raised by offset to out. Returns -1 if it has no port */
+static int shard_endpoint(char * out, size_t size, const char * endpoint, int offset) {
+    const char * colon = strrchr(endpoint, ':');
+    if (colon == NULL || !isdigit((unsigned char) colon[1])) {
+        return -1;
+    }
+    snprintf(out, size, "%.*s:%d", (int) (colon - endpoint), endpoint, atoi(colon + 1) + offset);
+    return 0;
+}
+
+static void secure_socket(void * socket) {
+    int as_server = 1;
+    zmq_setsockopt(socket, ZMQ_CURVE_SERVER, &as_server, sizeof(int));
+    zmq_setsockopt(socket, ZMQ_CURVE_SECRETKEY, sec_key, CURVE_KEYLEN);
+}
+
+/* Moves one message, all its frames, from in to out and, if set, to copy.
+ * The copy shares the data of the original. out NULL drops the message.
+ * Returns -1 if nothing was waiting */
+static int shard_forward(void * in, void * out, void * copy) {
+    int more;
+    do {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, in, ZMQ_DONTWAIT) < 0) {
+            zmq_msg_close(&msg);
+            return -1;
+        }
+        more = zmq_msg_more(&msg);
+        if (copy) {
+            zmq_msg_t dup;
+            zmq_msg_init(&dup);
+            zmq_msg_copy(&dup, &msg);
+            if (zmq_msg_send(&dup, copy, more ? ZMQ_SNDMORE : 0) < 0)
+                zmq_msg_close(&dup);
+        }
+        if (out == NULL || zmq_msg_send(&msg, out, more ? ZMQ_SNDMORE : 0) < 0)
+            zmq_msg_close(&msg);
+    } while (more);
+    return 0;
+}
 
+static void * task_shard(void * arg) {
+    shard_t * shard = arg;
+    zmq_pollitem_t items[] = {
+        {shard->xsub, 0, ZMQ_POLLIN, 0},
+        {shard->bus_sub, 0, ZMQ_POLLIN, 0},
+        {shard->xpub, 0, ZMQ_POLLIN, 0},
+    };
 
-        /* Print header data */
-        printf("Packet: Src %u, Dst %u, Dport %u, Sport %u, Pri %u, Flags 0x%02X, Size %"PRIu16"\n",
-                       packet->id.src, packet->id.dst, packet->id.dport,
-                       packet->id.sport, packet->id.pri, packet->id.flags, packet->length);
+    while (1) {
+        if (zmq_poll(items, 3, -1) < 0) {
+            if (zmq_errno() == ETERM)
+                break;
+            continue;
+        }
+        /* In batches, so a busy socket cannot starve the others */
+        for (int i = 0; (items[0].revents & ZMQ_POLLIN) && i < SHARD_BATCH; i++) {
+            if (shard_forward(shard->xsub, shard->xpub, shard->bus_pub) < 0)
+                break;
+        }
+        for (int i = 0; (items[1].revents & ZMQ_POLLIN) && i < SHARD_BATCH; i++) {
+            if (shard_forward(shard->bus_sub, shard->xpub, NULL) < 0)
+                break;
+        }
+        /* Subscriptions, not needed upstream */
+        for (int i = 0; (items[2].revents & ZMQ_POLLIN) && i < SHARD_BATCH; i++) {
+            if (shard_forward(shard->xpub, NULL, NULL) < 0)
+                break;
+        }
+    }
+    return NULL;
+}
 
-        if (logfile) {
-        	const char * delimiter = "--------\n";
-        	fwrite(delimiter, sizeof(delimiter), 1, logfile);
-        	fwrite(packet->frame_begin, packet->frame_length, 1, logfile);
-        	fflush(logfile);
+/* Sets up the shards around frontend and backend, which become shard 0 */
+static void shards_init(void) {
+    shards = calloc(shard_count, sizeof(shard_t));
+    assert(shards);
+    int hwm = SHARD_HWM;
+
+    for (int i = 0; i < shard_count; i++) {
+        shard_t * shard = &shards[i];
+        if (i == 0) {
+            shard->xsub = frontend;
+            shard->xpub = backend;
+        } else {
+            char sub[256], pub[256];
+            if (shard_endpoint(sub, sizeof(sub), sub_str, i) < 0 || shard_endpoint(pub, sizeof(pub), pub_str, i) < 0) {
+                printf("Sharding needs endpoints with a port\n");
+                exit(1);
+            }
+            shard->xsub = zmq_socket(ctx, ZMQ_XSUB);
+            assert(shard->xsub);
+            shard->xpub = zmq_socket(ctx, ZMQ_XPUB);
+            assert(shard->xpub);
+            if (auth) {
+                secure_socket(shard->xsub);
+                secure_socket(shard->xpub);
+            }
+            assert(zmq_bind(shard->xsub, sub) == 0);
+            assert(zmq_bind(shard->xpub, pub) == 0);
+            printf("Shard %d listening on %s and %s\n", i, sub, pub);
         }
+        /* Take everything the publishers send */
+        zmq_send(shard->xsub, "\x01", 1, 0);
+
+        char bus[64];
+        snprintf(bus, sizeof(bus), "inproc://zmqproxy-shard-%d", i);
+        shard->bus_pub = zmq_socket(ctx, ZMQ_PUB);
+        assert(shard->bus_pub);
+        zmq_setsockopt(shard->bus_pub, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+        assert(zmq_bind(shard->bus_pub, bus) == 0);
+    }
 
-        zmq_msg_close(&msg);
+    for (int i = 0; i < shard_count; i++) {
+        shard_t * shard = &shards[i];
+        shard->bus_sub = zmq_socket(ctx, ZMQ_SUB);
+        assert(shard->bus_sub);
+        zmq_setsockopt(shard->bus_sub, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+        zmq_setsockopt(shard->bus_sub, ZMQ_SUBSCRIBE, "", 0);
+        for (int j = 0; j < shard_count; j++) {
+            if (j == i)
+                continue;
+            char bus[64];
+            snprintf(bus, sizeof(bus), "inproc://zmqproxy-shard-%d", j);
+            assert(zmq_connect(shard->bus_sub, bus) == 0);
+        }
     }
 }
 
@@ -248,7 +434,7 @@ int main(int argc, char ** argv) {
 	csp_conf.version = 2;
 
     int opt;
-    while ((opt = getopt(argc, argv, "dhagv:s:p:f:")) != -1) {
+    while ((opt = getopt(argc, argv, "dhagv:s:p:f:n:t:m:")) != -1) {
         switch (opt) {
             case 'd':
                 debug = 1;
@@ -268,6 +454,15 @@ int main(int argc, char ** argv) {
             case 'a':
                 auth = 1;
                 break;
+            case 'n':
+                shard_count = atoi(optarg);
+                break;
+            case 't':
+                io_threads = atoi(optarg);
+                break;
+            case 'm':
+                traffic_port = atoi(optarg);
+                break;
             case 'g':{
                 char public_key[CURVE_KEYLEN], secret_key[CURVE_KEYLEN];
                 zmq_curve_keypair(public_key, secret_key);
@@ -280,9 +475,12 @@ int main(int argc, char ** argv) {
                 	   " -v VERSION\tcsp version\n"
                 	   " -s SUB_STR\tsubscriber port: tcp://localhost:7000\n"
                 	   " -p PUB_STR\tpublisher  port: tcp://localhost:6000\n"
-                	   " -f LOGFILE\tLog to this file\n"
+                	   " -f LOGFILE\tRecord packets to this CSP capture, see csp_capture_dump\n"
                 	   " -a AUTH\tEnable authentication and encryption\n"
                 	   " -g GEN \tGenerate keypair\n"
+                	   " -n SHARDS\tRun SHARDS proxy threads, on consecutive ports\n"
+                	   " -t THREADS\tZMQ I/O threads (default 1)\n"
+                	   " -m PORT\tServe per node traffic statistics on PORT at /metrics\n"
                 		);
                 exit(1);
                 break;
@@ -291,6 +489,9 @@ int main(int argc, char ** argv) {
 
     ctx = zmq_ctx_new();
     assert(ctx);
+    if (io_threads > 1) {
+        zmq_ctx_set(ctx, ZMQ_IO_THREADS, io_threads);
+    }
 
     frontend = zmq_socket(ctx, ZMQ_XSUB);
     assert(frontend);
@@ -323,12 +524,8 @@ int main(int argc, char ** argv) {
         }
         fclose(file);
 
-        int as_server = 1;
-        zmq_setsockopt(frontend, ZMQ_CURVE_SERVER, &as_server, sizeof(int));
-        zmq_setsockopt(frontend, ZMQ_CURVE_SECRETKEY, sec_key, CURVE_KEYLEN);
-
-        zmq_setsockopt(backend, ZMQ_CURVE_SERVER, &as_server, sizeof(int));
-        zmq_setsockopt(backend, ZMQ_CURVE_SECRETKEY, sec_key, CURVE_KEYLEN);
+        secure_socket(frontend);
+        secure_socket(backend);
     }
 
     assert(zmq_bind (frontend, sub_str) == 0);
@@ -336,16 +533,59 @@ int main(int argc, char ** argv) {
     assert(zmq_bind(backend, pub_str) == 0);
     printf("Publisher task listening on %s\n", pub_str);
 
+    if (shard_count > 1) {
+        shards_init();
+    }
+
+    /* With a capture file, packets are recorded instead of printed */
+    if (logfile_name) {
+        /* Handled on their own thread, which can safely flush the capture.
+         * Blocked first, so the writer thread inherits the mask */
+        sigemptyset(&capture_signals);
+        sigaddset(&capture_signals, SIGINT);
+        sigaddset(&capture_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &capture_signals, NULL);
+
+        capture = csp_capture_create(logfile_name, csp_conf.version);
+        if (capture == NULL) {
+            printf("Unable to open logfile %s\n", logfile_name);
+            exit(-1);
+        }
+    }
+
+    /* Statistics are counted by the capture task, from what the proxy forwards */
+    if (traffic_port) {
+        if (traffic_init(NULL, traffic_port) < 0) {
+            exit(-1);
+        }
+    }
+
+    if (debug || capture || traffic_port) {
+        pthread_create(&capture_thread, NULL, task_capture, NULL);
+    }
+
+    /* Signals stay pending until the capture task they stop exists */
+    if (capture) {
+        pthread_t sigworker;
+        pthread_create(&sigworker, NULL, task_signals, &capture_signals);
+    }
+
     if(debug){
-        pthread_t capworker;
-        pthread_create(&capworker, NULL, task_capture, NULL);
         pthread_t monfworker;
         pthread_create(&monfworker, NULL, task_monitor_frontend, NULL);
         pthread_t monbworker;
         pthread_create(&monbworker, NULL, task_monitor_backend, NULL);
     }
 
-    zmq_proxy(frontend, backend, NULL);
+    if (shard_count > 1) {
+        for (int i = 1; i < shard_count; i++) {
+            pthread_t shardworker;
+            pthread_create(&shardworker, NULL, task_shard, &shards[i]);
+        }
+        task_shard(&shards[0]);
+    } else {
+        zmq_proxy(frontend, backend, NULL);
+    }
 
     printf("Closing ZMQproxy");
     zmq_ctx_destroy(ctx);
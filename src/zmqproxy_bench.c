@@ -0,0 +1,299 @@
+/*
+ * zmqproxy_bench.c
+ *
+ * Load generator for a running zmqproxy. For 1, 2, 4 .. N publishers, each
+ * with as many subscribers, it sends timestamped messages through the
+ * proxy and reports the rate delivered to the subscribers, the loss and
+ * the latency percentiles. With -k, clients are spread over the shards of
+ * a zmqproxy started with -n, on consecutive ports.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <zmq.h>
+
+#define END_SEQ         UINT32_MAX
+#define JOIN_MS         500
+#define IDLE_MS         2000
+
+typedef struct __attribute__((packed)) {
+    uint64_t sent_ns;
+    uint32_t publisher;
+    uint32_t seq;
+} bench_msg_t;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    void * socket;
+    uint32_t * latency_us;
+    uint64_t received;
+    uint64_t first_ns;
+    uint64_t last_ns;
+} bench_client_t;
+
+static void * ctx;
+static char * sub_str = "tcp://localhost:6000";
+static char * pub_str = "tcp://localhost:7000";
+static int shards = 1;
+static unsigned int messages = 100000;
+static unsigned int size = 64;
+static unsigned int rate = 0;
+static int publishers;
+
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Endpoint of shard index, the port raised by index */
+static void bench_endpoint(char * out, size_t len, const char * endpoint, int index) {
+    const char * colon = strrchr(endpoint, ':');
+    if (colon == NULL || !isdigit((unsigned char) colon[1])) {
+        snprintf(out, len, "%s", endpoint);
+        return;
+    }
+    snprintf(out, len, "%.*s:%d", (int) (colon - endpoint), endpoint, atoi(colon + 1) + index % shards);
+}
+
+static void * bench_publisher(void * arg) {
+    bench_client_t * client = arg;
+    char * buf = calloc(1, size);
+    bench_msg_t * msg = (bench_msg_t *) buf;
+    msg->publisher = client->index;
+
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t start = now_ns();
+    for (unsigned int seq = 0; seq < messages; seq++) {
+        if (rate) {
+            uint64_t due = start + (uint64_t) seq * 1000000000ull / rate;
+            uint64_t now = now_ns();
+            if (now < due) {
+                struct timespec wait = {.tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000};
+                nanosleep(&wait, NULL);
+            }
+        }
+        msg->seq = seq;
+        msg->sent_ns = now_ns();
+        zmq_send(client->socket, buf, size, 0);
+    }
+
+    /* The proxy drops at its high water marks, give the end marker some room */
+    for (int i = 0; i < 3; i++) {
+        usleep(100000);
+        msg->seq = END_SEQ;
+        msg->sent_ns = now_ns();
+        zmq_send(client->socket, buf, size, 0);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void * bench_subscriber(void * arg) {
+    bench_client_t * client = arg;
+    char * buf = malloc(size);
+    char * ended = calloc(publishers, 1);
+    int ended_count = 0;
+
+    pthread_barrier_wait(&start_barrier);
+
+    while (ended_count < publishers) {
+        int len = zmq_recv(client->socket, buf, size, 0);
+        if (len < 0) {
+            break;  // Idle for IDLE_MS, the end markers were lost
+        }
+        if (len < (int) sizeof(bench_msg_t)) {
+            continue;
+        }
+        uint64_t now = now_ns();
+        bench_msg_t * msg = (bench_msg_t *) buf;
+        if (msg->publisher >= (uint32_t) publishers) {
+            continue;
+        }
+        if (msg->seq == END_SEQ) {
+            if (!ended[msg->publisher]) {
+                ended[msg->publisher] = 1;
+                ended_count++;
+            }
+            continue;
+        }
+        if (client->received == 0) {
+            client->first_ns = now;
+        }
+        client->last_ns = now;
+        if (client->received < (uint64_t) publishers * messages) {
+            client->latency_us[client->received] = (now - msg->sent_ns) / 1000;
+        }
+        client->received++;
+    }
+
+    free(ended);
+    free(buf);
+    return NULL;
+}
+
+static int compare_u32(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void bench_run(int count) {
+
+    publishers = count;
+    bench_client_t * pubs = calloc(count, sizeof(bench_client_t));
+    bench_client_t * subs = calloc(count, sizeof(bench_client_t));
+    pthread_barrier_init(&start_barrier, NULL, 2 * count + 1);
+
+    int idle = IDLE_MS;
+    int hwm = 0;
+    for (int i = 0; i < count; i++) {
+        char endpoint[256];
+        subs[i].index = i;
+        subs[i].latency_us = malloc((size_t) count * messages * sizeof(uint32_t));
+        subs[i].socket = zmq_socket(ctx, ZMQ_SUB);
+        zmq_setsockopt(subs[i].socket, ZMQ_SUBSCRIBE, "", 0);
+        zmq_setsockopt(subs[i].socket, ZMQ_RCVTIMEO, &idle, sizeof(idle));
+        zmq_setsockopt(subs[i].socket, ZMQ_RCVHWM, &hwm, sizeof(hwm));
+        bench_endpoint(endpoint, sizeof(endpoint), pub_str, i);
+        zmq_connect(subs[i].socket, endpoint);
+
+        pubs[i].index = i;
+        pubs[i].socket = zmq_socket(ctx, ZMQ_PUB);
+        zmq_setsockopt(pubs[i].socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+        bench_endpoint(endpoint, sizeof(endpoint), sub_str, i);
+        zmq_connect(pubs[i].socket, endpoint);
+    }
+
+    for (int i = 0; i < count; i++) {
+        pthread_create(&subs[i].thread, NULL, bench_subscriber, &subs[i]);
+        pthread_create(&pubs[i].thread, NULL, bench_publisher, &pubs[i]);
+    }
+
+    /* Let the connections and subscriptions settle before sending */
+    usleep(JOIN_MS * 1000);
+    pthread_barrier_wait(&start_barrier);
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(pubs[i].thread, NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(subs[i].thread, NULL);
+    }
+
+    /* Merge the latencies of all subscribers */
+    uint64_t received = 0, first = UINT64_MAX, last = 0;
+    for (int i = 0; i < count; i++) {
+        received += subs[i].received;
+        if (subs[i].received && subs[i].first_ns < first)
+            first = subs[i].first_ns;
+        if (subs[i].last_ns > last)
+            last = subs[i].last_ns;
+    }
+    uint32_t * all = malloc((received ? received : 1) * sizeof(uint32_t));
+    uint64_t n = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t kept = subs[i].received < (uint64_t) count * messages ? subs[i].received : (uint64_t) count * messages;
+        memcpy(all + n, subs[i].latency_us, kept * sizeof(uint32_t));
+        n += kept;
+    }
+    qsort(all, n, sizeof(uint32_t), compare_u32);
+
+    uint64_t expected = (uint64_t) count * count * messages;
+    double seconds = last > first ? (last - first) / 1e9 : 0;
+    printf("%4d %4d %12.0f %7.2f%%", count, count, seconds ? received / seconds : 0,
+           expected ? 100.0 * (expected - (received < expected ? received : expected)) / expected : 0);
+    if (n) {
+        printf(" %8u %8u %8u %8u %8u\n", all[n * 50 / 100], all[n * 90 / 100], all[n * 99 / 100], all[n * 999 / 1000], all[n - 1]);
+    } else {
+        printf(" %8s %8s %8s %8s %8s\n", "-", "-", "-", "-", "-");
+    }
+
+    free(all);
+    for (int i = 0; i < count; i++) {
+        zmq_close(subs[i].socket);
+        zmq_close(pubs[i].socket);
+        free(subs[i].latency_us);
+    }
+    pthread_barrier_destroy(&start_barrier);
+    free(pubs);
+    free(subs);
+
+}
+
+int main(int argc, char ** argv) {
+
+    int max_clients = 4;
+    int io_threads = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hs:p:k:N:m:b:r:t:")) != -1) {
+        switch (opt) {
+            case 's':
+                sub_str = optarg;
+                break;
+            case 'p':
+                pub_str = optarg;
+                break;
+            case 'k':
+                shards = atoi(optarg);
+                break;
+            case 'N':
+                max_clients = atoi(optarg);
+                break;
+            case 'm':
+                messages = atoi(optarg);
+                break;
+            case 'b':
+                size = atoi(optarg);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 't':
+                io_threads = atoi(optarg);
+                break;
+            default:
+                printf("Usage:\n"
+                       " -s SUB_STR\tproxy subscriber port: tcp://localhost:6000\n"
+                       " -p PUB_STR\tproxy publisher port: tcp://localhost:7000\n"
+                       " -k SHARDS\tspread clients over SHARDS consecutive ports (default 1)\n"
+                       " -N CLIENTS\tup to CLIENTS publishers and subscribers (default 4)\n"
+                       " -m COUNT\tmessages per publisher (default 100000)\n"
+                       " -b BYTES\tmessage size (default 64)\n"
+                       " -r RATE\tmessages per second per publisher, 0 = flat out (default 0)\n"
+                       " -t THREADS\tZMQ I/O threads (default 1)\n");
+                exit(1);
+        }
+    }
+    if (shards < 1)
+        shards = 1;
+    if (size < sizeof(bench_msg_t))
+        size = sizeof(bench_msg_t);
+
+    ctx = zmq_ctx_new();
+    zmq_ctx_set(ctx, ZMQ_IO_THREADS, io_threads);
+
+    printf("%u messages of %u bytes per publisher, %s\n", messages, size, rate ? "rate limited" : "flat out");
+    printf("%4s %4s %12s %8s %8s %8s %8s %8s %8s\n", "pubs", "subs", "recv msgs/s", "loss", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    int count = 1;
+    while (1) {
+        bench_run(count);
+        if (count >= max_clients)
+            break;
+        count = count * 2 < max_clients ? count * 2 : max_clients;
+    }
+
+    zmq_ctx_destroy(ctx);
+    return 0;
+}
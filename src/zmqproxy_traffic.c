@@ -0,0 +1,286 @@
+/*
+ * zmqproxy_traffic.c
+ *
+ * Counters are indexed directly by address or port, so counting a frame is
+ * six relaxed atomic adds. Every second the sampler scans the counters and
+ * records the value of each one that has ever been non-zero in a ring of
+ * TRAFFIC_HISTORY samples; a rate over a window is the difference between
+ * the newest sample and the one the window length before it. The HTTP
+ * handler renders under the same lock as the sampler, never the counting
+ * thread's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "zmqproxy_traffic.h"
+#include "http_server.h"
+
+#define TRAFFIC_NODES       16384   // 14 bit CSP 2 addresses, CSP 1 uses the first 32
+#define TRAFFIC_PORTS       64
+#define TRAFFIC_HISTORY     61      // Samples, one per second
+#define TRAFFIC_SERIES_MAX  4096
+#define TRAFFIC_LINE_MAX    1024    // Rendered lines of one series
+
+typedef enum {
+    TRAFFIC_SRC,
+    TRAFFIC_DST,
+    TRAFFIC_PORT,
+    TRAFFIC_KINDS,
+} traffic_kind_e;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytes;
+} traffic_counter_t;
+
+typedef struct {
+    traffic_kind_e kind;
+    unsigned int index;
+    traffic_counter_t history[TRAFFIC_HISTORY];
+} traffic_series_t;
+
+static const struct {
+    const char * name;
+    const char * label;
+    const char * help;
+    unsigned int size;
+} traffic_kinds[TRAFFIC_KINDS] = {
+    [TRAFFIC_SRC] = {"src", "node", "sent by each CSP node", TRAFFIC_NODES},
+    [TRAFFIC_DST] = {"dst", "node", "addressed to each CSP node", TRAFFIC_NODES},
+    [TRAFFIC_PORT] = {"port", "port", "addressed to each CSP port", TRAFFIC_PORTS},
+};
+
+static const unsigned int traffic_windows[] = {10, 60};
+
+/* Written by the capture task */
+static traffic_counter_t traffic_counters[TRAFFIC_KINDS][TRAFFIC_NODES];
+static uint64_t traffic_short_frames;
+
+/* Owned by the sampler, guarded by traffic_lock */
+static pthread_mutex_t traffic_lock = PTHREAD_MUTEX_INITIALIZER;
+static traffic_series_t * traffic_series;
+static unsigned int traffic_series_count;
+static uint16_t traffic_slots[TRAFFIC_KINDS][TRAFFIC_NODES];   // Series index + 1, 0 = none
+static uint64_t traffic_times[TRAFFIC_HISTORY];
+static uint64_t traffic_samples;
+static unsigned int traffic_untracked;
+
+/* Used by the HTTP server thread only */
+static char * traffic_buf;
+static size_t traffic_size;
+
+static uint64_t traffic_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void traffic_add(traffic_counter_t * counter, size_t bytes) {
+    __atomic_fetch_add(&counter->packets, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void traffic_count(unsigned int src, unsigned int dst, unsigned int dport, size_t bytes) {
+    traffic_add(&traffic_counters[TRAFFIC_SRC][src % TRAFFIC_NODES], bytes);
+    traffic_add(&traffic_counters[TRAFFIC_DST][dst % TRAFFIC_NODES], bytes);
+    traffic_add(&traffic_counters[TRAFFIC_PORT][dport % TRAFFIC_PORTS], bytes);
+}
+
+void traffic_short(void) {
+    __atomic_fetch_add(&traffic_short_frames, 1, __ATOMIC_RELAXED);
+}
+
+static void traffic_sample(void) {
+
+    pthread_mutex_lock(&traffic_lock);
+
+    unsigned int slot = traffic_samples % TRAFFIC_HISTORY;
+    traffic_times[slot] = traffic_now_ns();
+    unsigned int untracked = 0;
+
+    for (int kind = 0; kind < TRAFFIC_KINDS; kind++) {
+        for (unsigned int i = 0; i < traffic_kinds[kind].size; i++) {
+            traffic_counter_t now = {
+                .packets = __atomic_load_n(&traffic_counters[kind][i].packets, __ATOMIC_RELAXED),
+                .bytes = __atomic_load_n(&traffic_counters[kind][i].bytes, __ATOMIC_RELAXED),
+            };
+            if (now.packets == 0) {
+                continue;
+            }
+
+            /* Counters only grow, so a new series was zero in every earlier sample */
+            if (traffic_slots[kind][i] == 0) {
+                if (traffic_series_count == TRAFFIC_SERIES_MAX) {
+                    untracked++;
+                    continue;
+                }
+                traffic_series_t * series = &traffic_series[traffic_series_count++];
+                memset(series, 0, sizeof(*series));
+                series->kind = kind;
+                series->index = i;
+                traffic_slots[kind][i] = traffic_series_count;
+            }
+
+            traffic_series[traffic_slots[kind][i] - 1].history[slot] = now;
+        }
+    }
+
+    traffic_untracked = untracked;
+    traffic_samples++;
+    pthread_mutex_unlock(&traffic_lock);
+
+}
+
+static void * traffic_sampler(void * arg) {
+    while (1) {
+        traffic_sample();
+        sleep(1);
+    }
+    return NULL;
+}
+
+/* Makes room for len more bytes after offset. Returns -1 if out of memory */
+static int traffic_reserve(size_t offset, size_t len) {
+    if (offset + len <= traffic_size) {
+        return 0;
+    }
+    size_t size = traffic_size ? traffic_size : 64 * 1024;
+    while (size < offset + len) {
+        size *= 2;
+    }
+    char * grown = realloc(traffic_buf, size);
+    if (grown == NULL) {
+        return -1;
+    }
+    traffic_buf = grown;
+    traffic_size = size;
+    return 0;
+}
+
+static size_t traffic_render(void) {
+
+    size_t len = 0;
+
+    pthread_mutex_lock(&traffic_lock);
+
+    /* Newest sample, and how many came before it. Until a window has
+     * filled, its rate covers the samples there are */
+    uint64_t newest = traffic_samples ? traffic_samples - 1 : 0;
+    uint64_t before = newest < TRAFFIC_HISTORY - 1 ? newest : TRAFFIC_HISTORY - 1;
+
+    for (int kind = 0; kind < TRAFFIC_KINDS; kind++) {
+        const char * name = traffic_kinds[kind].name;
+        const char * help = traffic_kinds[kind].help;
+
+        if (traffic_reserve(len, TRAFFIC_LINE_MAX) < 0)
+            break;
+        len += snprintf(traffic_buf + len, traffic_size - len,
+            "# HELP zmqproxy_%s_packets_total Packets %s\n# TYPE zmqproxy_%s_packets_total counter\n"
+            "# HELP zmqproxy_%s_bytes_total Bytes %s, CSP header included\n# TYPE zmqproxy_%s_bytes_total counter\n"
+            "# HELP zmqproxy_%s_packet_rate Packets per second %s, over the window\n# TYPE zmqproxy_%s_packet_rate gauge\n"
+            "# HELP zmqproxy_%s_byte_rate Bytes per second %s, over the window\n# TYPE zmqproxy_%s_byte_rate gauge\n",
+            name, help, name, name, help, name, name, help, name, name, help, name);
+
+        for (unsigned int s = 0; s < traffic_series_count; s++) {
+            traffic_series_t * series = &traffic_series[s];
+            if (series->kind != (traffic_kind_e) kind)
+                continue;
+
+            if (traffic_reserve(len, TRAFFIC_LINE_MAX) < 0)
+                break;
+            char * out = traffic_buf + len;
+            char * end = traffic_buf + traffic_size;
+
+            /* Totals come from the live counters, rates from the samples */
+            char labels[32];
+            snprintf(labels, sizeof(labels), "%s=\"%u\"", traffic_kinds[kind].label, series->index);
+            traffic_counter_t * counter = &traffic_counters[kind][series->index];
+            out += snprintf(out, end - out, "zmqproxy_%s_packets_total{%s} %"PRIu64"\n", name, labels,
+                            __atomic_load_n(&counter->packets, __ATOMIC_RELAXED));
+            out += snprintf(out, end - out, "zmqproxy_%s_bytes_total{%s} %"PRIu64"\n", name, labels,
+                            __atomic_load_n(&counter->bytes, __ATOMIC_RELAXED));
+
+            for (size_t w = 0; w < sizeof(traffic_windows) / sizeof(traffic_windows[0]); w++) {
+                uint64_t back = traffic_windows[w] < before ? traffic_windows[w] : before;
+                if (back == 0)
+                    break;
+                unsigned int new_slot = newest % TRAFFIC_HISTORY;
+                unsigned int old_slot = (newest - back) % TRAFFIC_HISTORY;
+                double seconds = (traffic_times[new_slot] - traffic_times[old_slot]) / 1e9;
+                traffic_counter_t * a = &series->history[old_slot], * b = &series->history[new_slot];
+                out += snprintf(out, end - out, "zmqproxy_%s_packet_rate{%s,window=\"%us\"} %.3f\n", name, labels,
+                                traffic_windows[w], (b->packets - a->packets) / seconds);
+                out += snprintf(out, end - out, "zmqproxy_%s_byte_rate{%s,window=\"%us\"} %.1f\n", name, labels,
+                                traffic_windows[w], (b->bytes - a->bytes) / seconds);
+            }
+
+            len = out - traffic_buf;
+        }
+    }
+
+    unsigned int untracked = traffic_untracked;
+    pthread_mutex_unlock(&traffic_lock);
+
+    if (traffic_reserve(len, TRAFFIC_LINE_MAX) == 0) {
+        len += snprintf(traffic_buf + len, traffic_size - len,
+            "# HELP zmqproxy_short_frames_total Frames too short for a CSP header\n# TYPE zmqproxy_short_frames_total counter\n"
+            "zmqproxy_short_frames_total %"PRIu64"\n"
+            "# HELP zmqproxy_untracked_series Nodes and ports without rates, series limit reached\n# TYPE zmqproxy_untracked_series gauge\n"
+            "zmqproxy_untracked_series %u\n",
+            __atomic_load_n(&traffic_short_frames, __ATOMIC_RELAXED), untracked);
+    }
+
+    return len;
+
+}
+
+static void traffic_handler(const http_request_t * request, http_response_t * response, void * ctx) {
+
+    if (strcmp(request->method, "GET") != 0 && !request->head) {
+        response->status = 405;
+        response->headers = "Allow: GET, HEAD\r\n";
+        return;
+    }
+
+    if (strcmp(request->path, "/metrics") == 0) {
+        response->content_type = "text/plain; version=0.0.4";
+        response->len = traffic_render();
+        response->body = traffic_buf;
+    } else if (strcmp(request->path, "/health") == 0 || strcmp(request->path, "/-/healthy") == 0) {
+        response->body = "OK\n";
+        response->len = 3;
+    } else {
+        response->status = 404;
+    }
+
+}
+
+int traffic_init(const char * addr, uint16_t port) {
+
+    traffic_series = calloc(TRAFFIC_SERIES_MAX, sizeof(traffic_series_t));
+    if (traffic_series == NULL) {
+        printf("Cannot allocate traffic statistics\n");
+        return -1;
+    }
+
+    pthread_t sampler;
+    if (pthread_create(&sampler, NULL, traffic_sampler, NULL) != 0) {
+        printf("Cannot start traffic sampler\n");
+        return -1;
+    }
+
+    http_server_conf_t conf = {
+        .name = "Traffic statistics",
+        .addr = addr,
+        .port = port,
+        .handler = traffic_handler,
+    };
+    return http_server_start(&conf) ? 0 : -1;
+
+}
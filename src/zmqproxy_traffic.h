@@ -0,0 +1,26 @@
+/*
+ * zmqproxy_traffic.h
+ *
+ * Per node traffic statistics for zmqproxy. The capture task counts every
+ * frame the proxy forwards by CSP source, destination and destination
+ * port, with relaxed atomic adds and no locks. A sampler thread snapshots
+ * the counters once a second, and an HTTP endpoint serves the totals and
+ * the rates over sliding windows in Prometheus text format at /metrics.
+ */
+
+#ifndef SRC_ZMQPROXY_TRAFFIC_H_
+#define SRC_ZMQPROXY_TRAFFIC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Starts the sampler thread and the HTTP server. addr NULL = any */
+int traffic_init(const char * addr, uint16_t port);
+
+/* Counts one frame of bytes, header included */
+void traffic_count(unsigned int src, unsigned int dst, unsigned int dport, size_t bytes);
+
+/* Counts a frame too short to hold a CSP header */
+void traffic_short(void);
+
+#endif /* SRC_ZMQPROXY_TRAFFIC_H_ */